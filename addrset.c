@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pfresolved.h"
+
+/*
+ * Address sets are immutable and shared by all hosts that resolve to the same
+ * addresses. Every distinct set exists only once, so hosts behind the same
+ * load balancer need memory for a single set and identical sets can be
+ * recognized by comparing pointers.
+ *
+ * The addresses of a set are stored as packed keys of a single family, 4 bytes
+ * for IPv4 and 16 bytes for IPv6 in network byte order. They are only turned
+ * into a struct pfresolved_address when they are added to or removed from a
+ * table.
+ */
+
+#define FNV1A_64_INIT	0xcbf29ce484222325ULL
+#define FNV1A_64_PRIME	0x100000001b3ULL
+
+/*
+ * Up to this size insertion sort is fastest. Below the radix limit of a
+ * family qsort(3) is faster than the radix sort, measured with the
+ * benchmark of regress/addrset.
+ */
+#define ADDRSET_INSERTION_SORT	16
+#define ADDRSET_RADIX_SORT4	64
+#define ADDRSET_RADIX_SORT6	128
+
+int	 addrset_cmp(struct pfresolved_addrset *, struct pfresolved_addrset *);
+int	 addrset_qsort_cmp4(const void *, const void *);
+int	 addrset_qsort_cmp6(const void *, const void *);
+void	 addrset_sort_reserve(sa_family_t, int);
+void	 addrset_sort4(struct in_addr *, int);
+void	 addrset_sort6(struct in6_addr *, int);
+
+RB_HEAD(pfresolved_addrsets, pfresolved_addrset);
+RB_PROTOTYPE(pfresolved_addrsets, pfresolved_addrset, pfas_node, addrset_cmp);
+
+static struct pfresolved_addrsets	addrsets = RB_INITIALIZER(&addrsets);
+static int				addrsets_count;
+
+/* scratch space of the radix sort per family, it only grows */
+static uint32_t				*sort_keys4, *sort_tmp4;
+static struct in6_addr			*sort_keys6, *sort_tmp6;
+static int				 sort_size4, sort_size6;
+
+static uint64_t
+fnv1a_64(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t	*p = data;
+
+	while (len-- > 0) {
+		hash ^= *p++;
+		hash *= FNV1A_64_PRIME;
+	}
+
+	return (hash);
+}
+
+uint64_t
+addrset_hash(sa_family_t af, const void *keys, int num)
+{
+	uint64_t	 hash = FNV1A_64_INIT;
+
+	hash = fnv1a_64(hash, &af, sizeof(af));
+	return (fnv1a_64(hash, keys, num * ADDRSET_KEYLEN(af)));
+}
+
+/*
+ * Return the shared set for the sorted keys with a new reference. The keys
+ * are copied if the set does not exist yet. The empty set is NULL.
+ */
+struct pfresolved_addrset *
+addrset_get(sa_family_t af, const void *keys, int num)
+{
+	struct pfresolved_addrset	*set, key;
+	uint64_t			 hash;
+	size_t				 len;
+
+	if (num == 0)
+		return (NULL);
+
+	hash = addrset_hash(af, keys, num);
+	len = num * ADDRSET_KEYLEN(af);
+
+	/* look up with a key that refers to the caller's keys */
+	memset(&key, 0, sizeof(key));
+	key.pfas_hash = hash;
+	key.pfas_num = num;
+	key.pfas_af = af;
+	key.pfas_lookup = keys;
+	set = RB_FIND(pfresolved_addrsets, &addrsets, &key);
+
+	if (set != NULL) {
+		set->pfas_refcnt++;
+		return (set);
+	}
+
+	if ((set = malloc(sizeof(*set) + len)) == NULL)
+		fatal("%s: malloc", __func__);
+	memset(set, 0, sizeof(*set));
+	memcpy(set->pfas_keys, keys, len);
+	set->pfas_hash = hash;
+	set->pfas_num = num;
+	set->pfas_af = af;
+	set->pfas_refcnt = 1;
+	RB_INSERT(pfresolved_addrsets, &addrsets, set);
+	addrsets_count++;
+
+	return (set);
+}
+
+struct pfresolved_addrset *
+addrset_ref(struct pfresolved_addrset *set)
+{
+	if (set != NULL)
+		set->pfas_refcnt++;
+	return (set);
+}
+
+void
+addrset_put(struct pfresolved_addrset *set)
+{
+	if (set == NULL || --set->pfas_refcnt > 0)
+		return;
+
+	RB_REMOVE(pfresolved_addrsets, &addrsets, set);
+	addrsets_count--;
+	free(set);
+}
+
+int
+addrset_count(void)
+{
+	return (addrsets_count);
+}
+
+/*
+ * Convert a key into a host address for a table entry.
+ */
+void
+addrset_address(sa_family_t af, const void *key,
+    struct pfresolved_address *address)
+{
+	memset(address, 0, sizeof(*address));
+	address->pfa_af = af;
+	if (af == AF_INET) {
+		memcpy(&address->pfa_addr.in4, key,
+		    sizeof(address->pfa_addr.in4));
+		address->pfa_prefixlen = 32;
+	} else {
+		memcpy(&address->pfa_addr.in6, key,
+		    sizeof(address->pfa_addr.in6));
+		address->pfa_prefixlen = 128;
+	}
+}
+
+const char *
+addrset_print_key(sa_family_t af, const void *key)
+{
+	static char	 buffer[INET6_ADDRSTRLEN];
+
+	if (inet_ntop(af, key, buffer, sizeof(buffer)) == NULL)
+		return ("(UNKNOWN AF)");
+	return (buffer);
+}
+
+/*
+ * Compare two keys, IPv4 keys as integers in host byte order and IPv6 keys as
+ * 16 byte strings. This is the order of address_cmp().
+ */
+int
+addrset_key_cmp(sa_family_t af, const void *a, const void *b)
+{
+	uint32_t	 ka, kb;
+
+	if (af == AF_INET6)
+		return (memcmp(a, b, sizeof(struct in6_addr)));
+
+	memcpy(&ka, a, sizeof(ka));
+	memcpy(&kb, b, sizeof(kb));
+	ka = ntohl(ka);
+	kb = ntohl(kb);
+	return (ka < kb ? -1 : ka > kb);
+}
+
+/*
+ * Sort keys with a least significant digit radix sort, small arrays with
+ * insertion sort and medium ones with qsort(3).
+ */
+void
+addrset_sort(sa_family_t af, void *keys, int num)
+{
+	uint8_t		*k = keys, tmp[sizeof(struct in6_addr)];
+	size_t		 len = ADDRSET_KEYLEN(af);
+	int		 i, j;
+
+	if (num < 2)
+		return;
+
+	if (num <= ADDRSET_INSERTION_SORT) {
+		for (i = 1; i < num; i++) {
+			memcpy(tmp, k + i * len, len);
+			for (j = i; j > 0 &&
+			    addrset_key_cmp(af, k + (j - 1) * len, tmp) > 0;
+			    j--)
+				memcpy(k + j * len, k + (j - 1) * len, len);
+			memcpy(k + j * len, tmp, len);
+		}
+		return;
+	}
+
+	if (num < (af == AF_INET ? ADDRSET_RADIX_SORT4 : ADDRSET_RADIX_SORT6)) {
+		qsort(keys, num, len, af == AF_INET ? addrset_qsort_cmp4 :
+		    addrset_qsort_cmp6);
+		return;
+	}
+
+	addrset_sort_reserve(af, num);
+	if (af == AF_INET)
+		addrset_sort4(keys, num);
+	else
+		addrset_sort6(keys, num);
+}
+
+int
+addrset_qsort_cmp4(const void *a, const void *b)
+{
+	return (addrset_key_cmp(AF_INET, a, b));
+}
+
+int
+addrset_qsort_cmp6(const void *a, const void *b)
+{
+	return (addrset_key_cmp(AF_INET6, a, b));
+}
+
+void
+addrset_sort_reserve(sa_family_t af, int num)
+{
+	if (af == AF_INET) {
+		if (num <= sort_size4)
+			return;
+		if ((sort_keys4 = reallocarray(sort_keys4, num,
+		    sizeof(*sort_keys4))) == NULL ||
+		    (sort_tmp4 = reallocarray(sort_tmp4, num,
+		    sizeof(*sort_tmp4))) == NULL)
+			fatal("%s: reallocarray", __func__);
+		sort_size4 = num;
+		return;
+	}
+
+	if (num <= sort_size6)
+		return;
+	if ((sort_keys6 = reallocarray(sort_keys6, num,
+	    sizeof(*sort_keys6))) == NULL ||
+	    (sort_tmp6 = reallocarray(sort_tmp6, num,
+	    sizeof(*sort_tmp6))) == NULL)
+		fatal("%s: reallocarray", __func__);
+	sort_size6 = num;
+}
+
+void
+addrset_sort4(struct in_addr *addresses, int num)
+{
+	uint32_t	*keys = sort_keys4, *tmp = sort_tmp4, *swap;
+	int		 count[256];
+	int		 i, shift, b, sum;
+
+	for (i = 0; i < num; i++)
+		keys[i] = ntohl(addresses[i].s_addr);
+
+	for (shift = 0; shift < 32; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < num; i++)
+			count[(keys[i] >> shift) & 0xff]++;
+		/* all keys have the same digit */
+		if (count[(keys[0] >> shift) & 0xff] == num)
+			continue;
+		for (b = 0, sum = 0; b < 256; b++) {
+			i = count[b];
+			count[b] = sum;
+			sum += i;
+		}
+		for (i = 0; i < num; i++)
+			tmp[count[(keys[i] >> shift) & 0xff]++] = keys[i];
+		swap = keys;
+		keys = tmp;
+		tmp = swap;
+	}
+
+	for (i = 0; i < num; i++)
+		addresses[i].s_addr = htonl(keys[i]);
+}
+
+void
+addrset_sort6(struct in6_addr *addresses, int num)
+{
+	struct in6_addr	*keys = sort_keys6, *tmp = sort_tmp6, *swap;
+	int		 count[256];
+	int		 i, pos, b, sum;
+
+	memcpy(keys, addresses, num * sizeof(*keys));
+
+	for (pos = 15; pos >= 0; pos--) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < num; i++)
+			count[keys[i].s6_addr[pos]]++;
+		if (count[keys[0].s6_addr[pos]] == num)
+			continue;
+		for (b = 0, sum = 0; b < 256; b++) {
+			i = count[b];
+			count[b] = sum;
+			sum += i;
+		}
+		for (i = 0; i < num; i++)
+			tmp[count[keys[i].s6_addr[pos]]++] = keys[i];
+		swap = keys;
+		keys = tmp;
+		tmp = swap;
+	}
+
+	memcpy(addresses, keys, num * sizeof(*keys));
+}
+
+int
+addrset_cmp(struct pfresolved_addrset *a, struct pfresolved_addrset *b)
+{
+	const void	*ak, *bk;
+
+	if (a->pfas_hash != b->pfas_hash)
+		return (a->pfas_hash < b->pfas_hash ? -1 : 1);
+	if (a->pfas_num != b->pfas_num)
+		return (a->pfas_num < b->pfas_num ? -1 : 1);
+	if (a->pfas_af != b->pfas_af)
+		return (a->pfas_af < b->pfas_af ? -1 : 1);
+
+	ak = a->pfas_lookup != NULL ? a->pfas_lookup : a->pfas_keys;
+	bk = b->pfas_lookup != NULL ? b->pfas_lookup : b->pfas_keys;
+	return (memcmp(ak, bk, a->pfas_num * ADDRSET_KEYLEN(a->pfas_af)));
+}
+
+RB_GENERATE(pfresolved_addrsets, pfresolved_addrset, pfas_node, addrset_cmp);
@@ -33,6 +33,7 @@
 
 struct ctl_connlist ctl_conns = TAILQ_HEAD_INITIALIZER(ctl_conns);
 uint32_t ctl_peerid;
+int ctl_monitors;
 
 void	 control_accept(int, short, void *);
 struct ctl_conn
@@ -41,10 +42,14 @@ void	 control_close(int, struct control_sock *);
 void	 control_dispatch_imsg(int, short, void *);
 void	 control_imsg_forward(struct imsg *);
 void	 control_imsg_forward_peerid(struct imsg *);
+void	 control_monitor(struct ctl_conn *, struct imsg *);
+int	 control_monitor_match(struct ctl_conn *, struct ctl_event *);
+int	 control_restricted(uint32_t);
 void	 control_run(struct privsep *, struct privsep_proc *, void *);
+int	 control_dispatch_parent(int, struct privsep_proc *, struct imsg *);
 
 static struct privsep_proc procs[] = {
-	{ "parent", PROC_PARENT, NULL }
+	{ "parent", PROC_PARENT, control_dispatch_parent }
 };
 
 void
@@ -210,13 +215,25 @@ control_connbyfd(int fd)
 void
 control_close(int fd, struct control_sock *cs)
 {
-	struct ctl_conn *c;
+	struct pfresolved	*env = pfresolved_env;
+	struct ctl_conn		*c;
 
 	if ((c = control_connbyfd(fd)) == NULL) {
 		log_warn("%s: fd %d: not found", __func__, fd);
 		return;
 	}
 
+	/* the parent stops a dump or import that was not finished */
+	if (c->flags & (CTL_CONN_DUMP | CTL_CONN_IMPORT))
+		proc_compose_imsg(&env->sc_ps, PROC_PARENT, -1, IMSG_CTL_ABORT,
+		    c->peerid, -1, NULL, 0);
+
+	/* the parent only creates events while someone is listening */
+	if ((c->flags & CTL_CONN_NOTIFY) && --ctl_monitors == 0)
+		proc_compose_imsg(&env->sc_ps, PROC_PARENT, -1,
+		    IMSG_CTL_MONITOR, -1, -1, &ctl_monitors,
+		    sizeof(ctl_monitors));
+
 	msgbuf_clear(&c->iev.ibuf.w);
 	TAILQ_REMOVE(&ctl_conns, c, entry);
 
@@ -258,6 +275,12 @@ control_dispatch_imsg(int fd, short event, void *arg)
 			control_close(fd, cs);
 			return;
 		}
+		if ((c->flags & CTL_CONN_THROTTLED) &&
+		    c->iev.ibuf.w.queued < CTL_MSG_LOW_MARK) {
+			c->flags &= ~CTL_CONN_THROTTLED;
+			proc_compose_imsg(&env->sc_ps, PROC_PARENT, -1,
+			    IMSG_CTL_XON, c->peerid, -1, NULL, 0);
+		}
 	}
 
 	for (;;) {
@@ -269,11 +292,17 @@ control_dispatch_imsg(int fd, short event, void *arg)
 		if (n == 0)
 			break;
 
-		control_imsg_forward(&imsg);
-
 		/* record peerid of connection for reply */
 		imsg.hdr.peerid = c->peerid;
 
+		/* the restricted socket can only show information */
+		if (cs->cs_restricted && !control_restricted(imsg.hdr.type)) {
+			log_debug("%s: imsg %d not allowed on restricted socket",
+			    __func__, imsg.hdr.type);
+			imsg_free(&imsg);
+			continue;
+		}
+
 		switch (imsg.hdr.type) {
 		case IMSG_CTL_VERBOSE:
 			IMSG_SIZE_CHECK(&imsg, &v);
@@ -283,8 +312,30 @@ control_dispatch_imsg(int fd, short event, void *arg)
 
 			proc_forward_imsg(&env->sc_ps, &imsg, PROC_PARENT, -1);
 			break;
+		case IMSG_CTL_SHOW_HOSTS:
+		case IMSG_CTL_SHOW_TABLES:
+			c->flags |= CTL_CONN_DUMP;
+			proc_forward_imsg(&env->sc_ps, &imsg, PROC_PARENT, -1);
+			break;
+		case IMSG_CTL_IMPORT_START:
+			c->flags |= CTL_CONN_IMPORT;
+			proc_forward_imsg(&env->sc_ps, &imsg, PROC_PARENT, -1);
+			break;
+		case IMSG_CTL_MONITOR:
+			control_monitor(c, &imsg);
+			break;
 		case IMSG_CTL_RELOAD:
 		case IMSG_CTL_HINTS:
+		case IMSG_CTL_SHOW_RESOLVERS:
+		case IMSG_CTL_SHOW_STATS:
+		case IMSG_CTL_TRACE:
+		case IMSG_CTL_HOST_ADD:
+		case IMSG_CTL_HOST_DEL:
+		case IMSG_CTL_IMPORT_NAMES:
+		case IMSG_CTL_IMPORT_END:
+		case IMSG_CTL_REFRESH_HOST:
+		case IMSG_CTL_REFRESH_TABLE:
+		case IMSG_CTL_LOOKUP:
 			proc_forward_imsg(&env->sc_ps, &imsg, PROC_PARENT, -1);
 			break;
 		default:
@@ -298,29 +349,141 @@ control_dispatch_imsg(int fd, short event, void *arg)
 	imsg_event_add(&c->iev);
 }
 
+int
+control_dispatch_parent(int fd, struct privsep_proc *p, struct imsg *imsg)
+{
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_SHOW_RESOLVERS:
+	case IMSG_CTL_SHOW_STATS:
+	case IMSG_CTL_HOST:
+	case IMSG_CTL_TABLE:
+	case IMSG_CTL_ADDRESSES:
+	case IMSG_CTL_TRACE:
+	case IMSG_CTL_UPDATE:
+	case IMSG_CTL_REFRESH:
+	case IMSG_CTL_LOOKUP:
+	case IMSG_CTL_END:
+		control_imsg_forward_peerid(imsg);
+		break;
+	case IMSG_CTL_EVENT:
+		control_imsg_forward(imsg);
+		break;
+	default:
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Pass an event to all monitors that match. A monitor that does not read
+ * must not use up the memory of the control process, its events are
+ * counted as dropped instead.
+ */
 void
 control_imsg_forward(struct imsg *imsg)
 {
-	struct ctl_conn *c;
+	struct ctl_conn		*c;
+	struct ctl_event	 ce;
+
+	IMSG_SIZE_CHECK(imsg, &ce);
+	memcpy(&ce, imsg->data, sizeof(ce));
 
 	TAILQ_FOREACH(c, &ctl_conns, entry) {
-		if (c->flags & CTL_CONN_NOTIFY)
-			imsg_compose_event(&c->iev, imsg->hdr.type,
-			    0, imsg->hdr.pid, -1, imsg->data,
-			    imsg->hdr.len - IMSG_HEADER_SIZE);
+		if (!(c->flags & CTL_CONN_NOTIFY) ||
+		    !control_monitor_match(c, &ce))
+			continue;
+
+		if (c->iev.ibuf.w.queued >= CTL_MSG_MONITOR_MAX) {
+			c->dropped++;
+			continue;
+		}
+
+		ce.ce_dropped = c->dropped;
+		c->dropped = 0;
+		imsg_compose_event(&c->iev, imsg->hdr.type,
+		    0, imsg->hdr.pid, -1, &ce, sizeof(ce));
 	}
 }
 
+void
+control_monitor(struct ctl_conn *c, struct imsg *imsg)
+{
+	struct pfresolved	*env = pfresolved_env;
+
+	if (IMSG_DATA_SIZE(imsg) != sizeof(c->filter)) {
+		log_debug("%s: bad monitor filter", __func__);
+		return;
+	}
+	memcpy(&c->filter, imsg->data, sizeof(c->filter));
+	c->filter.cf_table[sizeof(c->filter.cf_table) - 1] = '\0';
+	c->filter.cf_hostname[sizeof(c->filter.cf_hostname) - 1] = '\0';
+
+	if (c->flags & CTL_CONN_NOTIFY)
+		return;
+	c->flags |= CTL_CONN_NOTIFY;
+
+	if (ctl_monitors++ == 0)
+		proc_compose_imsg(&env->sc_ps, PROC_PARENT, -1,
+		    IMSG_CTL_MONITOR, -1, -1, &ctl_monitors,
+		    sizeof(ctl_monitors));
+}
+
+int
+control_monitor_match(struct ctl_conn *c, struct ctl_event *ce)
+{
+	if (c->filter.cf_table[0] != '\0' &&
+	    strcmp(c->filter.cf_table, ce->ce_table) != 0)
+		return (0);
+	if (c->filter.cf_hostname[0] != '\0' &&
+	    strcmp(c->filter.cf_hostname, ce->ce_hostname) != 0)
+		return (0);
+
+	return (1);
+}
+
 void
 control_imsg_forward_peerid(struct imsg *imsg)
 {
-	struct ctl_conn *c;
+	struct pfresolved	*env = pfresolved_env;
+	struct ctl_conn		*c;
 
 	TAILQ_FOREACH(c, &ctl_conns, entry) {
-		if (c->peerid == imsg->hdr.peerid)
-			imsg_compose_event(&c->iev, imsg->hdr.type,
-			    0, imsg->hdr.pid, -1, imsg->data,
-			    imsg->hdr.len - IMSG_HEADER_SIZE);
+		if (c->peerid != imsg->hdr.peerid)
+			continue;
+
+		imsg_compose_event(&c->iev, imsg->hdr.type,
+		    0, imsg->hdr.pid, -1, imsg->data,
+		    imsg->hdr.len - IMSG_HEADER_SIZE);
+
+		if (imsg->hdr.type == IMSG_CTL_END)
+			c->flags &= ~CTL_CONN_DUMP;
+
+		/* pause the dump in the parent until pfresolvectl reads */
+		if ((c->flags & CTL_CONN_DUMP) &&
+		    !(c->flags & CTL_CONN_THROTTLED) &&
+		    c->iev.ibuf.w.queued > CTL_MSG_HIGH_MARK) {
+			c->flags |= CTL_CONN_THROTTLED;
+			proc_compose_imsg(&env->sc_ps, PROC_PARENT, -1,
+			    IMSG_CTL_XOFF, c->peerid, -1, NULL, 0);
+		}
+	}
+}
+
+/* the restricted socket can only show information */
+int
+control_restricted(uint32_t type)
+{
+	switch (type) {
+	case IMSG_CTL_SHOW_RESOLVERS:
+	case IMSG_CTL_SHOW_STATS:
+	case IMSG_CTL_SHOW_HOSTS:
+	case IMSG_CTL_SHOW_TABLES:
+	case IMSG_CTL_MONITOR:
+	case IMSG_CTL_LOOKUP:
+		return (1);
+	default:
+		return (0);
 	}
 }
 
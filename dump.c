@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pfresolved.h"
+
+/*
+ * The parent answers show hosts and show tables in chunks. After each chunk
+ * it returns to the event loop, so a dump of many hosts neither blocks the
+ * resolving nor needs memory for the whole reply. The position of a dump is
+ * the name of the last host or table and the last address sent, so the dump
+ * continues correctly after hosts were removed, addresses changed or the
+ * config was reloaded.
+ *
+ * The control process sends IMSG_CTL_XOFF when pfresolvectl does not read
+ * fast enough and IMSG_CTL_XON when it caught up again.
+ */
+
+/* hosts or tables per chunk, addresses are sent in full messages */
+#define DUMP_CHUNK		64
+#define DUMP_ADDRESSES		((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / \
+	sizeof(struct ctl_address))
+/* usec to wait when the pipe to the control process is full */
+#define DUMP_BACKOFF		10000
+
+enum dump_state {
+	DUMP_START = 0,
+	DUMP_TABLES,
+	DUMP_ADDRESSES_V4,
+	DUMP_ADDRESSES_V6
+};
+
+struct dump_ctx {
+	TAILQ_ENTRY(dump_ctx)		 dc_entry;
+	uint32_t			 dc_peerid;
+	uint32_t			 dc_type;
+	int				 dc_single;
+	int				 dc_throttled;
+	enum dump_state			 dc_state;
+	int				 dc_started;
+	char				 dc_name[HOST_NAME_MAX + 1];
+	struct pfresolved_address	 dc_addr;
+};
+TAILQ_HEAD(dump_ctxs, dump_ctx);
+
+void	 dump_schedule(struct pfresolved *, int);
+void	 dump_run(int, short, void *);
+struct dump_ctx *
+	 dump_find(uint32_t);
+void	 dump_free(struct dump_ctx *);
+int	 dump_hosts(struct pfresolved *, struct dump_ctx *);
+int	 dump_host(struct pfresolved *, struct dump_ctx *);
+int	 dump_host_next(struct pfresolved_addrset *,
+	    struct pfresolved_address *);
+int	 dump_tables(struct pfresolved *, struct dump_ctx *);
+int	 dump_table(struct pfresolved *, struct dump_ctx *);
+void	 dump_send_host(struct pfresolved *, struct dump_ctx *,
+	    struct pfresolved_host *);
+void	 dump_send_table(struct pfresolved *, struct dump_ctx *,
+	    struct pfresolved_table *, int);
+
+static struct dump_ctxs		 dump_ctxs = TAILQ_HEAD_INITIALIZER(dump_ctxs);
+static struct event		 dump_ev;
+static struct ctl_address	 dump_addresses[DUMP_ADDRESSES];
+
+void
+dump_start(struct pfresolved *env, struct imsg *imsg)
+{
+	struct dump_ctx		*dc;
+	size_t			 len;
+
+	len = IMSG_DATA_SIZE(imsg);
+	if (len > HOST_NAME_MAX) {
+		log_errorx("%s: name too long", __func__);
+		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_END,
+		    imsg->hdr.peerid, -1, NULL, 0);
+		return;
+	}
+
+	if ((dc = calloc(1, sizeof(*dc))) == NULL)
+		fatal("%s: calloc", __func__);
+	dc->dc_peerid = imsg->hdr.peerid;
+	dc->dc_type = imsg->hdr.type;
+	memcpy(dc->dc_name, imsg->data, len);
+	dc->dc_single = len > 0;
+
+	TAILQ_INSERT_TAIL(&dump_ctxs, dc, dc_entry);
+	dump_schedule(env, 0);
+}
+
+void
+dump_throttle(struct pfresolved *env, uint32_t peerid, int throttled)
+{
+	struct dump_ctx		*dc;
+
+	if ((dc = dump_find(peerid)) == NULL)
+		return;
+
+	log_debug("%s: %s dump for peer %u", __func__,
+	    throttled ? "pausing" : "resuming", peerid);
+	dc->dc_throttled = throttled;
+	if (!throttled)
+		dump_schedule(env, 0);
+}
+
+void
+dump_abort(struct pfresolved *env, uint32_t peerid)
+{
+	struct dump_ctx		*dc;
+
+	if ((dc = dump_find(peerid)) != NULL)
+		dump_free(dc);
+}
+
+struct dump_ctx *
+dump_find(uint32_t peerid)
+{
+	struct dump_ctx		*dc;
+
+	TAILQ_FOREACH(dc, &dump_ctxs, dc_entry) {
+		if (dc->dc_peerid == peerid)
+			return (dc);
+	}
+
+	return (NULL);
+}
+
+void
+dump_free(struct dump_ctx *dc)
+{
+	TAILQ_REMOVE(&dump_ctxs, dc, dc_entry);
+	free(dc);
+}
+
+void
+dump_schedule(struct pfresolved *env, int usec)
+{
+	struct timeval		 tv = { 0, usec };
+
+	if (!evtimer_initialized(&dump_ev))
+		evtimer_set(&dump_ev, dump_run, env);
+	if (!evtimer_pending(&dump_ev, NULL))
+		evtimer_add(&dump_ev, &tv);
+}
+
+/*
+ * Send one chunk of every dump that is not paused, a dump that is done is
+ * ended with IMSG_CTL_END.
+ */
+void
+dump_run(int fd, short event, void *arg)
+{
+	struct pfresolved	*env = arg;
+	struct dump_ctx		*dc, *next;
+	struct imsgev		*iev;
+	int			 more, active = 0;
+
+	iev = proc_iev(&env->sc_ps, PROC_CONTROL, 0);
+
+	for (dc = TAILQ_FIRST(&dump_ctxs); dc != NULL; dc = next) {
+		next = TAILQ_NEXT(dc, dc_entry);
+
+		if (dc->dc_throttled)
+			continue;
+		if (iev->ibuf.w.queued > CTL_MSG_HIGH_MARK) {
+			dump_schedule(env, DUMP_BACKOFF);
+			return;
+		}
+
+		if (dc->dc_type == IMSG_CTL_SHOW_HOSTS)
+			more = dc->dc_single ? dump_host(env, dc) :
+			    dump_hosts(env, dc);
+		else
+			more = dc->dc_single ? dump_table(env, dc) :
+			    dump_tables(env, dc);
+
+		if (more) {
+			active++;
+			continue;
+		}
+
+		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_END,
+		    dc->dc_peerid, -1, NULL, 0);
+		dump_free(dc);
+	}
+
+	if (active)
+		dump_schedule(env, 0);
+}
+
+int
+dump_hosts(struct pfresolved *env, struct dump_ctx *dc)
+{
+	struct pfresolved_host	 search_key, *host;
+	int			 i;
+
+	bzero(&search_key, sizeof(search_key));
+	strlcpy(search_key.pfh_hostname, dc->dc_name,
+	    sizeof(search_key.pfh_hostname));
+
+	/* continue after the last host that was sent */
+	if (dc->dc_started) {
+		host = RB_NFIND(pfresolved_hosts, &env->sc_hosts, &search_key);
+		if (host != NULL &&
+		    strcmp(host->pfh_hostname, dc->dc_name) == 0)
+			host = RB_NEXT(pfresolved_hosts, &env->sc_hosts, host);
+	} else
+		host = RB_MIN(pfresolved_hosts, &env->sc_hosts);
+	dc->dc_started = 1;
+
+	for (i = 0; host != NULL && i < DUMP_CHUNK; i++) {
+		dump_send_host(env, dc, host);
+		strlcpy(dc->dc_name, host->pfh_hostname, sizeof(dc->dc_name));
+		host = RB_NEXT(pfresolved_hosts, &env->sc_hosts, host);
+	}
+
+	return (host != NULL);
+}
+
+/*
+ * A single host is sent with the names of its tables and its addresses. The
+ * host is looked up again for every chunk, it may be gone after a reload.
+ * CNAME targets that are not configured themselves can be shown as well.
+ */
+int
+dump_host(struct pfresolved *env, struct dump_ctx *dc)
+{
+	struct pfresolved_host		 search_key, *host;
+	struct pfresolved_addrset	*addrset = NULL;
+	sa_family_t			 af = AF_INET;
+	int				 i = 0, idx, num = 0;
+
+	bzero(&search_key, sizeof(search_key));
+	strlcpy(search_key.pfh_hostname, dc->dc_name,
+	    sizeof(search_key.pfh_hostname));
+	if ((host = RB_FIND(pfresolved_hosts, &env->sc_hosts,
+	    &search_key)) == NULL &&
+	    (host = RB_FIND(pfresolved_hosts, &env->sc_canons,
+	    &search_key)) == NULL)
+		return (0);
+
+	switch (dc->dc_state) {
+	case DUMP_START:
+		dump_send_host(env, dc, host);
+		dc->dc_state = DUMP_TABLES;
+		return (1);
+	case DUMP_TABLES:
+		TABLESET_FOREACH(idx, &host->pfh_tables)
+			dump_send_table(env, dc, env->sc_table_index[idx], 0);
+		dc->dc_state = DUMP_ADDRESSES_V4;
+		return (1);
+	case DUMP_ADDRESSES_V4:
+		addrset = host->pfh_addrset_v4;
+		af = AF_INET;
+		break;
+	case DUMP_ADDRESSES_V6:
+		addrset = host->pfh_addrset_v6;
+		af = AF_INET6;
+		break;
+	}
+
+	/* the address set may have been replaced since the last chunk */
+	if (addrset != NULL && dc->dc_started)
+		i = dump_host_next(addrset, &dc->dc_addr);
+	dc->dc_started = 1;
+
+	while (addrset != NULL && i < addrset->pfas_num &&
+	    num < (int)DUMP_ADDRESSES) {
+		bzero(&dump_addresses[num], sizeof(dump_addresses[num]));
+		addrset_address(af, ADDRSET_KEY(af, addrset->pfas_keys, i),
+		    &dump_addresses[num].ca_addr);
+		dc->dc_addr = dump_addresses[num].ca_addr;
+		i++;
+		num++;
+	}
+	if (num > 0)
+		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
+		    IMSG_CTL_ADDRESSES, dc->dc_peerid, -1, dump_addresses,
+		    num * sizeof(*dump_addresses));
+
+	if (addrset != NULL && i < addrset->pfas_num)
+		return (1);
+	if (dc->dc_state == DUMP_ADDRESSES_V6)
+		return (0);
+
+	dc->dc_state = DUMP_ADDRESSES_V6;
+	dc->dc_started = 0;
+	return (1);
+}
+
+/* index of the first key of a sorted set after the last address sent */
+int
+dump_host_next(struct pfresolved_addrset *addrset,
+    struct pfresolved_address *last)
+{
+	int	 lo = 0, hi = addrset->pfas_num, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (addrset_key_cmp(addrset->pfas_af, ADDRSET_KEY(
+		    addrset->pfas_af, addrset->pfas_keys, mid),
+		    &last->pfa_addr) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+int
+dump_tables(struct pfresolved *env, struct dump_ctx *dc)
+{
+	struct pfresolved_table	 search_key, *table;
+	int			 i;
+
+	bzero(&search_key, sizeof(search_key));
+	strlcpy(search_key.pft_name, dc->dc_name, sizeof(search_key.pft_name));
+
+	if (dc->dc_started) {
+		table = RB_NFIND(pfresolved_tables, &env->sc_tables,
+		    &search_key);
+		if (table != NULL && strcmp(table->pft_name, dc->dc_name) == 0)
+			table = RB_NEXT(pfresolved_tables, &env->sc_tables,
+			    table);
+	} else
+		table = RB_MIN(pfresolved_tables, &env->sc_tables);
+	dc->dc_started = 1;
+
+	for (i = 0; table != NULL && i < DUMP_CHUNK; i++) {
+		dump_send_table(env, dc, table, 1);
+		strlcpy(dc->dc_name, table->pft_name, sizeof(dc->dc_name));
+		table = RB_NEXT(pfresolved_tables, &env->sc_tables, table);
+	}
+
+	return (table != NULL);
+}
+
+/* a single table is sent with its entries, one full message per chunk */
+int
+dump_table(struct pfresolved *env, struct dump_ctx *dc)
+{
+	struct pfresolved_table		 search_key, *table;
+	struct pfresolved_table_entry	 search_entry, *entry;
+	int				 num = 0;
+
+	bzero(&search_key, sizeof(search_key));
+	strlcpy(search_key.pft_name, dc->dc_name, sizeof(search_key.pft_name));
+	if ((table = RB_FIND(pfresolved_tables, &env->sc_tables,
+	    &search_key)) == NULL)
+		return (0);
+
+	if (dc->dc_state == DUMP_START) {
+		dump_send_table(env, dc, table, 1);
+		dc->dc_state = DUMP_ADDRESSES_V4;
+		return (1);
+	}
+
+	if (dc->dc_started) {
+		bzero(&search_entry, sizeof(search_entry));
+		search_entry.pfte_addr = dc->dc_addr;
+		entry = RB_NFIND(pfresolved_table_entries, &table->pft_entries,
+		    &search_entry);
+		if (entry != NULL &&
+		    address_cmp(&entry->pfte_addr, &dc->dc_addr) == 0)
+			entry = RB_NEXT(pfresolved_table_entries,
+			    &table->pft_entries, entry);
+	} else
+		entry = RB_MIN(pfresolved_table_entries, &table->pft_entries);
+	dc->dc_started = 1;
+
+	for (; entry != NULL && num < (int)DUMP_ADDRESSES;
+	    entry = RB_NEXT(pfresolved_table_entries, &table->pft_entries,
+	    entry)) {
+		bzero(&dump_addresses[num], sizeof(dump_addresses[num]));
+		dump_addresses[num].ca_addr = entry->pfte_addr;
+		dump_addresses[num].ca_negate = entry->pfte_negate;
+		dump_addresses[num].ca_static = entry->pfte_static;
+		dc->dc_addr = entry->pfte_addr;
+		num++;
+	}
+	if (num > 0)
+		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
+		    IMSG_CTL_ADDRESSES, dc->dc_peerid, -1, dump_addresses,
+		    num * sizeof(*dump_addresses));
+
+	return (entry != NULL);
+}
+
+void
+dump_send_host(struct pfresolved *env, struct dump_ctx *dc,
+    struct pfresolved_host *host)
+{
+	struct ctl_host		 ch;
+	int			 idx;
+
+	bzero(&ch, sizeof(ch));
+	strlcpy(ch.ch_hostname, host->pfh_hostname, sizeof(ch.ch_hostname));
+	if (host->pfh_canon != NULL)
+		strlcpy(ch.ch_canon, host->pfh_canon->pfh_hostname,
+		    sizeof(ch.ch_canon));
+	ch.ch_num_v4 = host->pfh_addrset_v4 ? host->pfh_addrset_v4->pfas_num :
+	    0;
+	ch.ch_num_v6 = host->pfh_addrset_v6 ? host->pfh_addrset_v6->pfas_num :
+	    0;
+	ch.ch_tries_v4 = host->pfh_tries_v4;
+	ch.ch_tries_v6 = host->pfh_tries_v6;
+	ch.ch_next_v4 = timer_remaining(&host->pfh_timer_v4);
+	ch.ch_next_v6 = timer_remaining(&host->pfh_timer_v6);
+	TABLESET_FOREACH(idx, &host->pfh_tables)
+		ch.ch_num_tables++;
+
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_HOST,
+	    dc->dc_peerid, -1, &ch, sizeof(ch));
+}
+
+/* the entries are only counted for the tables themselves, not for a host */
+void
+dump_send_table(struct pfresolved *env, struct dump_ctx *dc,
+    struct pfresolved_table *table, int count)
+{
+	struct ctl_table		 ct;
+
+	bzero(&ct, sizeof(ct));
+	strlcpy(ct.ct_name, table->pft_name, sizeof(ct.ct_name));
+	if (count) {
+		ct.ct_num_entries = table->pft_num_entries;
+		ct.ct_num_static = table->pft_num_static;
+	}
+
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_TABLE,
+	    dc->dc_peerid, -1, &ct, sizeof(ct));
+}
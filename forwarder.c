@@ -14,36 +14,61 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/time.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "pfresolved.h"
 
-#define DNS_CLASS_IN		1
-#define DNS_RR_TYPE_A		1
-#define DNS_RR_TYPE_AAAA	28
-#define DNS_RCODE_NOERROR	0
-#define DNS_RCODE_NXDOMAIN	3
-
 void	 forwarder_run(struct privsep *, struct privsep_proc *, void *);
 void	 forwarder_shutdown(void);
 int	 forwarder_dispatch_parent(int, struct privsep_proc *, struct imsg *);
 void	 forwarder_process_resolvereq(struct pfresolved *, struct imsg *);
+void	 forwarder_resolve(struct pfresolved *, sa_family_t, const char *);
+void	 forwarder_show_resolvers(struct pfresolved *, struct imsg *);
+void	 forwarder_show_stats(struct pfresolved *, struct imsg *);
 void	 forwarder_ub_ctx_init(struct pfresolved *);
+void	 forwarder_process_result(void *, int, struct ub_result *);
+void	 forwarder_send_part(struct pfresolved *, struct iovec *,
+	    sa_family_t, uint8_t *, int);
 void	 forwarder_ub_resolve_async_cb(void *, int, struct ub_result *);
 void	 forwarder_ub_resolve_async_cb_discard(void *, int, struct ub_result *);
+void	 forwarder_ub_resolve_event_cb(void *, int, void *, int, int, char *,
+	    int);
+void	 forwarder_ub_resolve_event_cb_discard(void *, int, void *, int, int,
+	    char *, int);
 void	 forwarder_ub_fd_read_cb(int, short, void *);
+struct resolve_args *
+	 forwarder_resolve_args_get(void);
+void	 forwarder_resolve_args_put(struct resolve_args *);
 
 static struct privsep_proc procs[] = {
 	{ "parent", PROC_PARENT, forwarder_dispatch_parent }
 };
 
+/*
+ * Request contexts are allocated in slabs that are kept on a free list and
+ * never returned, so in the steady state no memory is allocated per query.
+ */
+#define RESOLVE_ARGS_SLAB	64
+
 struct resolve_args {
-	char		*hostname;
-	sa_family_t	 af;
+	TAILQ_ENTRY(resolve_args) entry;
+	sa_family_t		 af;
+	struct timespec		 start;
+	char			 hostname[HOST_NAME_MAX + 1];
 };
+TAILQ_HEAD(resolve_args_list, resolve_args);
+
+static struct resolve_args_list	resolve_args_free =
+    TAILQ_HEAD_INITIALIZER(resolve_args_free);
+
+/* address keys of a result are collected here before they are sent */
+static uint32_t forwarder_keys[MAX_IMSGSIZE / sizeof(uint32_t)];
 
 void
 forwarderproc(struct privsep *ps, struct privsep_proc *p)
@@ -51,6 +76,13 @@ forwarderproc(struct privsep *ps, struct privsep_proc *p)
 	struct pfresolved	*env = ps->ps_env;
 	int			 res;
 
+	if (env->sc_engine == ENGINE_STUB) {
+		/* certificates and session files are opened before chroot(2) */
+		stub_init(env);
+		proc_run(ps, p, procs, nitems(procs), forwarder_run, NULL);
+		return;
+	}
+
 	forwarder_ub_ctx_init(env);
 
 	/*
@@ -59,8 +91,14 @@ forwarderproc(struct privsep *ps, struct privsep_proc *p)
 	 * call chroot(2). Therefore we simply query for "localhost" here and
 	 * then discard the result.
 	 */
-	res = ub_resolve_async(env->sc_ub_ctx, "localhost", DNS_RR_TYPE_A,
-	    DNS_CLASS_IN, NULL, forwarder_ub_resolve_async_cb_discard, NULL);
+	if (env->sc_engine == ENGINE_EVENT)
+		res = ub_resolve_event(env->sc_ub_ctx, "localhost",
+		    DNS_RR_TYPE_A, DNS_CLASS_IN, NULL,
+		    forwarder_ub_resolve_event_cb_discard, NULL);
+	else
+		res = ub_resolve_async(env->sc_ub_ctx, "localhost",
+		    DNS_RR_TYPE_A, DNS_CLASS_IN, NULL,
+		    forwarder_ub_resolve_async_cb_discard, NULL);
 	if (res != 0)
 		fatalx("%s: error when initializing libunbound: %s", __func__,
 		    ub_strerror(res));
@@ -72,19 +110,40 @@ void
 forwarder_run(struct privsep *ps, struct privsep_proc *p, void *arg)
 {
 	struct pfresolved	*env = ps->ps_env;
-	int			 fd;
+	int			 fd, res;
 
 	if (pledge("stdio dns inet rpath recvfd", NULL) == -1)
 		fatal("%s: pledge", __func__);
 
+	p->p_shutdown = forwarder_shutdown;
+
+	if (env->sc_engine == ENGINE_STUB) {
+		stub_start(env);
+		return;
+	}
+
+	/*
+	 * Move libunbound from the temporary event base it was initialized
+	 * with to the one of this process. Queries are then handled in our
+	 * event loop without a worker thread.
+	 */
+	if (env->sc_engine == ENGINE_EVENT) {
+		if ((res = ub_ctx_set_event(env->sc_ub_ctx,
+		    ps->ps_evbase)) != 0)
+			fatalx("%s: ub_ctx_set_event failed: %s", __func__,
+			    ub_strerror(res));
+		/* libunbound does not free the base it was created with */
+		event_base_free(env->sc_ub_evbase);
+		env->sc_ub_evbase = NULL;
+		return;
+	}
+
 	if ((fd = ub_fd(env->sc_ub_ctx)) == -1)
 		fatalx("%s: ub_fd failed", __func__);
 
 	event_set(&env->sc_ub_fd_event, fd, EV_READ | EV_PERSIST,
 	    forwarder_ub_fd_read_cb, env);
 	event_add(&env->sc_ub_fd_event, NULL);
-
-	p->p_shutdown = forwarder_shutdown;
 }
 
 void
@@ -92,7 +151,13 @@ forwarder_shutdown(void)
 {
 	struct pfresolved	*env = pfresolved_env;
 
-	event_del(&env->sc_ub_fd_event);
+	if (env->sc_engine == ENGINE_STUB) {
+		stub_shutdown(env);
+		return;
+	}
+
+	if (env->sc_engine == ENGINE_UNBOUND)
+		event_del(&env->sc_ub_fd_event);
 	ub_ctx_delete(env->sc_ub_ctx);
 }
 
@@ -105,6 +170,17 @@ forwarder_dispatch_parent(int fd, struct privsep_proc *p, struct imsg *imsg)
 	case IMSG_RESOLVEREQ:
 		forwarder_process_resolvereq(env, imsg);
 		break;
+	case IMSG_CTL_SHOW_RESOLVERS:
+		forwarder_show_resolvers(env, imsg);
+		break;
+	case IMSG_CTL_SHOW_STATS:
+		forwarder_show_stats(env, imsg);
+		break;
+	case IMSG_CTL_TRACE:
+		trace_send(env, PROC_PARENT, imsg->hdr.peerid);
+		proc_compose_imsg(&env->sc_ps, PROC_PARENT, -1, IMSG_CTL_END,
+		    imsg->hdr.peerid, -1, NULL, 0);
+		break;
 	default:
 		return (-1);
 		break;
@@ -119,64 +195,184 @@ forwarder_process_resolvereq(struct pfresolved *env, struct imsg *imsg)
 	uint8_t				*ptr;
 	size_t				 len;
 	sa_family_t			 af;
-	char				*hostname;
-	struct resolve_args		*resolve_args;
-	int				 request_type, res, hostname_len;
-	struct iovec			 iov[3];
-	int				 iovcnt = 0;
+	struct timespec			 sent;
+	char				 hostname[HOST_NAME_MAX + 1];
 
 	ptr = imsg->data;
 	len = IMSG_DATA_SIZE(imsg);
 
-	if (len < sizeof(af))
+	if (len < sizeof(af) + sizeof(sent))
 		fatalx("%s: imsg length too small for af: len %zu, required %lu",
-		    __func__, len, sizeof(af));
+		    __func__, len, sizeof(af) + sizeof(sent));
 
 	memcpy(&af, ptr, sizeof(af));
 	ptr += sizeof(af);
 	len -= sizeof(af);
+	memcpy(&sent, ptr, sizeof(sent));
+	ptr += sizeof(sent);
+	len -= sizeof(sent);
+
+	stats_histogram_add(&env->sc_stats.st_stages[STAGE_REQUEST],
+	    stats_elapsed(&sent));
 
 	if (len <= 0 || len > HOST_NAME_MAX)
 		fatalx("%s: invalid length for hostname: %zu", __func__, len);
 
-	if ((hostname = calloc(len + 1, sizeof(char))) == NULL)
-		fatal("%s: calloc", __func__);
-
 	memcpy(hostname, ptr, len);
+	hostname[len] = '\0';
+
+	/* a dual-stack request starts both queries, each sends its result */
+	if (af == AF_UNSPEC) {
+		forwarder_resolve(env, AF_INET, hostname);
+		forwarder_resolve(env, AF_INET6, hostname);
+	} else
+		forwarder_resolve(env, af, hostname);
+}
+
+void
+forwarder_resolve(struct pfresolved *env, sa_family_t af, const char *name)
+{
+	char				*hostname;
+	struct resolve_args		*resolve_args;
+	int				 request_type, res, hostname_len;
+	struct iovec			 iov[4];
+	struct timespec			 sent;
+	int				 iovcnt = 0;
+
+	resolve_args = forwarder_resolve_args_get();
+	hostname = resolve_args->hostname;
+	strlcpy(hostname, name, sizeof(resolve_args->hostname));
 
 	log_debug("%s: received resolve request for %s %s", __func__, hostname,
 	    af == AF_INET ? "A" : "AAAA");
 
 	request_type = af == AF_INET ? DNS_RR_TYPE_A : DNS_RR_TYPE_AAAA;
 
-	if ((resolve_args = calloc(1, sizeof(*resolve_args))) == NULL)
-		fatal("%s: calloc", __func__);
-	resolve_args->hostname = hostname;
 	resolve_args->af = af;
-
-	res = ub_resolve_async(env->sc_ub_ctx, hostname, request_type,
-	    DNS_CLASS_IN, resolve_args, forwarder_ub_resolve_async_cb, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &resolve_args->start);
+	trace_add(TRACE_REQUEST, af, hostname, 0);
+
+	if (env->sc_engine == ENGINE_STUB)
+		res = stub_resolve(env, hostname, request_type, resolve_args,
+		    forwarder_process_result);
+	else if (env->sc_engine == ENGINE_EVENT)
+		res = ub_resolve_event(env->sc_ub_ctx, hostname, request_type,
+		    DNS_CLASS_IN, resolve_args, forwarder_ub_resolve_event_cb,
+		    NULL);
+	else
+		res = ub_resolve_async(env->sc_ub_ctx, hostname, request_type,
+		    DNS_CLASS_IN, resolve_args, forwarder_ub_resolve_async_cb,
+		    NULL);
 	if (res != 0) {
-		log_errorx("%s: ub_resolve_async failed: %s", __func__,
+		log_errorx("%s: resolve failed: %s", __func__,
 		    ub_strerror(res));
+		env->sc_stats.st_query_failures++;
+		trace_add(TRACE_ERROR, af, hostname, res);
+
+		clock_gettime(CLOCK_MONOTONIC, &sent);
 
 		iov[0].iov_base = &af;
 		iov[0].iov_len = sizeof(af);
 		iovcnt++;
+		iov[1].iov_base = &sent;
+		iov[1].iov_len = sizeof(sent);
+		iovcnt++;
 
 		hostname_len = strlen(hostname);
-		iov[1].iov_base = &hostname_len;
-		iov[1].iov_len = sizeof(hostname_len);
+		iov[2].iov_base = &hostname_len;
+		iov[2].iov_len = sizeof(hostname_len);
 		iovcnt++;
-		iov[2].iov_base = hostname;
-		iov[2].iov_len = hostname_len;
+		iov[3].iov_base = hostname;
+		iov[3].iov_len = hostname_len;
 		iovcnt++;
 
 		proc_composev(&env->sc_ps, PROC_PARENT, IMSG_RESOLVEREQ_FAIL,
 		    iov, iovcnt);
-		free(hostname);
-		free(resolve_args);
+		forwarder_resolve_args_put(resolve_args);
+		return;
+	}
+
+	env->sc_stats.st_queries++;
+}
+
+struct resolve_args *
+forwarder_resolve_args_get(void)
+{
+	struct resolve_args	*slab, *resolve_args;
+	int			 i;
+
+	if (TAILQ_EMPTY(&resolve_args_free)) {
+		if ((slab = calloc(RESOLVE_ARGS_SLAB, sizeof(*slab))) == NULL)
+			fatal("%s: calloc", __func__);
+		for (i = 0; i < RESOLVE_ARGS_SLAB; i++)
+			TAILQ_INSERT_TAIL(&resolve_args_free, &slab[i], entry);
+	}
+
+	resolve_args = TAILQ_FIRST(&resolve_args_free);
+	TAILQ_REMOVE(&resolve_args_free, resolve_args, entry);
+
+	return (resolve_args);
+}
+
+void
+forwarder_resolve_args_put(struct resolve_args *resolve_args)
+{
+	TAILQ_INSERT_HEAD(&resolve_args_free, resolve_args, entry);
+}
+
+/*
+ * Libunbound does not expose its per server state, statistics are only
+ * available with the stub engine.
+ */
+void
+forwarder_show_resolvers(struct pfresolved *env, struct imsg *imsg)
+{
+	if (env->sc_engine == ENGINE_STUB)
+		stub_show_resolvers(env, imsg->hdr.peerid);
+
+	proc_compose_imsg(&env->sc_ps, PROC_PARENT, -1, IMSG_CTL_END,
+	    imsg->hdr.peerid, -1, NULL, 0);
+}
+
+void
+forwarder_show_stats(struct pfresolved *env, struct imsg *imsg)
+{
+	static const char	*rcodes[STATS_RCODES + 1] = {
+		"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP",
+		"REFUSED", "other"
+	};
+	struct pfresolved_stats	*st = &env->sc_stats;
+	uint32_t		 peerid = imsg->hdr.peerid;
+	char			 label[STATS_LABEL_SIZE];
+	int			 i;
+
+	stats_send(env, PROC_PARENT, peerid, STATS_COUNTER, "queries_total",
+	    NULL, "Queries sent to the resolvers", st->st_queries);
+	stats_send(env, PROC_PARENT, peerid, STATS_COUNTER,
+	    "query_failures_total", NULL, "Queries without an answer",
+	    st->st_query_failures);
+	for (i = 0; i <= STATS_RCODES; i++) {
+		snprintf(label, sizeof(label), "rcode=\"%s\"", rcodes[i]);
+		stats_send(env, PROC_PARENT, peerid, STATS_COUNTER,
+		    "answers_total", label, "Answers by rcode",
+		    st->st_answers[i]);
 	}
+	stats_send(env, PROC_PARENT, peerid, STATS_COUNTER,
+	    "dnssec_bogus_total", NULL, "Answers that failed DNSSEC validation",
+	    st->st_bogus);
+	stats_send(env, PROC_PARENT, peerid, STATS_COUNTER,
+	    "dnssec_insecure_total", NULL,
+	    "Insecure answers when DNSSEC is required", st->st_insecure);
+	stats_send_histogram(env, PROC_PARENT, peerid, "stage_duration_seconds",
+	    "stage=\"request\"", "Time spent in each processing stage",
+	    &st->st_stages[STAGE_REQUEST]);
+	stats_send_histogram(env, PROC_PARENT, peerid, "stage_duration_seconds",
+	    "stage=\"resolve\"", "Time spent in each processing stage",
+	    &st->st_stages[STAGE_RESOLVE]);
+	stats_send_process(env, PROC_PARENT, peerid);
+
+	proc_compose_imsg(&env->sc_ps, PROC_PARENT, -1, IMSG_CTL_END,
+	    peerid, -1, NULL, 0);
 }
 
 void
@@ -185,7 +381,12 @@ forwarder_ub_ctx_init(struct pfresolved *env)
 	struct ub_ctx		*ctx;
 	int			 res, i;
 
-	if ((ctx = ub_ctx_create()) == NULL)
+	if (env->sc_engine == ENGINE_EVENT) {
+		if ((env->sc_ub_evbase = event_base_new()) == NULL)
+			fatalx("%s: event_base_new failed", __func__);
+		if ((ctx = ub_ctx_create_event(env->sc_ub_evbase)) == NULL)
+			fatalx("%s: ub_ctx_create_event failed", __func__);
+	} else if ((ctx = ub_ctx_create()) == NULL)
 		fatalx("%s: ub_ctx_create failed", __func__);
 
 	env->sc_ub_ctx = ctx;
@@ -196,7 +397,8 @@ forwarder_ub_ctx_init(struct pfresolved *env)
 		    ub_strerror(res));
 
 	/* use threads instead of fork(2) */
-	if ((res = ub_ctx_async(ctx, 1)) != 0)
+	if (env->sc_engine == ENGINE_UNBOUND &&
+	    (res = ub_ctx_async(ctx, 1)) != 0)
 		fatalx("%s: ub_ctx_async failed: %s", __func__,
 		    ub_strerror(res));
 
@@ -220,7 +422,14 @@ forwarder_ub_ctx_init(struct pfresolved *env)
 	if ((res = ub_ctx_set_option(ctx, "rrset-cache-size:", "0")) != 0)
 		fatalx("%s: ub_ctx_set_option rrset-cache-size failed: %s",
 		    __func__, ub_strerror(res));
-	if ((res = ub_ctx_set_option(ctx, "key-cache-size:", "0")) != 0)
+
+	/*
+	 * Validated DNSSEC keys are not what we refresh, they may be cached
+	 * until their own TTL expires. Otherwise every single query has to
+	 * fetch and validate the whole chain of DNSKEY and DS records again.
+	 */
+	if ((res = ub_ctx_set_option(ctx, "key-cache-size:",
+	    env->sc_key_cache ? KEY_CACHE_SIZE : "0")) != 0)
 		fatalx("%s: ub_ctx_set_option key-cache-size failed: %s",
 		    __func__, ub_strerror(res));
 	if ((res = ub_ctx_set_option(ctx, "neg-cache-size:", "0")) != 0)
@@ -277,6 +486,47 @@ forwarder_ub_fd_read_cb(int fd, short event, void *arg)
 
 void
 forwarder_ub_resolve_async_cb(void *arg, int err, struct ub_result *result)
+{
+	forwarder_process_result(arg, err, result);
+	ub_resolve_free(result);
+}
+
+/*
+ * In event mode libunbound only passes the answer packet. It is parsed into
+ * a result on the stack, the addresses point into the packet.
+ */
+void
+forwarder_ub_resolve_event_cb(void *arg, int rcode, void *packet, int len,
+    int sec, char *why_bogus, int was_ratelimited)
+{
+	struct resolve_args	*resolve_args = arg;
+	struct ub_result	 result;
+	int			 qtype;
+
+	qtype = resolve_args->af == AF_INET ? DNS_RR_TYPE_A : DNS_RR_TYPE_AAAA;
+
+	if (packet == NULL || len <= 0 ||
+	    stub_parse_answer(resolve_args->hostname, qtype, packet, len,
+	    &result) == -1) {
+		forwarder_process_result(arg, UB_SERVFAIL, NULL);
+		return;
+	}
+
+	/* 0 is insecure, 1 is bogus and 2 is secure */
+	result.secure = sec == 2;
+	result.bogus = sec == 1;
+	result.why_bogus = why_bogus;
+	result.was_ratelimited = was_ratelimited;
+
+	forwarder_process_result(arg, 0, &result);
+}
+
+/*
+ * Send the result of a query to the parent. This is used by both libunbound
+ * and the stub engine, the result is owned by the caller.
+ */
+void
+forwarder_process_result(void *arg, int err, struct ub_result *result)
 {
 	struct pfresolved		*env = pfresolved_env;
 	struct resolve_args		*resolve_args = arg;
@@ -284,21 +534,31 @@ forwarder_ub_resolve_async_cb(void *arg, int err, struct ub_result *result)
 	char				*qtype_str;
 	sa_family_t			 af;
 	int				 hostname_len;
-	int				 num_addresses = 0, max_addresses = 0;
-	struct pfresolved_address	*addresses = NULL;
-	struct iovec			 iov[6];
+	int				 num_addresses = 0, max_addresses = 0, i;
+	int				 parts = 0;
+	uint64_t			 fingerprint = 0;
+	uint8_t				*keys = (uint8_t *)forwarder_keys;
+	size_t				 keylen;
+	struct iovec			 iov[11];
+	struct timespec			 now, sent;
 	int				 iovcnt = 0, imsg_data_size = 0;
 	int				 fail = 0, type;
+	int				 cname_ttl = -1, canon_len = 0;
 
 	hostname = resolve_args->hostname;
 	af = resolve_args->af;
 
 	qtype_str = af == AF_INET ? "A" : "AAAA";
+	keylen = ADDRSET_KEYLEN(af);
 
 	iov[iovcnt].iov_base = &af;
 	iov[iovcnt].iov_len = sizeof(af);
 	imsg_data_size += sizeof(af);
 	iovcnt++;
+	iov[iovcnt].iov_base = &sent;
+	iov[iovcnt].iov_len = sizeof(sent);
+	imsg_data_size += sizeof(sent);
+	iovcnt++;
 
 	hostname_len = strlen(hostname);
 	iov[iovcnt].iov_base = &hostname_len;
@@ -310,12 +570,26 @@ forwarder_ub_resolve_async_cb(void *arg, int err, struct ub_result *result)
 	imsg_data_size += hostname_len;
 	iovcnt++;
 
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &resolve_args->start, &now);
+	log_debug("%s: query for %s (%s) took %lld usec", __func__, hostname,
+	    qtype_str, (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+	stats_histogram_add(&env->sc_stats.st_stages[STAGE_RESOLVE],
+	    (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+
 	if (err != 0) {
 		log_errorx("%s: query for %s (%s) failed: %s", __func__,
 		    hostname, qtype_str, ub_strerror(err));
+		env->sc_stats.st_query_failures++;
+		trace_add(TRACE_ERROR, af, hostname, err);
 		fail = 1;
 		goto done;
 	}
+	trace_add(TRACE_ANSWER, af, hostname, result->rcode);
+
+	/* rcodes above REFUSED are counted as other */
+	env->sc_stats.st_answers[result->rcode < STATS_RCODES ?
+	    result->rcode : STATS_RCODES]++;
 
 	log_debug("%s: result for %s (%s): qtype: %d, qclass: %d, rcode: %d, "
 	    "canonname: %s, havedata: %d, nxdomain: %d, secure: %d, bogus: %d, "
@@ -327,6 +601,7 @@ forwarder_ub_resolve_async_cb(void *arg, int err, struct ub_result *result)
 	    result->was_ratelimited, result->ttl);
 
 	if (result->bogus) {
+		env->sc_stats.st_bogus++;
 		log_warn("%s: DNSSEC validation for %s (%s) failed: %s",
 		    __func__, hostname, qtype_str, result->why_bogus);
 		if (env->sc_dnssec_level >= DNSSEC_VALIDATE) {
@@ -347,6 +622,7 @@ forwarder_ub_resolve_async_cb(void *arg, int err, struct ub_result *result)
 	}
 
 	if (!result->secure && env->sc_dnssec_level >= DNSSEC_FORCE) {
+		env->sc_stats.st_insecure++;
 		log_warn("%s: DNSSEC required but not available for %s (%s)",
 		    __func__, hostname, qtype_str);
 		fail = 1;
@@ -358,6 +634,28 @@ forwarder_ub_resolve_async_cb(void *arg, int err, struct ub_result *result)
 	imsg_data_size += sizeof(result->ttl);
 	iovcnt++;
 
+	/*
+	 * Tell the parent about the CNAME target and how long the alias is
+	 * valid, aliases of the same target are resolved only once.
+	 */
+	if (result->canonname != NULL && result->answer_packet != NULL)
+		cname_ttl = stub_cname_ttl(hostname, result->answer_packet,
+		    result->answer_len);
+	if (cname_ttl != -1)
+		canon_len = strnlen(result->canonname, HOST_NAME_MAX);
+	iov[iovcnt].iov_base = &cname_ttl;
+	iov[iovcnt].iov_len = sizeof(cname_ttl);
+	imsg_data_size += sizeof(cname_ttl);
+	iovcnt++;
+	iov[iovcnt].iov_base = &canon_len;
+	iov[iovcnt].iov_len = sizeof(canon_len);
+	imsg_data_size += sizeof(canon_len);
+	iovcnt++;
+	iov[iovcnt].iov_base = result->canonname;
+	iov[iovcnt].iov_len = canon_len;
+	imsg_data_size += canon_len;
+	iovcnt++;
+
 	if (result->nxdomain) {
 		log_notice("%s: query for %s (%s) returned NXDOMAIN", __func__,
 		    hostname, qtype_str);
@@ -371,70 +669,81 @@ forwarder_ub_resolve_async_cb(void *arg, int err, struct ub_result *result)
 	}
 
 	max_addresses = (MAX_IMSGSIZE - IMSG_HEADER_SIZE - imsg_data_size -
-	    sizeof(num_addresses)) / sizeof(*addresses);
+	    sizeof(fingerprint) - sizeof(num_addresses)) / keylen;
 
-	while (result->data[num_addresses] != NULL) {
+	for (i = 0; result->data[i] != NULL; i++) {
+		/* the parent collects the parts until the final message */
 		if (num_addresses == max_addresses) {
-			log_warn("%s: query for %s (%s): maximum of %d addresses"
-			    " exceeded, discarding remaining addresses",
-			    __func__, hostname, qtype_str, max_addresses);
-			break;
+			forwarder_send_part(env, iov, af, keys, num_addresses);
+			num_addresses = 0;
+			parts++;
 		}
 
-		if ((addresses = recallocarray(addresses, num_addresses,
-		    num_addresses + 1, sizeof(*addresses))) == NULL)
-			fatal("%s: recallocarray", __func__);
-
-		if (af == AF_INET) {
-			if (sizeof(addresses[num_addresses].pfa_addr.in4) !=
-			    result->len[num_addresses]) {
-				log_errorx("%s: query for %s (A): data size "
-				    "mismatch in result", __func__, hostname);
-				fail = 1;
-				goto done;
-			}
-			memcpy(&addresses[num_addresses].pfa_addr.in4,
-			    result->data[num_addresses],
-			    result->len[num_addresses]);
-			addresses[num_addresses].pfa_af = AF_INET;
-			addresses[num_addresses].pfa_prefixlen = 32;
-		} else {
-			if (sizeof(addresses[num_addresses].pfa_addr.in6) !=
-			    result->len[num_addresses]) {
-				log_errorx("%s: query for %s (AAAA): data size "
-				    "mismatch in result", __func__, hostname);
-				fail = 1;
-				goto done;
-			}
-			memcpy(&addresses[num_addresses].pfa_addr.in6,
-			    result->data[num_addresses],
-			    result->len[num_addresses]);
-			addresses[num_addresses].pfa_af = AF_INET6;
-			addresses[num_addresses].pfa_prefixlen = 128;
+		if (keylen != (size_t)result->len[i]) {
+			log_errorx("%s: query for %s (%s): data size mismatch "
+			    "in result", __func__, hostname, qtype_str);
+			fail = 1;
+			goto done;
 		}
+		memcpy(keys + num_addresses * keylen, result->data[i], keylen);
 
 		log_debug("%s: query for %s (%s): address %d: %s", __func__,
-		    hostname, qtype_str, num_addresses,
-		    print_address(&addresses[num_addresses]));
+		    hostname, qtype_str, i,
+		    addrset_print_key(af, keys + num_addresses * keylen));
 
 		num_addresses++;
 	}
 
+	/*
+	 * The parent skips all work for a result that has the fingerprint of
+	 * the addresses it already has. This needs the complete set, results
+	 * that were split into parts get no fingerprint.
+	 */
+	if (parts == 0) {
+		addrset_sort(af, keys, num_addresses);
+		fingerprint = addrset_hash(af, keys, num_addresses);
+	}
+
+	iov[iovcnt].iov_base = &fingerprint;
+	iov[iovcnt].iov_len = sizeof(fingerprint);
+	iovcnt++;
 	iov[iovcnt].iov_base = &num_addresses;
 	iov[iovcnt].iov_len = sizeof(num_addresses);
 	iovcnt++;
-	iov[iovcnt].iov_base = addresses;
-	iov[iovcnt].iov_len = num_addresses * sizeof(*addresses);
+	iov[iovcnt].iov_base = keys;
+	iov[iovcnt].iov_len = num_addresses * keylen;
 	iovcnt++;
 
 done:
 	type = fail ? IMSG_RESOLVEREQ_FAIL : IMSG_RESOLVEREQ_SUCCESS;
+	clock_gettime(CLOCK_MONOTONIC, &sent);
 	proc_composev(&env->sc_ps, PROC_PARENT, type, iov, iovcnt);
 
-	free(hostname);
-	free(resolve_args);
-	free(addresses);
-	ub_resolve_free(result);
+	forwarder_resolve_args_put(resolve_args);
+}
+
+/*
+ * Send address keys that do not fit into the final message of a result. The
+ * header is the address family, timestamp and hostname from the first four
+ * iovecs.
+ */
+void
+forwarder_send_part(struct pfresolved *env, struct iovec *hdr, sa_family_t af,
+    uint8_t *keys, int num_addresses)
+{
+	struct iovec	 iov[6];
+	struct timespec	 sent;
+
+	clock_gettime(CLOCK_MONOTONIC, &sent);
+
+	memcpy(iov, hdr, 4 * sizeof(*iov));
+	iov[1].iov_base = &sent;
+	iov[4].iov_base = &num_addresses;
+	iov[4].iov_len = sizeof(num_addresses);
+	iov[5].iov_base = keys;
+	iov[5].iov_len = num_addresses * ADDRSET_KEYLEN(af);
+
+	proc_composev(&env->sc_ps, PROC_PARENT, IMSG_RESOLVEREQ_PART, iov, 6);
 }
 
 void
@@ -443,3 +752,9 @@ forwarder_ub_resolve_async_cb_discard(void *arg, int err, struct ub_result *resu
 	ub_resolve_free(result);
 }
 
+void
+forwarder_ub_resolve_event_cb_discard(void *arg, int rcode, void *packet,
+    int len, int sec, char *why_bogus, int was_ratelimited)
+{
+}
+
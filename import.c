@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pfresolved.h"
+
+/*
+ * pfresolvectl import replaces the hosts of a table with a list of names.
+ * The names arrive in several messages and are collected until the end of
+ * the import. Then the membership of the table is changed in one step:
+ * hosts that are missing in the list are removed, new names are added and
+ * hosts that stay keep their resolved addresses. The table is written to
+ * pf once. If a name is invalid, nothing is changed.
+ */
+
+struct import_ctx {
+	TAILQ_ENTRY(import_ctx)		 ic_entry;
+	uint32_t			 ic_peerid;
+	char				 ic_table[PF_TABLE_NAME_SIZE];
+	char				*ic_names;
+	size_t				 ic_len;
+	size_t				 ic_size;
+	int				 ic_num;
+	struct ctl_update		 ic_update;
+};
+TAILQ_HEAD(import_ctxs, import_ctx);
+
+struct import_ctx *
+	 import_find(uint32_t);
+void	 import_free(struct import_ctx *);
+void	 import_apply(struct pfresolved *, struct import_ctx *);
+int	 import_cmp(const void *, const void *);
+
+static struct import_ctxs	 import_ctxs =
+    TAILQ_HEAD_INITIALIZER(import_ctxs);
+
+void
+import_start(struct pfresolved *env, struct imsg *imsg)
+{
+	struct import_ctx	*ic;
+	size_t			 len;
+
+	/* a client that starts again replaces its unfinished import */
+	if ((ic = import_find(imsg->hdr.peerid)) != NULL)
+		import_free(ic);
+
+	if ((ic = calloc(1, sizeof(*ic))) == NULL)
+		fatal("%s: calloc", __func__);
+	ic->ic_peerid = imsg->hdr.peerid;
+	TAILQ_INSERT_TAIL(&import_ctxs, ic, ic_entry);
+
+	len = IMSG_DATA_SIZE(imsg);
+	if (len == 0 || len >= sizeof(ic->ic_table)) {
+		strlcpy(ic->ic_update.cu_error, "invalid table name",
+		    sizeof(ic->ic_update.cu_error));
+		return;
+	}
+	memcpy(ic->ic_table, imsg->data, len);
+
+	log_debug("%s: importing hosts of table %s for peer %u", __func__,
+	    ic->ic_table, ic->ic_peerid);
+}
+
+/*
+ * Each message carries NUL terminated names. The names are validated at
+ * once, but stored until the import ends.
+ */
+void
+import_names(struct pfresolved *env, struct imsg *imsg)
+{
+	struct import_ctx	*ic;
+	struct ctl_update	*cu;
+	char			*name, *end;
+	size_t			 len, namelen, size;
+
+	if ((ic = import_find(imsg->hdr.peerid)) == NULL) {
+		log_errorx("%s: no import for peer %u", __func__,
+		    imsg->hdr.peerid);
+		return;
+	}
+	cu = &ic->ic_update;
+
+	len = IMSG_DATA_SIZE(imsg);
+	if (len == 0 || ((char *)imsg->data)[len - 1] != '\0') {
+		if (cu->cu_error[0] == '\0')
+			strlcpy(cu->cu_error, "bad request",
+			    sizeof(cu->cu_error));
+		return;
+	}
+
+	if (ic->ic_len + len > ic->ic_size) {
+		size = ic->ic_size ? ic->ic_size : MAX_IMSGSIZE;
+		while (size < ic->ic_len + len)
+			size *= 2;
+		if ((ic->ic_names = realloc(ic->ic_names, size)) == NULL)
+			fatal("%s: realloc", __func__);
+		ic->ic_size = size;
+	}
+
+	end = (char *)imsg->data + len;
+	for (name = imsg->data; name < end; name += strlen(name) + 1) {
+		cu->cu_received++;
+		if (parent_check_hostname(name, cu) == -1)
+			continue;
+		namelen = strlen(name) + 1;
+		memcpy(ic->ic_names + ic->ic_len, name, namelen);
+		ic->ic_len += namelen;
+		ic->ic_num++;
+	}
+
+	/* progress, the totals follow at the end */
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_UPDATE,
+	    ic->ic_peerid, -1, cu, sizeof(*cu));
+}
+
+void
+import_end(struct pfresolved *env, struct imsg *imsg)
+{
+	struct import_ctx	*ic;
+
+	if ((ic = import_find(imsg->hdr.peerid)) == NULL) {
+		log_errorx("%s: no import for peer %u", __func__,
+		    imsg->hdr.peerid);
+		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_END,
+		    imsg->hdr.peerid, -1, NULL, 0);
+		return;
+	}
+
+	if (ic->ic_update.cu_error[0] == '\0')
+		import_apply(env, ic);
+	else
+		log_warn("%s: import of table %s failed: %s", __func__,
+		    ic->ic_table, ic->ic_update.cu_error);
+
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_UPDATE,
+	    ic->ic_peerid, -1, &ic->ic_update, sizeof(ic->ic_update));
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_END,
+	    ic->ic_peerid, -1, NULL, 0);
+	import_free(ic);
+}
+
+void
+import_abort(struct pfresolved *env, uint32_t peerid)
+{
+	struct import_ctx	*ic;
+
+	if ((ic = import_find(peerid)) == NULL)
+		return;
+
+	log_debug("%s: aborting import of table %s for peer %u", __func__,
+	    ic->ic_table, peerid);
+	import_free(ic);
+}
+
+/*
+ * The hosts tree and the sorted names are walked in the same order to find
+ * the hosts that are removed. Then all names are added, names that are in
+ * the table already are counted as kept.
+ */
+void
+import_apply(struct pfresolved *env, struct import_ctx *ic)
+{
+	struct ctl_update		*cu = &ic->ic_update;
+	struct pfresolved_table		*table, search_key;
+	struct pfresolved_host		*host, *tmp_host;
+	char				**names, *name;
+	int				 i, n, cmp;
+
+	bzero(&search_key, sizeof(search_key));
+	strlcpy(search_key.pft_name, ic->ic_table,
+	    sizeof(search_key.pft_name));
+	if ((table = RB_FIND(pfresolved_tables, &env->sc_tables,
+	    &search_key)) == NULL) {
+		snprintf(cu->cu_error, sizeof(cu->cu_error), "unknown table %s",
+		    ic->ic_table);
+		return;
+	}
+
+	if ((names = reallocarray(NULL, ic->ic_num, sizeof(*names))) == NULL &&
+	    ic->ic_num > 0)
+		fatal("%s: reallocarray", __func__);
+	for (i = 0, name = ic->ic_names; i < ic->ic_num;
+	    i++, name += strlen(name) + 1)
+		names[i] = name;
+	qsort(names, ic->ic_num, sizeof(*names), import_cmp);
+
+	/* remove duplicates, they are counted as received only */
+	for (i = 0, n = 0; i < ic->ic_num; i++) {
+		if (n > 0 && strcmp(names[n - 1], names[i]) == 0)
+			continue;
+		names[n++] = names[i];
+	}
+
+	i = 0;
+	RB_FOREACH_SAFE(host, pfresolved_hosts, &env->sc_hosts, tmp_host) {
+		if (!tableset_isset(&host->pfh_tables, table->pft_index))
+			continue;
+		cmp = -1;
+		while (i < n &&
+		    (cmp = strcmp(names[i], host->pfh_hostname)) < 0)
+			i++;
+		if (cmp != 0)
+			parent_host_del(env, table, host->pfh_hostname, cu);
+	}
+
+	for (i = 0; i < n; i++)
+		parent_host_add(env, table, names[i], cu);
+
+	free(names);
+	parent_commit_tables(env);
+
+	log_notice("%s: imported %d hosts into table %s: added %d, "
+	    "removed %d, kept %d", __func__, n, table->pft_name, cu->cu_added,
+	    cu->cu_removed, cu->cu_kept);
+}
+
+int
+import_cmp(const void *a, const void *b)
+{
+	return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+struct import_ctx *
+import_find(uint32_t peerid)
+{
+	struct import_ctx	*ic;
+
+	TAILQ_FOREACH(ic, &import_ctxs, ic_entry) {
+		if (ic->ic_peerid == peerid)
+			return (ic);
+	}
+
+	return (NULL);
+}
+
+void
+import_free(struct import_ctx *ic)
+{
+	TAILQ_REMOVE(&import_ctxs, ic, ic_entry);
+	free(ic->ic_names);
+	free(ic);
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pfresolved.h"
+
+/*
+ * Reverse index from a resolved address to the hosts that have it. There is
+ * one node per address of a host, sorted by address and hostname, so all
+ * hosts of an address are neighbours in the tree. The tables of an address
+ * are the tables of its hosts, a change of the table membership of a host
+ * does not touch the index. CNAME targets that are not configured themselves
+ * have no tables and are not indexed, their aliases are.
+ */
+
+struct lookup_ref {
+	struct pfresolved_address	 lr_addr;
+	struct pfresolved_host		*lr_host;
+	RB_ENTRY(lookup_ref)		 lr_node;
+};
+RB_HEAD(lookup_refs, lookup_ref);
+
+int	 lookup_cmp(struct lookup_ref *, struct lookup_ref *);
+void	 lookup_set_addrset(struct pfresolved_host *,
+	    struct pfresolved_addrset *, int);
+void	 lookup_send(struct pfresolved *, uint32_t, const char *,
+	    struct pfresolved_table *, struct pfresolved_table_entry *);
+
+RB_PROTOTYPE(lookup_refs, lookup_ref, lr_node, lookup_cmp);
+
+static struct lookup_refs	lookup_refs = RB_INITIALIZER(&lookup_refs);
+
+void
+lookup_add(struct pfresolved_host *host, struct pfresolved_address *address)
+{
+	struct lookup_ref	*ref;
+
+	if (host->pfh_cname_target)
+		return;
+
+	if ((ref = calloc(1, sizeof(*ref))) == NULL)
+		fatal("%s: calloc", __func__);
+	ref->lr_addr = *address;
+	ref->lr_host = host;
+
+	if (RB_INSERT(lookup_refs, &lookup_refs, ref) != NULL) {
+		log_errorx("%s: address %s of %s is already indexed",
+		    __func__, print_address(address), host->pfh_hostname);
+		free(ref);
+	}
+}
+
+void
+lookup_remove(struct pfresolved_host *host, struct pfresolved_address *address)
+{
+	struct lookup_ref	*ref, search_key;
+
+	if (host->pfh_cname_target)
+		return;
+
+	bzero(&search_key, sizeof(search_key));
+	search_key.lr_addr = *address;
+	search_key.lr_host = host;
+
+	if ((ref = RB_FIND(lookup_refs, &lookup_refs, &search_key)) == NULL) {
+		log_errorx("%s: address %s of %s is not indexed",
+		    __func__, print_address(address), host->pfh_hostname);
+		return;
+	}
+	RB_REMOVE(lookup_refs, &lookup_refs, ref);
+	free(ref);
+}
+
+/*
+ * Index all current addresses of a host that is configured itself, either
+ * from a CNAME target or from the start. The caller clears pfh_cname_target
+ * before.
+ */
+void
+lookup_add_host(struct pfresolved_host *host)
+{
+	lookup_set_addrset(host, host->pfh_addrset_v4, 1);
+	lookup_set_addrset(host, host->pfh_addrset_v6, 1);
+}
+
+/*
+ * A host that is freed takes its addresses with it. So does a host that
+ * is only kept as CNAME target, the caller sets pfh_cname_target after.
+ */
+void
+lookup_remove_host(struct pfresolved_host *host)
+{
+	lookup_set_addrset(host, host->pfh_addrset_v4, 0);
+	lookup_set_addrset(host, host->pfh_addrset_v6, 0);
+}
+
+void
+lookup_set_addrset(struct pfresolved_host *host,
+    struct pfresolved_addrset *set, int add)
+{
+	struct pfresolved_address	 address;
+	int				 i;
+
+	if (set == NULL)
+		return;
+
+	for (i = 0; i < set->pfas_num; i++) {
+		addrset_address(set->pfas_af,
+		    ADDRSET_KEY(set->pfas_af, set->pfas_keys, i), &address);
+		if (add)
+			lookup_add(host, &address);
+		else
+			lookup_remove(host, &address);
+	}
+}
+
+/*
+ * Send a message for every table and host that contain an address, followed
+ * by the static entries of the configuration with exactly this address.
+ */
+void
+lookup_start(struct pfresolved *env, struct imsg *imsg)
+{
+	struct pfresolved_address	 address;
+	struct pfresolved_table		*table;
+	struct pfresolved_table_entry	*entry, entry_key;
+	struct lookup_ref		*ref, search_key;
+	int				 idx;
+
+	if (IMSG_DATA_SIZE(imsg) != sizeof(address)) {
+		log_errorx("%s: bad length imsg received", __func__);
+		goto done;
+	}
+	bzero(&address, sizeof(address));
+	memcpy(&address, imsg->data, sizeof(address));
+	if (address.pfa_af != AF_INET && address.pfa_af != AF_INET6) {
+		log_errorx("%s: bad address family %d", __func__,
+		    address.pfa_af);
+		goto done;
+	}
+	address.pfa_prefixlen = address.pfa_af == AF_INET ? 32 : 128;
+
+	log_debug("%s: looking up %s for peer %u", __func__,
+	    print_address(&address), imsg->hdr.peerid);
+
+	bzero(&search_key, sizeof(search_key));
+	search_key.lr_addr = address;
+	for (ref = RB_NFIND(lookup_refs, &lookup_refs, &search_key);
+	    ref != NULL && address_cmp(&ref->lr_addr, &address) == 0;
+	    ref = RB_NEXT(lookup_refs, &lookup_refs, ref)) {
+		TABLESET_FOREACH(idx, &ref->lr_host->pfh_tables)
+			lookup_send(env, imsg->hdr.peerid,
+			    ref->lr_host->pfh_hostname,
+			    env->sc_table_index[idx], NULL);
+	}
+
+	bzero(&entry_key, sizeof(entry_key));
+	entry_key.pfte_addr = address;
+	RB_FOREACH(table, pfresolved_tables, &env->sc_tables) {
+		entry = RB_FIND(pfresolved_table_entries, &table->pft_entries,
+		    &entry_key);
+		if (entry != NULL && entry->pfte_static)
+			lookup_send(env, imsg->hdr.peerid, NULL, table, entry);
+	}
+
+done:
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_END,
+	    imsg->hdr.peerid, -1, NULL, 0);
+}
+
+void
+lookup_send(struct pfresolved *env, uint32_t peerid, const char *hostname,
+    struct pfresolved_table *table, struct pfresolved_table_entry *entry)
+{
+	struct ctl_lookup	 cl;
+
+	bzero(&cl, sizeof(cl));
+	if (hostname != NULL)
+		strlcpy(cl.cl_hostname, hostname, sizeof(cl.cl_hostname));
+	strlcpy(cl.cl_table, table->pft_name, sizeof(cl.cl_table));
+	if (entry != NULL) {
+		cl.cl_static = 1;
+		cl.cl_negate = entry->pfte_negate;
+	}
+
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_LOOKUP,
+	    peerid, -1, &cl, sizeof(cl));
+}
+
+/* a key without a host is sorted before all hosts of its address */
+int
+lookup_cmp(struct lookup_ref *a, struct lookup_ref *b)
+{
+	int	 diff;
+
+	if ((diff = address_cmp(&a->lr_addr, &b->lr_addr)) != 0)
+		return (diff);
+	if (a->lr_host == NULL || b->lr_host == NULL)
+		return ((a->lr_host != NULL) - (b->lr_host != NULL));
+
+	return (strcmp(a->lr_host->pfh_hostname, b->lr_host->pfh_hostname));
+}
+
+RB_GENERATE(lookup_refs, lookup_ref, lr_node, lookup_cmp);
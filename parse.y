@@ -798,7 +798,10 @@ add_static_address(struct pfresolved_table *table, const char *value, int negate
 			log_warn("duplicate entry in config: %s %s",
 			    table->pft_name, value);
 		}
+		return (0);
 	}
+	table->pft_num_entries++;
+	table->pft_num_static++;
 	return (0);
 }
 
@@ -806,7 +809,6 @@ int
 add_host(struct pfresolved_table *table, const char *value)
 {
 	struct pfresolved_host		*host, *old_host;
-	struct pfresolved_table_ref	*ref, *old_ref;
 
 	if (strlen(value) == 0) {
 		yyerror("hostname is empty");
@@ -816,7 +818,7 @@ add_host(struct pfresolved_table *table, const char *value)
 	if ((host = calloc(1, sizeof(*host))) == NULL)
 		fatal("%s: calloc", __func__);
 
-	RB_INIT(&host->pfh_tables);
+	TAILQ_INIT(&host->pfh_aliases);
 
 	if (strlcpy(host->pfh_hostname, value, sizeof(host->pfh_hostname))
 	    >= sizeof(host->pfh_hostname)) {
@@ -825,24 +827,19 @@ add_host(struct pfresolved_table *table, const char *value)
 		return (-1);
 	}
 
-	if ((ref = calloc(1, sizeof(*ref))) == NULL)
-		fatal("%s: calloc", __func__);
-
-	ref->pftr_table = table;
-	RB_INSERT(pfresolved_table_refs, &host->pfh_tables, ref);
-
 	old_host = RB_INSERT(pfresolved_hosts, &env->sc_hosts, host);
 	if (old_host) {
-		old_ref = RB_INSERT(pfresolved_table_refs,
-		    &old_host->pfh_tables, ref);
-		if (old_ref) {
+		free(host);
+		host = old_host;
+		if (tableset_isset(&host->pfh_tables, table->pft_index)) {
 			log_warn("duplicate entry in config: %s %s",
 			    table->pft_name, value);
-			free(ref);
+			return (0);
 		}
-		free(host);
 	}
 
+	tableset_add(&host->pfh_tables, table->pft_index);
+
 	return (0);
 }
 
@@ -869,6 +866,12 @@ table_lookup_or_create(const char *table_name)
 		return (old);
 	}
 
+	if ((env->sc_table_index = reallocarray(env->sc_table_index,
+	    env->sc_num_tables + 1, sizeof(*env->sc_table_index))) == NULL)
+		fatal("%s: reallocarray", __func__);
+	table->pft_index = env->sc_num_tables;
+	env->sc_table_index[env->sc_num_tables++] = table;
+
 	return (table);
 }
 
@@ -29,7 +29,10 @@ enum token_type {
 	NOTOKEN,
 	ENDTOKEN,
 	KEYWORD,
-	LOGLEVEL
+	LOGLEVEL,
+	NAME,
+	TABLENAME,
+	FLAG
 };
 
 struct token {
@@ -41,11 +44,119 @@ struct token {
 
 static const struct token t_main[];
 static const struct token t_log[];
+static const struct token t_show[];
+static const struct token t_show_host[];
+static const struct token t_show_table[];
+static const struct token t_host[];
+static const struct token t_host_table[];
+static const struct token t_host_name[];
+static const struct token t_import[];
+static const struct token t_monitor[];
+static const struct token t_monitor_host[];
+static const struct token t_monitor_table[];
+static const struct token t_lookup[];
+static const struct token t_refresh[];
+static const struct token t_refresh_host[];
+static const struct token t_refresh_table[];
+static const struct token t_refresh_wait[];
 
 static const struct token t_main[] = {
 	{ KEYWORD,	"log",		LOG,		t_log },
 	{ KEYWORD,	"reload",	RELOAD,		NULL },
 	{ KEYWORD,	"hints",	HINTS,		NULL },
+	{ KEYWORD,	"host",		NONE,		t_host },
+	{ KEYWORD,	"import",	IMPORT,		t_import },
+	{ KEYWORD,	"lookup",	LOOKUP,		t_lookup },
+	{ KEYWORD,	"monitor",	MONITOR,	t_monitor },
+	{ KEYWORD,	"refresh",	NONE,		t_refresh },
+	{ KEYWORD,	"show",		NONE,		t_show },
+	{ KEYWORD,	"trace",	TRACE,		NULL },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show[] = {
+	{ KEYWORD,	"host",		SHOW_HOSTS,	t_show_host },
+	{ KEYWORD,	"hosts",	SHOW_HOSTS,	NULL },
+	{ KEYWORD,	"metrics",	SHOW_METRICS,	NULL },
+	{ KEYWORD,	"resolvers",	SHOW_RESOLVERS,	NULL },
+	{ KEYWORD,	"stats",	SHOW_STATS,	NULL },
+	{ KEYWORD,	"table",	SHOW_TABLES,	t_show_table },
+	{ KEYWORD,	"tables",	SHOW_TABLES,	NULL },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_host[] = {
+	{ NAME,		"<hostname>",	NONE,		NULL },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_show_table[] = {
+	{ NAME,		"<table>",	NONE,		NULL },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_host[] = {
+	{ KEYWORD,	"add",		HOST_ADD,	t_host_table },
+	{ KEYWORD,	"delete",	HOST_DEL,	t_host_table },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_host_table[] = {
+	{ TABLENAME,	"<table>",	NONE,		t_host_name },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_host_name[] = {
+	{ NAME,		"<hostname>",	NONE,		NULL },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_import[] = {
+	{ TABLENAME,	"<table>",	NONE,		NULL },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_lookup[] = {
+	{ NAME,		"<address>",	NONE,		NULL },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_monitor[] = {
+	{ NOTOKEN,	"",		NONE,		NULL },
+	{ KEYWORD,	"host",		NONE,		t_monitor_host },
+	{ KEYWORD,	"table",	NONE,		t_monitor_table },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_monitor_host[] = {
+	{ NAME,		"<hostname>",	NONE,		t_monitor },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_monitor_table[] = {
+	{ TABLENAME,	"<table>",	NONE,		t_monitor },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_refresh[] = {
+	{ KEYWORD,	"host",		REFRESH_HOST,	t_refresh_host },
+	{ KEYWORD,	"table",	REFRESH_TABLE,	t_refresh_table },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_refresh_host[] = {
+	{ NAME,		"<hostname>",	NONE,		t_refresh_wait },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_refresh_table[] = {
+	{ TABLENAME,	"<table>",	NONE,		t_refresh_wait },
+	{ ENDTOKEN,	"",		NONE,		NULL }
+};
+
+static const struct token t_refresh_wait[] = {
+	{ NOTOKEN,	"",		NONE,		NULL },
+	{ FLAG,		"wait",		F_WAIT,		NULL },
 	{ ENDTOKEN,	"",		NONE,		NULL }
 };
 
@@ -100,6 +211,16 @@ match_token(char *word, const struct token table[])
 	unsigned int		 i, match = 0;
 	const struct token	*t = NULL;
 
+	/* a keyword that is also the prefix of another one, like host */
+	for (i = 0; word != NULL && table[i].type != ENDTOKEN; i++) {
+		if (table[i].type == KEYWORD &&
+		    strcmp(word, table[i].keyword) == 0) {
+			if (table[i].value)
+				res.action = table[i].value;
+			return (&table[i]);
+		}
+	}
+
 	for (i = 0; table[i].type != ENDTOKEN; i++) {
 		switch (table[i].type) {
 		case NOTOKEN:
@@ -126,6 +247,28 @@ match_token(char *word, const struct token table[])
 				t = &table[i];
 			}
 			break;
+		case NAME:
+			if (word != NULL && strlen(word) > 0) {
+				res.name = word;
+				match++;
+				t = &table[i];
+			}
+			break;
+		case TABLENAME:
+			if (word != NULL && strlen(word) > 0) {
+				res.table = word;
+				match++;
+				t = &table[i];
+			}
+			break;
+		case FLAG:
+			if (word != NULL && strncmp(word, table[i].keyword,
+			    strlen(word)) == 0) {
+				res.flags |= table[i].value;
+				match++;
+				t = &table[i];
+			}
+			break;
 		case ENDTOKEN:
 			break;
 		}
@@ -155,11 +298,16 @@ show_valid_args(const struct token table[])
 			fprintf(stderr, "  <cr>\n");
 			break;
 		case KEYWORD:
+		case FLAG:
 			fprintf(stderr, "  %s\n", table[i].keyword);
 			break;
 		case LOGLEVEL:
 			fprintf(stderr, " %s\n", table[i].keyword);
 			break;
+		case NAME:
+		case TABLENAME:
+			fprintf(stderr, "  %s\n", table[i].keyword);
+			break;
 		case ENDTOKEN:
 			break;
 		}
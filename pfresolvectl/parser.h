@@ -22,12 +22,30 @@ enum actions {
 	NONE,
 	LOG,
 	RELOAD,
-	HINTS
+	HINTS,
+	SHOW_RESOLVERS,
+	SHOW_STATS,
+	SHOW_METRICS,
+	SHOW_HOSTS,
+	SHOW_TABLES,
+	TRACE,
+	HOST_ADD,
+	HOST_DEL,
+	IMPORT,
+	MONITOR,
+	REFRESH_HOST,
+	REFRESH_TABLE,
+	LOOKUP
 };
 
+#define F_WAIT		0x01
+
 struct parse_result {
 	enum actions	 action;
 	int              value;
+	char		*name;
+	char		*table;
+	int		 flags;
 };
 
 struct parse_result	*parse(int, char *[]);
@@ -20,7 +20,9 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <arpa/inet.h>
 
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -28,18 +30,62 @@
 #include <string.h>
 #include <err.h>
 #include <errno.h>
+#include <time.h>
 
 #include "pfresolved.h"
 #include "parser.h"
 
 __dead void	usage(void);
+int		show_resolvers_msg(struct imsg *);
+int		show_stats_msg(struct imsg *);
+void		show_stats(int);
+void		show_stats_line(struct ctl_stats *, int);
+double		show_stats_quantile(struct stats_histogram *, double);
+void		show_dump_start(struct parse_result *);
+int		show_dump_msg(struct imsg *, struct parse_result *);
+void		show_host(struct ctl_host *, struct parse_result *);
+void		show_table(struct ctl_table *, struct parse_result *);
+void		show_addresses(struct imsg *, struct parse_result *);
+void		show_json_string(const char *);
+void		show_json_next(void);
+const char	*show_address(struct pfresolved_address *);
+int		show_trace_msg(struct imsg *);
+void		show_trace(void);
+int		show_trace_cmp(const void *, const void *);
+int		show_update_msg(struct imsg *);
+void		import_hosts(struct imsgbuf *, const char *);
+void		import_send(struct imsgbuf *, char *, size_t);
+int		show_event_msg(struct imsg *);
+int		show_refresh_msg(struct imsg *, struct parse_result *);
+void		lookup_address(struct imsgbuf *, const char *);
+int		show_lookup_msg(struct imsg *, struct parse_result *);
+
+/* metrics are collected until all processes sent them */
+static struct ctl_stats	*stats;
+static int		 num_stats;
+
+/* output of show hosts and show tables is printed while it arrives */
+static int		 json;
+static int		 num_items;
+static int		 num_replies;
+static int		 in_addresses;
+
+/* the events of both processes are sorted by time */
+static struct trace_event *events;
+static size_t		 num_events;
+
+/* the last report of a change, set if the daemon rejected it */
+static struct ctl_update update;
+static int		 update_failed;
+static int		 progress;
 
 __dead void
 usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-s socket] command [arg ...]\n", __progname);
+	fprintf(stderr, "usage: %s [-j] [-s socket] command [arg ...]\n",
+	    __progname);
 
 	exit(1);
 }
@@ -51,14 +97,20 @@ main(int argc, char **argv)
 	struct parse_result	*res;
 	struct imsgbuf		*ibuf;
 	struct imsg		 imsg;
+	struct ctl_membership	 cm;
+	struct ctl_filter	 cf;
+	struct ctl_refresh	 rf;
 	int             	 c;
 	int			 ctl_sock;
 	int			 done = 1;
 	int			 n;
 	const char      	*sock = PFRESOLVED_SOCKET;
 
-	while ((c = getopt(argc, argv, "s:")) != -1) {
+	while ((c = getopt(argc, argv, "js:")) != -1) {
 		switch (c) {
+		case 'j':
+			json = 1;
+			break;
 		case 's':
 			sock = optarg;
 			break;
@@ -111,6 +163,82 @@ main(int argc, char **argv)
 		imsg_compose(ibuf, IMSG_CTL_HINTS, 0, 0, -1, NULL, 0);
 		printf("hints file request sent.\n");
 		break;
+	case SHOW_RESOLVERS:
+		imsg_compose(ibuf, IMSG_CTL_SHOW_RESOLVERS, 0, 0, -1, NULL, 0);
+		printf("%-24s %-11s %6s %7s %9s %9s %9s %9s %9s\n",
+		    "RESOLVER", "STATE", "SRTT", "P95", "QUERIES", "ANSWERS",
+		    "FAILURES", "TIMEOUTS", "HEDGES");
+		done = 0;
+		break;
+	case SHOW_STATS:
+	case SHOW_METRICS:
+		imsg_compose(ibuf, IMSG_CTL_SHOW_STATS, 0, 0, -1, NULL, 0);
+		done = 0;
+		break;
+	case SHOW_HOSTS:
+	case SHOW_TABLES:
+		if (res->name != NULL && strlen(res->name) > HOST_NAME_MAX)
+			errx(1, "name too long: %s", res->name);
+		imsg_compose(ibuf, res->action == SHOW_HOSTS ?
+		    IMSG_CTL_SHOW_HOSTS : IMSG_CTL_SHOW_TABLES, 0, 0, -1,
+		    res->name, res->name ? strlen(res->name) : 0);
+		show_dump_start(res);
+		done = 0;
+		break;
+	case TRACE:
+		imsg_compose(ibuf, IMSG_CTL_TRACE, 0, 0, -1, NULL, 0);
+		done = 0;
+		break;
+	case HOST_ADD:
+	case HOST_DEL:
+		bzero(&cm, sizeof(cm));
+		if (strlcpy(cm.cm_table, res->table, sizeof(cm.cm_table)) >=
+		    sizeof(cm.cm_table))
+			errx(1, "table name too long: %s", res->table);
+		if (strlcpy(cm.cm_hostname, res->name,
+		    sizeof(cm.cm_hostname)) >= sizeof(cm.cm_hostname))
+			errx(1, "hostname too long: %s", res->name);
+		imsg_compose(ibuf, res->action == HOST_ADD ?
+		    IMSG_CTL_HOST_ADD : IMSG_CTL_HOST_DEL, 0, 0, -1,
+		    &cm, sizeof(cm));
+		done = 0;
+		break;
+	case IMPORT:
+		import_hosts(ibuf, res->table);
+		done = 0;
+		break;
+	case MONITOR:
+		bzero(&cf, sizeof(cf));
+		if (res->table != NULL && strlcpy(cf.cf_table, res->table,
+		    sizeof(cf.cf_table)) >= sizeof(cf.cf_table))
+			errx(1, "table name too long: %s", res->table);
+		if (res->name != NULL && strlcpy(cf.cf_hostname, res->name,
+		    sizeof(cf.cf_hostname)) >= sizeof(cf.cf_hostname))
+			errx(1, "hostname too long: %s", res->name);
+		imsg_compose(ibuf, IMSG_CTL_MONITOR, 0, 0, -1, &cf,
+		    sizeof(cf));
+		done = 0;
+		break;
+	case REFRESH_HOST:
+	case REFRESH_TABLE:
+		bzero(&rf, sizeof(rf));
+		if (res->action == REFRESH_TABLE &&
+		    strlen(res->table) >= PF_TABLE_NAME_SIZE)
+			errx(1, "table name too long: %s", res->table);
+		if (strlcpy(rf.rf_name, res->action == REFRESH_HOST ?
+		    res->name : res->table, sizeof(rf.rf_name)) >=
+		    sizeof(rf.rf_name))
+			errx(1, "hostname too long: %s", res->name);
+		rf.rf_wait = (res->flags & F_WAIT) != 0;
+		imsg_compose(ibuf, res->action == REFRESH_HOST ?
+		    IMSG_CTL_REFRESH_HOST : IMSG_CTL_REFRESH_TABLE, 0, 0, -1,
+		    &rf, sizeof(rf));
+		done = 0;
+		break;
+	case LOOKUP:
+		lookup_address(ibuf, res->name);
+		done = 0;
+		break;
 	}
 
 	while (ibuf->w.queued) {
@@ -131,6 +259,39 @@ main(int argc, char **argv)
 				break;
 
 			switch (res->action) {
+			case SHOW_RESOLVERS:
+				done = show_resolvers_msg(&imsg);
+				break;
+			case SHOW_STATS:
+			case SHOW_METRICS:
+				done = show_stats_msg(&imsg);
+				if (done)
+					show_stats(res->action == SHOW_METRICS);
+				break;
+			case SHOW_HOSTS:
+			case SHOW_TABLES:
+				done = show_dump_msg(&imsg, res);
+				break;
+			case TRACE:
+				done = show_trace_msg(&imsg);
+				if (done)
+					show_trace();
+				break;
+			case HOST_ADD:
+			case HOST_DEL:
+			case IMPORT:
+				done = show_update_msg(&imsg);
+				break;
+			case MONITOR:
+				done = show_event_msg(&imsg);
+				break;
+			case REFRESH_HOST:
+			case REFRESH_TABLE:
+				done = show_refresh_msg(&imsg, res);
+				break;
+			case LOOKUP:
+				done = show_lookup_msg(&imsg, res);
+				break;
 			default:
 				break;
 			}
@@ -142,5 +303,754 @@ main(int argc, char **argv)
 	close(ctl_sock);
 	free(ibuf);
 
+	return (update_failed);
+}
+
+int
+show_resolvers_msg(struct imsg *imsg)
+{
+	struct ctl_resolver	 cr;
+	char			 state[16];
+
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_SHOW_RESOLVERS:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(cr))
+			errx(1, "%s: invalid message size", __func__);
+		memcpy(&cr, imsg->data, sizeof(cr));
+		cr.cr_name[sizeof(cr.cr_name) - 1] = '\0';
+
+		switch (cr.cr_state) {
+		case RESOLVER_UP:
+			strlcpy(state, "up", sizeof(state));
+			break;
+		case RESOLVER_DOWN:
+			snprintf(state, sizeof(state), "down %us", cr.cr_down);
+			break;
+		case RESOLVER_PROBE:
+			strlcpy(state, "probing", sizeof(state));
+			break;
+		}
+
+		printf("%-24s %-11s %4ums %5ums %9llu %9llu %9llu %9llu "
+		    "%9llu\n", cr.cr_name, state, cr.cr_srtt, cr.cr_p95,
+		    (unsigned long long)cr.cr_queries,
+		    (unsigned long long)cr.cr_answers,
+		    (unsigned long long)cr.cr_failures,
+		    (unsigned long long)cr.cr_timeouts,
+		    (unsigned long long)cr.cr_hedges);
+		break;
+	case IMSG_CTL_END:
+		return (1);
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+int
+show_stats_msg(struct imsg *imsg)
+{
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_SHOW_STATS:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(*stats))
+			errx(1, "%s: invalid message size", __func__);
+		if ((stats = recallocarray(stats, num_stats, num_stats + 1,
+		    sizeof(*stats))) == NULL)
+			err(1, "%s: recallocarray", __func__);
+		memcpy(&stats[num_stats], imsg->data, sizeof(*stats));
+		stats[num_stats].cs_name[STATS_NAME_SIZE - 1] = '\0';
+		stats[num_stats].cs_label[STATS_LABEL_SIZE - 1] = '\0';
+		stats[num_stats].cs_help[STATS_LABEL_SIZE - 1] = '\0';
+		if (stats[num_stats].cs_type > STATS_HISTOGRAM)
+			errx(1, "%s: invalid metric type", __func__);
+		num_stats++;
+		break;
+	case IMSG_CTL_END:
+		return (1);
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+/*
+ * Print the metrics grouped by name, either as a table or in the Prometheus
+ * text format.
+ */
+void
+show_stats(int prometheus)
+{
+	static const char	*types[] = { "counter", "gauge", "histogram" };
+	char			*printed;
+	int			 i, j;
+
+	if ((printed = calloc(num_stats, 1)) == NULL && num_stats > 0)
+		err(1, "%s: calloc", __func__);
+
+	for (i = 0; i < num_stats; i++) {
+		if (printed[i])
+			continue;
+		if (prometheus) {
+			printf("# HELP pfresolved_%s %s\n", stats[i].cs_name,
+			    stats[i].cs_help);
+			printf("# TYPE pfresolved_%s %s\n", stats[i].cs_name,
+			    types[stats[i].cs_type]);
+		}
+		for (j = i; j < num_stats; j++) {
+			if (printed[j] ||
+			    strcmp(stats[i].cs_name, stats[j].cs_name) != 0)
+				continue;
+			show_stats_line(&stats[j], prometheus);
+			printed[j] = 1;
+		}
+	}
+
+	free(printed);
+	free(stats);
+}
+
+void
+show_stats_line(struct ctl_stats *cs, int prometheus)
+{
+	struct stats_histogram	*sh = &cs->cs_histogram;
+	const char		*label = cs->cs_label;
+	char			 name[STATS_NAME_SIZE + STATS_LABEL_SIZE + 16];
+	uint64_t		 count = 0;
+	int			 i;
+
+	snprintf(name, sizeof(name), "%s%s%s%s", cs->cs_name,
+	    *label ? "{" : "", label, *label ? "}" : "");
+
+	if (!prometheus) {
+		if (cs->cs_type != STATS_HISTOGRAM) {
+			printf("%-48s %llu\n", name,
+			    (unsigned long long)cs->cs_value);
+			return;
+		}
+		printf("%-48s count %llu, p50 %.6fs, p99 %.6fs, p999 %.6fs\n",
+		    name, (unsigned long long)sh->sh_count,
+		    show_stats_quantile(sh, 0.5), show_stats_quantile(sh, 0.99),
+		    show_stats_quantile(sh, 0.999));
+		return;
+	}
+
+	if (cs->cs_type != STATS_HISTOGRAM) {
+		printf("pfresolved_%s %llu\n", name,
+		    (unsigned long long)cs->cs_value);
+		return;
+	}
+
+	/* only the buckets that end at powers of two microseconds are shown */
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		count += sh->sh_buckets[i];
+		if (i % STATS_SUB_BUCKETS != STATS_SUB_BUCKETS - 1)
+			continue;
+		printf("pfresolved_%s_bucket{%s%sle=\"%g\"} %llu\n",
+		    cs->cs_name, label, *label ? "," : "",
+		    (STATS_BUCKET_UPPER(i) + 1) / 1e6,
+		    (unsigned long long)count);
+	}
+	printf("pfresolved_%s_bucket{%s%sle=\"+Inf\"} %llu\n", cs->cs_name,
+	    label, *label ? "," : "", (unsigned long long)sh->sh_count);
+	printf("pfresolved_%s_sum%s%s%s %g\n", cs->cs_name, *label ? "{" : "",
+	    label, *label ? "}" : "", sh->sh_sum / 1e6);
+	printf("pfresolved_%s_count%s%s%s %llu\n", cs->cs_name,
+	    *label ? "{" : "", label, *label ? "}" : "",
+	    (unsigned long long)sh->sh_count);
+}
+
+/*
+ * The quantile is the upper bound of the bucket that contains it, so it is
+ * at most a quarter above the real value.
+ */
+double
+show_stats_quantile(struct stats_histogram *sh, double q)
+{
+	uint64_t		 count = 0, rank;
+	int			 i;
+
+	if (sh->sh_count == 0)
+		return (0.0);
+
+	rank = sh->sh_count * q;
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		count += sh->sh_buckets[i];
+		if (count >= rank)
+			break;
+	}
+	if (i == STATS_BUCKETS)
+		i--;
+
+	return ((STATS_BUCKET_UPPER(i) + 1) / 1e6);
+}
+
+/*
+ * Hosts and tables are listed one per line. A single host or table is shown
+ * with its tables and addresses. With -j the output is a JSON array of
+ * objects or a single object.
+ */
+void
+show_dump_start(struct parse_result *res)
+{
+	if (json) {
+		if (res->name == NULL)
+			printf("[");
+		return;
+	}
+
+	if (res->name != NULL)
+		return;
+	if (res->action == SHOW_HOSTS)
+		printf("%-40s %6s %6s %6s %6s %6s %6s %s\n", "HOST", "A",
+		    "AAAA", "NEXT4", "NEXT6", "FAILED", "TABLES", "CNAME");
+	else
+		printf("%-32s %9s %9s\n", "TABLE", "ENTRIES", "STATIC");
+}
+
+int
+show_dump_msg(struct imsg *imsg, struct parse_result *res)
+{
+	struct ctl_host		 ch;
+	struct ctl_table	 ct;
+
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_HOST:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(ch))
+			errx(1, "%s: invalid message size", __func__);
+		memcpy(&ch, imsg->data, sizeof(ch));
+		ch.ch_hostname[sizeof(ch.ch_hostname) - 1] = '\0';
+		ch.ch_canon[sizeof(ch.ch_canon) - 1] = '\0';
+		show_host(&ch, res);
+		num_replies++;
+		break;
+	case IMSG_CTL_TABLE:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(ct))
+			errx(1, "%s: invalid message size", __func__);
+		memcpy(&ct, imsg->data, sizeof(ct));
+		ct.ct_name[sizeof(ct.ct_name) - 1] = '\0';
+		show_table(&ct, res);
+		num_replies++;
+		break;
+	case IMSG_CTL_ADDRESSES:
+		show_addresses(imsg, res);
+		break;
+	case IMSG_CTL_END:
+		if (res->name != NULL && num_replies == 0)
+			errx(1, "%s %s not found", res->action == SHOW_HOSTS ?
+			    "host" : "table", res->name);
+		if (!json)
+			return (1);
+		if (res->name == NULL)
+			printf("]\n");
+		else if (res->action == SHOW_HOSTS && !in_addresses)
+			printf("],\"addresses\":[]}\n");
+		else
+			printf("]}\n");
+		return (1);
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+void
+show_host(struct ctl_host *ch, struct parse_result *res)
+{
+	char		 next4[16], next6[16];
+
+	if (json) {
+		if (res->name == NULL)
+			show_json_next();
+		printf("{\"hostname\":");
+		show_json_string(ch->ch_hostname);
+		printf(",\"cname\":");
+		if (ch->ch_canon[0] != '\0')
+			show_json_string(ch->ch_canon);
+		else
+			printf("null");
+		printf(",\"a\":{\"addresses\":%d,\"next\":%d,\"failures\":%d}"
+		    ",\"aaaa\":{\"addresses\":%d,\"next\":%d,\"failures\":%d}",
+		    ch->ch_num_v4, ch->ch_next_v4, ch->ch_tries_v4,
+		    ch->ch_num_v6, ch->ch_next_v6, ch->ch_tries_v6);
+		if (res->name == NULL)
+			printf(",\"tables\":%d}", ch->ch_num_tables);
+		else
+			printf(",\"tables\":[");
+		return;
+	}
+
+	/* no timer is scheduled for AAAA if both are resolved together */
+	strlcpy(next4, "-", sizeof(next4));
+	strlcpy(next6, "-", sizeof(next6));
+	if (ch->ch_next_v4 != -1)
+		snprintf(next4, sizeof(next4), "%ds", ch->ch_next_v4);
+	if (ch->ch_next_v6 != -1)
+		snprintf(next6, sizeof(next6), "%ds", ch->ch_next_v6);
+
+	if (res->name == NULL) {
+		printf("%-40s %6d %6d %6s %6s %6d %6d %s\n", ch->ch_hostname,
+		    ch->ch_num_v4, ch->ch_num_v6, next4, next6,
+		    ch->ch_tries_v4 + ch->ch_tries_v6, ch->ch_num_tables,
+		    ch->ch_canon[0] ? ch->ch_canon : "-");
+		return;
+	}
+
+	printf("host: %s\n", ch->ch_hostname);
+	printf("cname: %s\n", ch->ch_canon[0] ? ch->ch_canon : "-");
+	printf("A: %d addresses, next resolve %s, %d failures\n",
+	    ch->ch_num_v4, next4, ch->ch_tries_v4);
+	printf("AAAA: %d addresses, next resolve %s, %d failures\n",
+	    ch->ch_num_v6, next6, ch->ch_tries_v6);
+}
+
+void
+show_table(struct ctl_table *ct, struct parse_result *res)
+{
+	/* the tables of a single host are only names */
+	if (res->action == SHOW_HOSTS) {
+		if (json) {
+			show_json_next();
+			show_json_string(ct->ct_name);
+		} else
+			printf("table: %s\n", ct->ct_name);
+		return;
+	}
+
+	if (json) {
+		if (res->name == NULL)
+			show_json_next();
+		printf("{\"name\":");
+		show_json_string(ct->ct_name);
+		printf(",\"entries\":%d,\"static\":%d", ct->ct_num_entries,
+		    ct->ct_num_static);
+		printf(res->name == NULL ? "}" : ",\"addresses\":[");
+		return;
+	}
+
+	if (res->name == NULL)
+		printf("%-32s %9d %9d\n", ct->ct_name, ct->ct_num_entries,
+		    ct->ct_num_static);
+	else
+		printf("table: %s\nentries: %d, static: %d\n", ct->ct_name,
+		    ct->ct_num_entries, ct->ct_num_static);
+}
+
+void
+show_addresses(struct imsg *imsg, struct parse_result *res)
+{
+	struct ctl_address	 ca;
+	size_t			 len;
+	uint8_t			*ptr;
+
+	len = IMSG_DATA_SIZE(imsg);
+	if (len % sizeof(ca) != 0)
+		errx(1, "%s: invalid message size", __func__);
+
+	/* the addresses of a host follow the array of its tables */
+	if (json && res->action == SHOW_HOSTS && !in_addresses) {
+		printf("],\"addresses\":[");
+		num_items = 0;
+		in_addresses = 1;
+	}
+
+	for (ptr = imsg->data; len > 0; ptr += sizeof(ca), len -= sizeof(ca)) {
+		memcpy(&ca, ptr, sizeof(ca));
+
+		if (!json) {
+			printf("address: %s%s%s\n", ca.ca_negate ? "!" : "",
+			    show_address(&ca.ca_addr),
+			    ca.ca_static ? " (static)" : "");
+			continue;
+		}
+
+		show_json_next();
+		if (res->action == SHOW_HOSTS) {
+			show_json_string(show_address(&ca.ca_addr));
+			continue;
+		}
+		printf("{\"address\":");
+		show_json_string(show_address(&ca.ca_addr));
+		printf(",\"negate\":%s,\"static\":%s}",
+		    ca.ca_negate ? "true" : "false",
+		    ca.ca_static ? "true" : "false");
+	}
+}
+
+/* elements of a JSON array are separated by commas */
+void
+show_json_next(void)
+{
+	if (num_items++ > 0)
+		printf(",");
+}
+
+void
+show_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", (unsigned char)*str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+const char *
+show_address(struct pfresolved_address *addr)
+{
+	static char	 buf[INET6_ADDRSTRLEN + 8];
+	char		 prefix[8];
+	int		 full;
+
+	if (inet_ntop(addr->pfa_af, &addr->pfa_addr, buf, sizeof(buf)) ==
+	    NULL)
+		return ("(UNKNOWN AF)");
+
+	full = addr->pfa_af == AF_INET ? 32 : 128;
+	if (addr->pfa_prefixlen >= 0 && addr->pfa_prefixlen < full) {
+		snprintf(prefix, sizeof(prefix), "/%d", addr->pfa_prefixlen);
+		strlcat(buf, prefix, sizeof(buf));
+	}
+
+	return (buf);
+}
+
+int
+show_trace_msg(struct imsg *imsg)
+{
+	size_t			 len, num;
+
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_TRACE:
+		len = IMSG_DATA_SIZE(imsg);
+		if (len % sizeof(*events) != 0)
+			errx(1, "%s: invalid message size", __func__);
+		num = len / sizeof(*events);
+		if ((events = recallocarray(events, num_events,
+		    num_events + num, sizeof(*events))) == NULL)
+			err(1, "%s: recallocarray", __func__);
+		memcpy(&events[num_events], imsg->data, len);
+		num_events += num;
+		break;
+	case IMSG_CTL_END:
+		return (1);
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+/*
+ * The events are shown with their age in seconds, the monotonic clock of
+ * the daemon is the same as the one of pfresolvectl.
+ */
+void
+show_trace(void)
+{
+	static const char	*types[] = {
+		"timer", "request", "answer", "result", "diff", "commit",
+		"error"
+	};
+	struct trace_event	*te;
+	struct timespec		 now;
+	uint64_t		 usec;
+	size_t			 i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+	qsort(events, num_events, sizeof(*events), show_trace_cmp);
+
+	printf("%12s %-9s %-7s %-4s %-32s %s\n", "AGE", "PROCESS", "EVENT",
+	    "TYPE", "NAME", "VALUE");
+	for (i = 0; i < num_events; i++) {
+		te = &events[i];
+		te->te_name[sizeof(te->te_name) - 1] = '\0';
+		printf("%12.6f %-9s %-7s %-4s %-32s %lld\n",
+		    te->te_usec < usec ? (usec - te->te_usec) / 1e6 : 0.0,
+		    te->te_proc == PROC_PARENT ? "parent" : "forwarder",
+		    te->te_type < nitems(types) ? types[te->te_type] : "?",
+		    te->te_af == AF_INET ? "A" : te->te_af == AF_INET6 ?
+		    "AAAA" : "-", te->te_name[0] ? te->te_name : "-",
+		    (long long)te->te_value);
+	}
+
+	free(events);
+}
+
+int
+show_trace_cmp(const void *a, const void *b)
+{
+	const struct trace_event	*ta = a, *tb = b;
+
+	if (ta->te_usec < tb->te_usec)
+		return (-1);
+	return (ta->te_usec > tb->te_usec);
+}
+
+int
+show_update_msg(struct imsg *imsg)
+{
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_UPDATE:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(update))
+			errx(1, "%s: invalid message size", __func__);
+		memcpy(&update, imsg->data, sizeof(update));
+		update.cu_error[sizeof(update.cu_error) - 1] = '\0';
+		if (progress)
+			fprintf(stderr, "\rreceived %d", update.cu_received);
+		break;
+	case IMSG_CTL_END:
+		if (progress)
+			fprintf(stderr, "\n");
+		if (update.cu_error[0] != '\0') {
+			warnx("%s", update.cu_error);
+			update_failed = 1;
+		}
+		printf("received %d, added %d, removed %d, kept %d, "
+		    "failed %d\n", update.cu_received, update.cu_added,
+		    update.cu_removed, update.cu_kept, update.cu_failed);
+		return (1);
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+/*
+ * Send the names from stdin, one per line, in full messages. Progress
+ * reports are read while sending, the totals arrive after the last name.
+ */
+void
+import_hosts(struct imsgbuf *ibuf, const char *table)
+{
+	char		 buf[MAX_IMSGSIZE - IMSG_HEADER_SIZE];
+	char		*line = NULL, *name;
+	size_t		 linesize = 0, len = 0, namelen;
+
+	if (strlen(table) >= PF_TABLE_NAME_SIZE)
+		errx(1, "table name too long: %s", table);
+	imsg_compose(ibuf, IMSG_CTL_IMPORT_START, 0, 0, -1, table,
+	    strlen(table));
+
+	progress = isatty(STDERR_FILENO);
+
+	while (getline(&line, &linesize, stdin) != -1) {
+		name = line + strspn(line, " \t");
+		name[strcspn(name, " \t\r\n")] = '\0';
+		if (*name == '\0' || *name == '#')
+			continue;
+
+		namelen = strlen(name) + 1;
+		if (namelen > HOST_NAME_MAX + 1)
+			errx(1, "hostname too long: %s", name);
+		if (len + namelen > sizeof(buf)) {
+			import_send(ibuf, buf, len);
+			len = 0;
+		}
+		memcpy(buf + len, name, namelen);
+		len += namelen;
+	}
+	if (ferror(stdin))
+		err(1, "%s: stdin", __func__);
+	free(line);
+
+	if (len > 0)
+		import_send(ibuf, buf, len);
+	imsg_compose(ibuf, IMSG_CTL_IMPORT_END, 0, 0, -1, NULL, 0);
+}
+
+void
+import_send(struct imsgbuf *ibuf, char *buf, size_t len)
+{
+	struct pollfd	 pfd;
+	struct imsg	 imsg;
+	int		 n;
+
+	imsg_compose(ibuf, IMSG_CTL_IMPORT_NAMES, 0, 0, -1, buf, len);
+	while (ibuf->w.queued) {
+		if (msgbuf_write(&ibuf->w) <= 0 && errno != EAGAIN)
+			err(1, "%s: msgbuf_write", __func__);
+	}
+
+	pfd.fd = ibuf->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) <= 0)
+		return;
+
+	if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+		errx(1, "%s: imsg_read error", __func__);
+	if (n == 0)
+		errx(1, "%s: pipe closed", __func__);
+
+	for (;;) {
+		if ((n = imsg_get(ibuf, &imsg)) == -1)
+			errx(1, "%s: imsg_get error", __func__);
+		if (n == 0)
+			break;
+		show_update_msg(&imsg);
+		imsg_free(&imsg);
+	}
+}
+
+/* events are printed as they arrive, one line each, until interrupted */
+int
+show_event_msg(struct imsg *imsg)
+{
+	struct ctl_event	 ce;
+	struct tm		*tm;
+	time_t			 t;
+	char			 tstr[32];
+	const char		*type;
+
+	if (imsg->hdr.type != IMSG_CTL_EVENT)
+		return (0);
+
+	if (IMSG_DATA_SIZE(imsg) != sizeof(ce))
+		errx(1, "%s: invalid message size", __func__);
+	memcpy(&ce, imsg->data, sizeof(ce));
+	ce.ce_table[sizeof(ce.ce_table) - 1] = '\0';
+	ce.ce_hostname[sizeof(ce.ce_hostname) - 1] = '\0';
+
+	t = ce.ce_time;
+	if ((tm = gmtime(&t)) == NULL ||
+	    strftime(tstr, sizeof(tstr), "%Y-%m-%dT%H:%M:%SZ", tm) == 0)
+		strlcpy(tstr, "-", sizeof(tstr));
+	type = ce.ce_type == CTL_EVENT_ADD ? "add" : "remove";
+
+	if (json) {
+		printf("{\"time\":\"%s\",\"event\":\"%s\",\"table\":", tstr,
+		    type);
+		show_json_string(ce.ce_table);
+		printf(",\"address\":\"%s\",\"hostname\":",
+		    show_address(&ce.ce_addr));
+		show_json_string(ce.ce_hostname);
+		printf(",\"dropped\":%u}\n", ce.ce_dropped);
+	} else {
+		if (ce.ce_dropped > 0)
+			printf("dropped %u events\n", ce.ce_dropped);
+		printf("%s %-6s %s %s %s\n", tstr, type, ce.ce_table,
+		    show_address(&ce.ce_addr), ce.ce_hostname);
+	}
+	fflush(stdout);
+
+	return (0);
+}
+
+/*
+ * The daemon answers when the hosts are scheduled. With wait the end of
+ * the reply only arrives after their addresses were written to pf.
+ */
+int
+show_refresh_msg(struct imsg *imsg, struct parse_result *res)
+{
+	struct ctl_refresh	 rf;
+
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_REFRESH:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(rf))
+			errx(1, "%s: invalid message size", __func__);
+		memcpy(&rf, imsg->data, sizeof(rf));
+		rf.rf_error[sizeof(rf.rf_error) - 1] = '\0';
+		if (rf.rf_error[0] != '\0') {
+			warnx("%s", rf.rf_error);
+			update_failed = 1;
+			break;
+		}
+		printf("refreshing %d hosts, last request in %d seconds\n",
+		    rf.rf_hosts, rf.rf_seconds);
+		fflush(stdout);
+		break;
+	case IMSG_CTL_END:
+		if ((res->flags & F_WAIT) && !update_failed)
+			printf("refresh done\n");
+		return (1);
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+void
+lookup_address(struct imsgbuf *ibuf, const char *name)
+{
+	struct pfresolved_address	 addr;
+
+	bzero(&addr, sizeof(addr));
+	if (inet_pton(AF_INET, name, &addr.pfa_addr.in4) == 1) {
+		addr.pfa_af = AF_INET;
+		addr.pfa_prefixlen = 32;
+	} else if (inet_pton(AF_INET6, name, &addr.pfa_addr.in6) == 1) {
+		addr.pfa_af = AF_INET6;
+		addr.pfa_prefixlen = 128;
+	} else
+		errx(1, "invalid address: %s", name);
+
+	imsg_compose(ibuf, IMSG_CTL_LOOKUP, 0, 0, -1, &addr, sizeof(addr));
+
+	if (json)
+		printf("[");
+	else
+		printf("%-32s %s\n", "TABLE", "HOST");
+}
+
+/* one line per table and host that contain the address */
+int
+show_lookup_msg(struct imsg *imsg, struct parse_result *res)
+{
+	struct ctl_lookup	 cl;
+
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_LOOKUP:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(cl))
+			errx(1, "%s: invalid message size", __func__);
+		memcpy(&cl, imsg->data, sizeof(cl));
+		cl.cl_hostname[sizeof(cl.cl_hostname) - 1] = '\0';
+		cl.cl_table[sizeof(cl.cl_table) - 1] = '\0';
+		num_replies++;
+
+		if (!json) {
+			if (cl.cl_static)
+				printf("%-32s %s(static)\n", cl.cl_table,
+				    cl.cl_negate ? "!" : "");
+			else
+				printf("%-32s %s\n", cl.cl_table,
+				    cl.cl_hostname);
+			break;
+		}
+		show_json_next();
+		printf("{\"table\":");
+		show_json_string(cl.cl_table);
+		printf(",\"hostname\":");
+		if (cl.cl_static)
+			printf("null");
+		else
+			show_json_string(cl.cl_hostname);
+		printf(",\"static\":%s,\"negate\":%s}",
+		    cl.cl_static ? "true" : "false",
+		    cl.cl_negate ? "true" : "false");
+		break;
+	case IMSG_CTL_END:
+		if (num_replies == 0)
+			errx(1, "address %s not found", res->name);
+		if (json)
+			printf("]\n");
+		return (1);
+	default:
+		break;
+	}
+
 	return (0);
 }
@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <arpa/inet.h>
+
 #include <fcntl.h>
 #include <getopt.h>
 #include <pwd.h>
@@ -22,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "pfresolved.h"
@@ -37,23 +40,59 @@ void	 parent_reload(struct pfresolved *);
 void	 parent_start_resolve_timeouts(struct pfresolved *);
 void	 parent_send_resolve_request_v4(struct pfresolved *, void *);
 void	 parent_send_resolve_request_v6(struct pfresolved *, void *);
+void	 parent_send_resolve_request_dual(struct pfresolved *, void *);
 void	 parent_send_resolve_request(struct pfresolved *, sa_family_t,
 	     struct pfresolved_host *);
 void	 parent_process_resolve_result(struct pfresolved *, struct imsg *);
+void	 parent_finish_dual_result(struct pfresolved *,
+	     struct pfresolved_host *, int);
 struct pfresolved_host *
 	 parent_get_resolve_result_data(struct pfresolved *, struct imsg *,
-	     sa_family_t *, int *, int *, struct pfresolved_address **);
-int	 parent_address_cmp(const void *, const void *);
-void	 parent_update_host_addresses(struct pfresolved *,
-	     struct pfresolved_host *, struct pfresolved_address *, int,
+	     sa_family_t *, int *, int *, char *, int *, int *,
+	     const uint8_t **);
+uint64_t parent_host_fingerprint(struct pfresolved_host *, sa_family_t);
+int	 parent_host_has_keys(struct pfresolved_host *, sa_family_t,
+	     const uint8_t *, int);
+void	 parent_start_host_timers(struct pfresolved *,
+	     struct pfresolved_host *, int);
+void	 parent_update_canon(struct pfresolved *, struct pfresolved_host *,
+	     const char *, int, int);
+void	 parent_unlink_alias(struct pfresolved *, struct pfresolved_host *);
+void	 parent_free_host(struct pfresolved *, struct pfresolved_host *);
+void	 parent_fanout_addresses(struct pfresolved *,
+	     struct pfresolved_host *, sa_family_t);
+void	 parent_append_pending_addresses(struct pfresolved_host *,
+	     sa_family_t, const uint8_t *, int);
+void	 parent_free_pending_addresses(struct pfresolved_host *,
+	     sa_family_t);
+int	 parent_update_host_addresses(struct pfresolved *,
+	     struct pfresolved_host *, const uint8_t *, int, sa_family_t);
+int	 parent_set_host_addrset(struct pfresolved *,
+	     struct pfresolved_host *, struct pfresolved_addrset *,
 	     sa_family_t);
 void	 parent_add_table_entries(struct pfresolved *,
 	     struct pfresolved_host *, struct pfresolved_address *);
+void	 parent_add_table_entry(struct pfresolved *,
+	     struct pfresolved_table *, struct pfresolved_host *,
+	     struct pfresolved_address *);
 void	 parent_remove_table_entries(struct pfresolved *,
 	     struct pfresolved_host *, struct pfresolved_address *);
+void	 parent_remove_table_entry(struct pfresolved *,
+	     struct pfresolved_table *, struct pfresolved_host *,
+	     struct pfresolved_address *);
+void	 parent_set_table_membership(struct pfresolved *,
+	     struct pfresolved_host *, struct pfresolved_table *, int);
+void	 parent_set_table_addrset(struct pfresolved *,
+	     struct pfresolved_table *, struct pfresolved_host *,
+	     struct pfresolved_addrset *, sa_family_t, int);
+void	 parent_monitor_event(struct pfresolved *, enum ctl_event_type,
+	     struct pfresolved_table *, struct pfresolved_host *,
+	     struct pfresolved_address *);
 int	 parent_init_pftables(struct pfresolved *);
 void	 parent_clear_pftables(struct pfresolved *);
 void	 parent_write_hints_file(struct pfresolved *);
+void	 parent_show_stats(struct pfresolved *, uint32_t);
+void	 parent_ctl_host(struct pfresolved *, struct imsg *);
 
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -75,10 +114,11 @@ usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-dnTv] [-A trust_anchor_file] "
-	    "[-C cert_bundle_file] [-f file] [-h hints_file] [-i outbound_ip] "
-	    "[-M seconds] [-m seconds] [-r resolver] [-S dnssec_level] "
-	    "[-s socket]", __progname);
+	fprintf(stderr, "usage: %s [-bdKnTv] [-A trust_anchor_file] "
+	    "[-C cert_bundle_file] [-e engine] [-f file] [-H percent] "
+	    "[-h hints_file] [-i outbound_ip] [-M seconds] [-m seconds] "
+	    "[-R socket] [-r resolver] [-S dnssec_level] [-s socket]",
+	    __progname);
 	exit(1);
 }
 
@@ -87,18 +127,20 @@ main(int argc, char **argv)
 {
 	int			 c;
 	int			 debug = 0, verbose = 0, no_action = 0;
-	int			 use_dot = 0;
+	int			 use_dot = 0, key_cache = 0, dual_stack = 0;
 	int			 min_ttl = MIN_TTL_DEFAULT;
 	int			 max_ttl = MAX_TTL_DEFAULT;
 	int			 num_resolvers = 0;
+	int			 hedge_budget = 0;
 	const char		*conffile = PFRESOLVED_CONFIG;
-	const char		*sock = PFRESOLVED_SOCKET;
+	const char		*sock = PFRESOLVED_SOCKET, *rsock = NULL;
 	const char		*errstr, *title = NULL;
 	const char		*outbound_ip = NULL;
 	const char		*cert_bundle = NULL, *trust_anchor = NULL;
 	const char		*hints_file = NULL;
 	const char	       **resolvers = NULL;
 	enum dnssec_level	 dnssec_level = DNSSEC_NONE;
+	enum forwarder_engine	 engine = ENGINE_UNBOUND;
 	struct pfresolved	*env = NULL;
 	struct privsep		*ps;
 	enum privsep_procid	 proc_id = PROC_PARENT;
@@ -107,20 +149,39 @@ main(int argc, char **argv)
 
 	log_init(1, LOG_DAEMON);
 
-	while ((c = getopt(argc, argv, "A:C:df:h:i:I:m:M:nP:r:s:S:Tv")) != -1) {
+	while ((c = getopt(argc, argv,
+	    "A:bC:de:f:H:h:i:I:Km:M:nP:R:r:s:S:Tv")) != -1) {
 		switch (c) {
 		case 'A':
 			trust_anchor = optarg;
 			break;
+		case 'b':
+			dual_stack = 1;
+			break;
 		case 'C':
 			cert_bundle = optarg;
 			break;
 		case 'd':
 			debug++;
 			break;
+		case 'e':
+			if (strcmp(optarg, "unbound") == 0)
+				engine = ENGINE_UNBOUND;
+			else if (strcmp(optarg, "stub") == 0)
+				engine = ENGINE_STUB;
+			else if (strcmp(optarg, "event") == 0)
+				engine = ENGINE_EVENT;
+			else
+				fatalx("invalid engine");
+			break;
 		case 'f':
 			conffile = optarg;
 			break;
+		case 'H':
+			hedge_budget = strtonum(optarg, 1, 100, &errstr);
+			if (errstr)
+				fatalx("invalid hedge budget");
+			break;
 		case 'h':
 			hints_file = optarg;
 			break;
@@ -133,6 +194,9 @@ main(int argc, char **argv)
 			if (errstr)
 				fatalx("invalid process instance");
 			break;
+		case 'K':
+			key_cache = 1;
+			break;
 		case 'm':
 			min_ttl = strtonum(optarg, 0, INT_MAX, &errstr);
 			if (errstr)
@@ -152,6 +216,9 @@ main(int argc, char **argv)
 			if (proc_id == PROC_MAX)
 				fatalx("invalid process name");
 			break;
+		case 'R':
+			rsock = optarg;
+			break;
 		case 'r':
 			if ((resolvers = recallocarray(resolvers, num_resolvers,
 			    num_resolvers + 1, sizeof(*resolvers))) == NULL)
@@ -183,6 +250,21 @@ main(int argc, char **argv)
 	if (argc > 0)
 		usage();
 
+	if (engine == ENGINE_STUB) {
+		if (dnssec_level > DNSSEC_NONE)
+			fatalx("the stub engine does not support DNSSEC");
+		if (num_resolvers == 0)
+			fatalx("the stub engine requires a resolver");
+	} else if (hedge_budget > 0)
+		fatalx("hedging requires the stub engine");
+
+	if (key_cache && dnssec_level == DNSSEC_NONE)
+		fatalx("key caching requires DNSSEC validation");
+
+	/* libunbound sets up TLS again after the event base was changed */
+	if (engine == ENGINE_EVENT && use_dot)
+		fatalx("the event engine does not support DNS-over-TLS");
+
 	if ((env = calloc(1, sizeof(*env))) == NULL)
 		fatal("calloc: env");
 
@@ -201,9 +283,14 @@ main(int argc, char **argv)
 	env->sc_cert_bundle = cert_bundle;
 	env->sc_dnssec_level = dnssec_level;
 	env->sc_trust_anchor = trust_anchor;
+	env->sc_engine = engine;
+	env->sc_hedge_budget = hedge_budget;
+	env->sc_key_cache = key_cache;
+	env->sc_dual_stack = dual_stack;
 
 	RB_INIT(&env->sc_tables);
 	RB_INIT(&env->sc_hosts);
+	RB_INIT(&env->sc_canons);
 
 	if (strlcpy(env->sc_conffile, conffile, PATH_MAX) >= PATH_MAX)
 		fatalx("config file exceeds PATH_MAX");
@@ -212,6 +299,8 @@ main(int argc, char **argv)
 		fatalx("unknown user %s", PFRESOLVED_USER);
 
 	ps->ps_csock.cs_name = sock;
+	ps->ps_rcsock.cs_name = rsock;
+	ps->ps_rcsock.cs_restricted = 1;
 
 	log_init(debug, LOG_DAEMON);
 	log_setverbose(verbose);
@@ -306,8 +395,15 @@ parent_dispatch_forwarder(int fd, struct privsep_proc *p, struct imsg *imsg)
 	switch (imsg->hdr.type) {
 	case IMSG_RESOLVEREQ_SUCCESS:
 	case IMSG_RESOLVEREQ_FAIL:
+	case IMSG_RESOLVEREQ_PART:
 		parent_process_resolve_result(env, imsg);
 		break;
+	case IMSG_CTL_SHOW_RESOLVERS:
+	case IMSG_CTL_SHOW_STATS:
+	case IMSG_CTL_TRACE:
+	case IMSG_CTL_END:
+		proc_forward_imsg(&env->sc_ps, imsg, PROC_CONTROL, -1);
+		break;
 	default:
 		return (-1);
 	}
@@ -332,6 +428,58 @@ parent_dispatch_control(int fd, struct privsep_proc *p, struct imsg *imsg)
 	case IMSG_CTL_HINTS:
 		parent_write_hints_file(env);
 		break;
+	case IMSG_CTL_SHOW_RESOLVERS:
+		proc_forward_imsg(&env->sc_ps, imsg, PROC_FORWARDER, -1);
+		break;
+	case IMSG_CTL_SHOW_STATS:
+		/* the forwarder adds its metrics and ends the reply */
+		parent_show_stats(env, imsg->hdr.peerid);
+		proc_forward_imsg(&env->sc_ps, imsg, PROC_FORWARDER, -1);
+		break;
+	case IMSG_CTL_SHOW_HOSTS:
+	case IMSG_CTL_SHOW_TABLES:
+		dump_start(env, imsg);
+		break;
+	case IMSG_CTL_HOST_ADD:
+	case IMSG_CTL_HOST_DEL:
+		parent_ctl_host(env, imsg);
+		break;
+	case IMSG_CTL_IMPORT_START:
+		import_start(env, imsg);
+		break;
+	case IMSG_CTL_IMPORT_NAMES:
+		import_names(env, imsg);
+		break;
+	case IMSG_CTL_IMPORT_END:
+		import_end(env, imsg);
+		break;
+	case IMSG_CTL_REFRESH_HOST:
+	case IMSG_CTL_REFRESH_TABLE:
+		refresh_start(env, imsg);
+		break;
+	case IMSG_CTL_LOOKUP:
+		lookup_start(env, imsg);
+		break;
+	case IMSG_CTL_TRACE:
+		/* the forwarder adds its events and ends the reply */
+		trace_send(env, PROC_CONTROL, imsg->hdr.peerid);
+		proc_forward_imsg(&env->sc_ps, imsg, PROC_FORWARDER, -1);
+		break;
+	case IMSG_CTL_XON:
+	case IMSG_CTL_XOFF:
+		dump_throttle(env, imsg->hdr.peerid,
+		    imsg->hdr.type == IMSG_CTL_XOFF);
+		break;
+	case IMSG_CTL_ABORT:
+		dump_abort(env, imsg->hdr.peerid);
+		import_abort(env, imsg->hdr.peerid);
+		break;
+	case IMSG_CTL_MONITOR:
+		IMSG_SIZE_CHECK(imsg, &env->sc_monitor);
+		memcpy(&env->sc_monitor, imsg->data, sizeof(env->sc_monitor));
+		log_debug("%s: monitor %s", __func__,
+		    env->sc_monitor ? "enabled" : "disabled");
+		break;
 	}
 
 	return (0);
@@ -376,28 +524,16 @@ void
 parent_reload(struct pfresolved *env)
 {
 	struct pfresolved_host		*host, *tmp_host;
-	struct pfresolved_table_ref	*ref, *tmp_ref;
 	struct pfresolved_table		*table, *tmp_table;
 	struct pfresolved_table_entry	*entry, *tmp_entry;
 
 	log_notice("%s: reload requested", __func__);
 
-	RB_FOREACH_SAFE(host, pfresolved_hosts, &env->sc_hosts, tmp_host) {
-		timer_del(env, &host->pfh_timer_v4);
-		timer_del(env, &host->pfh_timer_v6);
-
-		RB_FOREACH_SAFE(ref, pfresolved_table_refs, &host->pfh_tables,
-		    tmp_ref) {
-			RB_REMOVE(pfresolved_table_refs, &host->pfh_tables, ref);
-			free(ref);
-		}
-
-		free(host->pfh_addresses_v4);
-		free(host->pfh_addresses_v6);
+	RB_FOREACH_SAFE(host, pfresolved_hosts, &env->sc_canons, tmp_host)
+		parent_free_host(env, host);
 
-		RB_REMOVE(pfresolved_hosts, &env->sc_hosts, host);
-		free(host);
-	}
+	RB_FOREACH_SAFE(host, pfresolved_hosts, &env->sc_hosts, tmp_host)
+		parent_free_host(env, host);
 
 	parent_clear_pftables(env);
 
@@ -412,6 +548,9 @@ parent_reload(struct pfresolved *env)
 		RB_REMOVE(pfresolved_tables, &env->sc_tables, table);
 		free(table);
 	}
+	free(env->sc_table_index);
+	env->sc_table_index = NULL;
+	env->sc_num_tables = 0;
 
 	if (parse_config(env->sc_conffile, env) == -1) {
 		log_errorx("%s: failed to load config file %s", __func__,
@@ -431,14 +570,46 @@ parent_start_resolve_timeouts(struct pfresolved *env)
 
 	log_info("%s: starting resolve timeouts", __func__);
 
-	RB_FOREACH(host, pfresolved_hosts, &env->sc_hosts) {
+	RB_FOREACH(host, pfresolved_hosts, &env->sc_hosts)
+		parent_start_host_timers(env, host, 2);
+}
+
+void
+parent_start_host_timers(struct pfresolved *env, struct pfresolved_host *host,
+    int timeout)
+{
+	/* in dual-stack mode the v4 timer is used for both families */
+	if (env->sc_dual_stack) {
 		timer_set(env, &host->pfh_timer_v4,
-		    parent_send_resolve_request_v4, host);
-		timer_add(env, &host->pfh_timer_v4, 2);
-		timer_set(env, &host->pfh_timer_v6,
-		    parent_send_resolve_request_v6, host);
-		timer_add(env, &host->pfh_timer_v6, 2);
+		    parent_send_resolve_request_dual, host);
+		timer_add(env, &host->pfh_timer_v4, timeout);
+		return;
 	}
+	timer_set(env, &host->pfh_timer_v4,
+	    parent_send_resolve_request_v4, host);
+	timer_add(env, &host->pfh_timer_v4, timeout);
+	timer_set(env, &host->pfh_timer_v6,
+	    parent_send_resolve_request_v6, host);
+	timer_add(env, &host->pfh_timer_v6, timeout);
+}
+
+void
+parent_free_host(struct pfresolved *env, struct pfresolved_host *host)
+{
+	timer_del(env, &host->pfh_timer_v4);
+	timer_del(env, &host->pfh_timer_v6);
+	refresh_free_host(env, host);
+	lookup_remove_host(host);
+
+	tableset_free(&host->pfh_tables);
+	addrset_put(host->pfh_addrset_v4);
+	addrset_put(host->pfh_addrset_v6);
+	free(host->pfh_pending_v4);
+	free(host->pfh_pending_v6);
+
+	RB_REMOVE(pfresolved_hosts, host->pfh_cname_target ? &env->sc_canons :
+	    &env->sc_hosts, host);
+	free(host);
 }
 
 void
@@ -446,6 +617,8 @@ parent_send_resolve_request_v4(struct pfresolved *env, void *arg)
 {
 	struct pfresolved_host		*host = arg;
 
+	trace_add(TRACE_TIMER, AF_INET, host->pfh_hostname,
+	    host->pfh_timer_v4.tmr_late);
 	parent_send_resolve_request(env, AF_INET, host);
 }
 
@@ -454,24 +627,52 @@ parent_send_resolve_request_v6(struct pfresolved *env, void *arg)
 {
 	struct pfresolved_host		*host = arg;
 
+	trace_add(TRACE_TIMER, AF_INET6, host->pfh_hostname,
+	    host->pfh_timer_v6.tmr_late);
 	parent_send_resolve_request(env, AF_INET6, host);
 }
 
+/*
+ * Request A and AAAA records of a host at once. The forwarder sends both
+ * results, the pf tables are only updated after the second one arrived.
+ */
+void
+parent_send_resolve_request_dual(struct pfresolved *env, void *arg)
+{
+	struct pfresolved_host		*host = arg;
+
+	trace_add(TRACE_TIMER, AF_UNSPEC, host->pfh_hostname,
+	    host->pfh_timer_v4.tmr_late);
+	host->pfh_dual_wait = 2;
+	host->pfh_dual_timeout = INT_MAX;
+	parent_send_resolve_request(env, AF_UNSPEC, host);
+}
+
 void
 parent_send_resolve_request(struct pfresolved *env, sa_family_t af,
     struct pfresolved_host *host)
 {
-	struct iovec		 iov[2];
+	struct iovec		 iov[3];
+	struct timespec		 sent;
 	int			 iovcnt = 0;
 
 	log_debug("%s: sending resolve request for %s (%s) to forwarder",
-	    __func__, host->pfh_hostname, af == AF_INET ? "A" : "AAAA");
+	    __func__, host->pfh_hostname, af == AF_INET ? "A" :
+	    af == AF_INET6 ? "AAAA" : "A, AAAA");
+
+	trace_add(TRACE_REQUEST, af, host->pfh_hostname, 0);
+
+	/* the forwarder measures how long the request was queued */
+	clock_gettime(CLOCK_MONOTONIC, &sent);
 
 	iov[0].iov_base = &af;
 	iov[0].iov_len = sizeof(af);
 	iovcnt++;
-	iov[1].iov_base = host->pfh_hostname;
-	iov[1].iov_len = strlen(host->pfh_hostname);
+	iov[1].iov_base = &sent;
+	iov[1].iov_len = sizeof(sent);
+	iovcnt++;
+	iov[2].iov_base = host->pfh_hostname;
+	iov[2].iov_len = strlen(host->pfh_hostname);
 	iovcnt++;
 
 	proc_composev(&env->sc_ps, PROC_FORWARDER, IMSG_RESOLVEREQ, iov, iovcnt);
@@ -481,18 +682,39 @@ void
 parent_process_resolve_result(struct pfresolved *env, struct imsg *imsg)
 {
 	int				 ttl = 0, num_addresses = 0;
-	int				 timeout = 0, shift = 0;
+	int				 timeout = 0, shift = 0, cname_ttl = -1;
+	int				 unchanged = 0;
 	sa_family_t			 af = AF_INET;
+	char				 canon[HOST_NAME_MAX + 1];
 	struct pfresolved_host		*host;
-	struct pfresolved_address	*addresses = NULL;
-	struct pfresolved_table_ref	*table_ref;
+	const uint8_t			*addresses = NULL;
+	struct pfresolved_addrset	*set;
+	struct timespec			 start;
+	int				 idx;
 
 	host = parent_get_resolve_result_data(env, imsg, &af, &ttl,
-	    &num_addresses, &addresses);
+	    &num_addresses, canon, &cname_ttl, &unchanged, &addresses);
 	if (host == NULL)
 		return;
 
+	/*
+	 * Large results are split into several messages. The addresses are
+	 * collected until the final message of the result arrives.
+	 */
+	if (imsg->hdr.type == IMSG_RESOLVEREQ_PART) {
+		parent_append_pending_addresses(host, af, addresses,
+		    num_addresses);
+		return;
+	}
+
+	env->sc_stats.st_results++;
+
 	if (imsg->hdr.type == IMSG_RESOLVEREQ_FAIL) {
+		/* discard the parts of a result that failed later */
+		parent_free_pending_addresses(host, af);
+		env->sc_stats.st_retries++;
+		trace_add(TRACE_ERROR, af, host->pfh_hostname, 0);
+
 		log_warn("%s: resolve request for %s (%s) failed", __func__,
 		    host->pfh_hostname, af == AF_INET ? "A" : "AAAA");
 
@@ -510,25 +732,65 @@ parent_process_resolve_result(struct pfresolved *env, struct imsg *imsg)
 		goto done;
 	}
 
-	parent_update_host_addresses(env, host, addresses, num_addresses, af);
-
 	if (af == AF_INET) {
 		host->pfh_tries_v4 = 0;
 	} else {
 		host->pfh_tries_v6 = 0;
 	}
-
-	RB_FOREACH(table_ref, pfresolved_table_refs, &host->pfh_tables) {
-		pftable_set_addresses(env, table_ref->pftr_table);
+	trace_add(TRACE_RESULT, af, host->pfh_hostname, num_addresses);
+
+	/* the addresses did not change, only the timer has to be set again */
+	if (unchanged) {
+		env->sc_fingerprint_hits++;
+		log_debug("%s: addresses for %s (%s) did not change, "
+		    "%llu of %llu results unchanged", __func__,
+		    host->pfh_hostname, af == AF_INET ? "A" : "AAAA",
+		    (unsigned long long)env->sc_fingerprint_hits,
+		    (unsigned long long)(env->sc_fingerprint_hits +
+		    env->sc_fingerprint_misses));
+		parent_update_canon(env, host, canon, cname_ttl, ttl);
+		goto timeout;
 	}
+	env->sc_fingerprint_misses++;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* the pf tables are only written if the address set changed */
+	if (parent_update_host_addresses(env, host, addresses, num_addresses,
+	    af)) {
+		set = af == AF_INET ? host->pfh_addrset_v4 :
+		    host->pfh_addrset_v6;
+		trace_add(TRACE_DIFF, af, host->pfh_hostname,
+		    set ? set->pfas_num : 0);
+		TABLESET_FOREACH(idx, &host->pfh_tables)
+			env->sc_table_index[idx]->pft_dirty = 1;
+	}
+
+	parent_update_canon(env, host, canon, cname_ttl, ttl);
+	parent_fanout_addresses(env, host, af);
+	/* dual-stack results are written when both families are done */
+	if (!env->sc_dual_stack)
+		parent_commit_tables(env);
+	stats_histogram_add(&env->sc_stats.st_stages[STAGE_UPDATE],
+	    stats_elapsed(&start));
 
+timeout:
 	/*
 	 * Set the timeout to be 1 second higher than the ttl to try to prevent
-	 * getting a response with ttl 0.
+	 * getting a response with ttl 0. An alias gets its addresses from the
+	 * CNAME target, it only has to be checked again when the CNAME expires.
 	 */
+	if (host->pfh_canon != NULL)
+		ttl = cname_ttl;
 	timeout = CLAMP(ttl + 1, env->sc_min_ttl, env->sc_max_ttl);
 
 done:
+	if (env->sc_dual_stack) {
+		parent_finish_dual_result(env, host, timeout);
+		if (host->pfh_dual_wait == 0)
+			refresh_result(env, host, AF_UNSPEC);
+		return;
+	}
+
 	log_info("%s: starting new resolve request for %s (%s) in %d seconds",
 	    __func__, host->pfh_hostname, af == AF_INET ? "A" : "AAAA", timeout);
 	if (af == AF_INET) {
@@ -536,16 +798,44 @@ done:
 	} else {
 		timer_add(env, &host->pfh_timer_v6, timeout);
 	}
+	refresh_result(env, host, af);
+}
+
+/*
+ * Both results of a dual-stack request are applied to the pf tables in a
+ * single update. The next request is due when the first family expires.
+ */
+void
+parent_finish_dual_result(struct pfresolved *env, struct pfresolved_host *host,
+    int timeout)
+{
+	if (host->pfh_dual_wait == 0) {
+		/* a result that was requested before a reload */
+		host->pfh_dual_timeout = timeout;
+	} else {
+		host->pfh_dual_timeout = MIN(host->pfh_dual_timeout, timeout);
+		if (--host->pfh_dual_wait > 0)
+			return;
+	}
+
+	/* the tables of the host and its aliases are written once */
+	parent_commit_tables(env);
+
+	log_info("%s: starting new resolve request for %s (A, AAAA) in %d "
+	    "seconds", __func__, host->pfh_hostname, host->pfh_dual_timeout);
+	timer_add(env, &host->pfh_timer_v4, host->pfh_dual_timeout);
 }
 
 struct pfresolved_host *
 parent_get_resolve_result_data(struct pfresolved *env, struct imsg *imsg,
-    sa_family_t *af, int *ttl, int *num_addresses,
-    struct pfresolved_address **addresses)
+    sa_family_t *af, int *ttl, int *num_addresses, char *canon, int *cname_ttl,
+    int *unchanged, const uint8_t **addresses)
 {
+	uint64_t			 fingerprint = 0;
 	uint8_t				*ptr;
-	size_t				 len;
-	int				 hostname_len;
+	size_t				 len, keylen;
+	int				 hostname_len, canon_len;
+	struct timespec			 sent;
 	struct pfresolved_host		 search_key, *host;
 
 	bzero(&search_key, sizeof(search_key));
@@ -561,6 +851,17 @@ parent_get_resolve_result_data(struct pfresolved *env, struct imsg *imsg,
 	ptr += sizeof(*af);
 	len -= sizeof(*af);
 
+	if (len < sizeof(sent))
+		fatalx("%s: imsg length too small for timestamp: "
+		    "len %zu, required %lu", __func__, len, sizeof(sent));
+
+	memcpy(&sent, ptr, sizeof(sent));
+	ptr += sizeof(sent);
+	len -= sizeof(sent);
+
+	stats_histogram_add(&env->sc_stats.st_stages[STAGE_RESULT],
+	    stats_elapsed(&sent));
+
 	if (len < sizeof(hostname_len))
 		fatalx("%s: imsg length too small for hostname_len: "
 		    "len %zu, required %lu", __func__, len, sizeof(hostname_len));
@@ -582,6 +883,8 @@ parent_get_resolve_result_data(struct pfresolved *env, struct imsg *imsg,
 	len -= hostname_len;
 
 	host = RB_FIND(pfresolved_hosts, &env->sc_hosts, &search_key);
+	if (host == NULL)
+		host = RB_FIND(pfresolved_hosts, &env->sc_canons, &search_key);
 	if (host == NULL) {
 		log_errorx("%s: host from resolve result not found: %s",
 		    __func__, search_key.pfh_hostname);
@@ -591,17 +894,52 @@ parent_get_resolve_result_data(struct pfresolved *env, struct imsg *imsg,
 	if (imsg->hdr.type == IMSG_RESOLVEREQ_FAIL)
 		return (host);
 
-	if (len < sizeof(*ttl))
-		fatalx("%s: imsg length too small for ttl: len %zu, "
-		    "required %lu", __func__, len, sizeof(*ttl));
-
-	memcpy(ttl, ptr, sizeof(*ttl));
-	ptr += sizeof(*ttl);
-	len -= sizeof(*ttl);
+	/* only the final message of a result has a ttl */
+	if (imsg->hdr.type == IMSG_RESOLVEREQ_SUCCESS) {
+		if (len < sizeof(*ttl))
+			fatalx("%s: imsg length too small for ttl: len %zu, "
+			    "required %lu", __func__, len, sizeof(*ttl));
+
+		memcpy(ttl, ptr, sizeof(*ttl));
+		ptr += sizeof(*ttl);
+		len -= sizeof(*ttl);
+
+		if (len < sizeof(*cname_ttl) + sizeof(canon_len))
+			fatalx("%s: imsg length too small for canonical name: "
+			    "len %zu", __func__, len);
+
+		memcpy(cname_ttl, ptr, sizeof(*cname_ttl));
+		ptr += sizeof(*cname_ttl);
+		len -= sizeof(*cname_ttl);
+		memcpy(&canon_len, ptr, sizeof(canon_len));
+		ptr += sizeof(canon_len);
+		len -= sizeof(canon_len);
+
+		if (canon_len < 0 || canon_len > HOST_NAME_MAX ||
+		    len < (size_t)canon_len)
+			fatalx("%s: invalid length for canonical name: %d",
+			    __func__, canon_len);
+
+		memcpy(canon, ptr, canon_len);
+		canon[canon_len] = '\0';
+		ptr += canon_len;
+		len -= canon_len;
+	}
 
 	if (len == 0)
 		return (host);
 
+	if (imsg->hdr.type == IMSG_RESOLVEREQ_SUCCESS) {
+		if (len < sizeof(fingerprint))
+			fatalx("%s: imsg length too small for fingerprint: "
+			    "len %zu, required %lu", __func__, len,
+			    sizeof(fingerprint));
+
+		memcpy(&fingerprint, ptr, sizeof(fingerprint));
+		ptr += sizeof(fingerprint);
+		len -= sizeof(fingerprint);
+	}
+
 	if (len < sizeof(*num_addresses))
 		fatalx("%s: imsg length too small for num_addresses: len %zu, "
 		    "required %lu", __func__, len, sizeof(*num_addresses));
@@ -610,118 +948,358 @@ parent_get_resolve_result_data(struct pfresolved *env, struct imsg *imsg,
 	ptr += sizeof(*num_addresses);
 	len -= sizeof(*num_addresses);
 
-	if (len != *num_addresses * sizeof(**addresses))
+	/* the addresses are packed keys of the address family */
+	keylen = ADDRSET_KEYLEN(*af);
+	if (*num_addresses < 0 || len != *num_addresses * keylen)
 		fatalx("%s: remaining imsg length does not match expected "
-		    "length for addresses: len %zu, expected %lu", __func__, len,
-		    *num_addresses * sizeof(**addresses));
+		    "length for addresses: len %zu, expected %zu", __func__, len,
+		    *num_addresses * keylen);
 
-	if ((*addresses = calloc(*num_addresses, sizeof(**addresses))) == NULL)
-		fatal("%s: calloc", __func__);
+	/* the keys are used in place and copied by the caller */
+	*addresses = ptr;
 
-	memcpy(*addresses, ptr, *num_addresses * sizeof(**addresses));
+	/*
+	 * The addresses are not needed if they are already known. The keys
+	 * always follow the fingerprint, so a hash collision is ruled out by
+	 * comparing them with the current set.
+	 */
+	if (fingerprint != 0 &&
+	    fingerprint == parent_host_fingerprint(host, *af) &&
+	    (*af == AF_INET ? host->pfh_num_pending_v4 :
+	    host->pfh_num_pending_v6) == 0 &&
+	    parent_host_has_keys(host, *af, ptr, *num_addresses))
+		*unchanged = 1;
 
 	return (host);
 }
 
+/*
+ * Hosts that are CNAMEs of the same target share the query for the target.
+ * The target is resolved by its own timers and every answer is copied to all
+ * of its aliases. Targets that are not configured themselves are kept in a
+ * separate tree and removed with their last alias.
+ */
+void
+parent_update_canon(struct pfresolved *env, struct pfresolved_host *host,
+    const char *canon, int cname_ttl, int ttl)
+{
+	struct pfresolved_host		 search_key, *target;
+
+	/* only follow a single level of aliases */
+	if (host->pfh_cname_target)
+		return;
+
+	if (cname_ttl == -1) {
+		parent_unlink_alias(env, host);
+		return;
+	}
+
+	if (host->pfh_canon != NULL &&
+	    strcmp(host->pfh_canon->pfh_hostname, canon) == 0)
+		return;
+
+	parent_unlink_alias(env, host);
+
+	bzero(&search_key, sizeof(search_key));
+	strlcpy(search_key.pfh_hostname, canon,
+	    sizeof(search_key.pfh_hostname));
+
+	target = RB_FIND(pfresolved_hosts, &env->sc_hosts, &search_key);
+	if (target == NULL)
+		target = RB_FIND(pfresolved_hosts, &env->sc_canons,
+		    &search_key);
+	if (target == NULL) {
+		if ((target = calloc(1, sizeof(*target))) == NULL)
+			fatal("%s: calloc", __func__);
+		strlcpy(target->pfh_hostname, canon,
+		    sizeof(target->pfh_hostname));
+		TAILQ_INIT(&target->pfh_aliases);
+		target->pfh_cname_target = 1;
+		RB_INSERT(pfresolved_hosts, &env->sc_canons, target);
+
+		log_info("%s: resolving CNAME target %s", __func__,
+		    target->pfh_hostname);
+		parent_start_host_timers(env, target,
+		    CLAMP(ttl + 1, env->sc_min_ttl, env->sc_max_ttl));
+	}
+
+	if (target == host || target->pfh_canon != NULL)
+		return;
+
+	log_info("%s: %s is an alias of %s", __func__, host->pfh_hostname,
+	    target->pfh_hostname);
+	host->pfh_canon = target;
+	TAILQ_INSERT_TAIL(&target->pfh_aliases, host, pfh_alias_entry);
+}
+
+void
+parent_unlink_alias(struct pfresolved *env, struct pfresolved_host *host)
+{
+	struct pfresolved_host		*target = host->pfh_canon;
+
+	if (target == NULL)
+		return;
+
+	TAILQ_REMOVE(&target->pfh_aliases, host, pfh_alias_entry);
+	host->pfh_canon = NULL;
+
+	if (target->pfh_cname_target && TAILQ_EMPTY(&target->pfh_aliases)) {
+		log_info("%s: CNAME target %s is no longer used", __func__,
+		    target->pfh_hostname);
+		parent_free_host(env, target);
+	}
+}
+
+/*
+ * Copy the addresses of a host to all of its aliases. The changed tables are
+ * only marked, so a table that is shared by several aliases is written once
+ * by the next commit.
+ */
+void
+parent_fanout_addresses(struct pfresolved *env, struct pfresolved_host *host,
+    sa_family_t af)
+{
+	struct pfresolved_host		*alias;
+	struct pfresolved_addrset	*set;
+	int				 idx;
+
+	if (TAILQ_EMPTY(&host->pfh_aliases))
+		return;
+
+	set = af == AF_INET ? host->pfh_addrset_v4 : host->pfh_addrset_v6;
+
+	TAILQ_FOREACH(alias, &host->pfh_aliases, pfh_alias_entry) {
+		if (!parent_set_host_addrset(env, alias, addrset_ref(set), af))
+			continue;
+
+		TABLESET_FOREACH(idx, &alias->pfh_tables)
+			env->sc_table_index[idx]->pft_dirty = 1;
+	}
+}
+
+/* write all tables that were changed since the last commit */
+void
+parent_commit_tables(struct pfresolved *env)
+{
+	struct pfresolved_table		*table;
+	int				 idx;
+
+	for (idx = 0; idx < env->sc_num_tables; idx++) {
+		table = env->sc_table_index[idx];
+		if (!table->pft_dirty)
+			continue;
+		table->pft_dirty = 0;
+		pftable_set_addresses(env, table);
+	}
+}
+
+uint64_t
+parent_host_fingerprint(struct pfresolved_host *host, sa_family_t af)
+{
+	struct pfresolved_addrset	*set;
+
+	set = af == AF_INET ? host->pfh_addrset_v4 : host->pfh_addrset_v6;
+
+	return (set != NULL ? set->pfas_hash : addrset_hash(af, NULL, 0));
+}
+
 int
-parent_address_cmp(const void *a, const void *b)
+parent_host_has_keys(struct pfresolved_host *host, sa_family_t af,
+    const uint8_t *keys, int num_keys)
 {
-	return address_cmp((const struct pfresolved_address *)a,
-	    (const struct pfresolved_address *)b);
+	struct pfresolved_addrset	*set;
+
+	set = af == AF_INET ? host->pfh_addrset_v4 : host->pfh_addrset_v6;
+	if (set == NULL)
+		return (num_keys == 0);
+
+	return (set->pfas_num == num_keys &&
+	    memcmp(set->pfas_keys, keys, num_keys * ADDRSET_KEYLEN(af)) == 0);
 }
 
 void
+parent_append_pending_addresses(struct pfresolved_host *host, sa_family_t af,
+    const uint8_t *addresses, int num_addresses)
+{
+	uint32_t			**pending;
+	int				 *num_pending;
+	size_t				  keylen = ADDRSET_KEYLEN(af);
+
+	if (num_addresses == 0)
+		return;
+
+	if (af == AF_INET) {
+		pending = &host->pfh_pending_v4;
+		num_pending = &host->pfh_num_pending_v4;
+	} else {
+		pending = &host->pfh_pending_v6;
+		num_pending = &host->pfh_num_pending_v6;
+	}
+
+	if ((*pending = reallocarray(*pending, *num_pending + num_addresses,
+	    keylen)) == NULL)
+		fatal("%s: reallocarray", __func__);
+
+	memcpy((uint8_t *)*pending + *num_pending * keylen, addresses,
+	    num_addresses * keylen);
+	*num_pending += num_addresses;
+}
+
+void
+parent_free_pending_addresses(struct pfresolved_host *host, sa_family_t af)
+{
+	if (af == AF_INET) {
+		free(host->pfh_pending_v4);
+		host->pfh_pending_v4 = NULL;
+		host->pfh_num_pending_v4 = 0;
+	} else {
+		free(host->pfh_pending_v6);
+		host->pfh_pending_v6 = NULL;
+		host->pfh_num_pending_v6 = 0;
+	}
+}
+
+/*
+ * Set the addresses of a host from the keys of the final result message.
+ * A result that fits into a single message has been sorted by the forwarder
+ * and is used in place, it needs no memory unless its address set is new.
+ * Returns 1 if the addresses changed.
+ */
+int
 parent_update_host_addresses(struct pfresolved *env,
-    struct pfresolved_host *host, struct pfresolved_address *addresses,
-    int num_addresses, sa_family_t af)
+    struct pfresolved_host *host, const uint8_t *addresses, int num_addresses,
+    sa_family_t af)
+{
+	struct pfresolved_addrset	*set;
+	uint32_t			*keys;
+	int				 num_keys;
+
+	if ((af == AF_INET ? host->pfh_num_pending_v4 :
+	    host->pfh_num_pending_v6) > 0) {
+		parent_append_pending_addresses(host, af, addresses,
+		    num_addresses);
+		if (af == AF_INET) {
+			keys = host->pfh_pending_v4;
+			num_keys = host->pfh_num_pending_v4;
+		} else {
+			keys = host->pfh_pending_v6;
+			num_keys = host->pfh_num_pending_v6;
+		}
+		/* the forwarder cannot sort the parts of a split result */
+		addrset_sort(af, keys, num_keys);
+		set = addrset_get(af, keys, num_keys);
+	} else
+		set = addrset_get(af, addresses, num_addresses);
+	parent_free_pending_addresses(host, af);
+
+	return (parent_set_host_addrset(env, host, set, af));
+}
+
+/*
+ * Replace the addresses of a host with a shared set, the reference to the set
+ * is passed to the host. Returns 1 if the addresses changed.
+ */
+int
+parent_set_host_addrset(struct pfresolved *env, struct pfresolved_host *host,
+    struct pfresolved_addrset *set, sa_family_t af)
 {
-	int				 cur_old = 0, num_old, cur_new = 0, cmp;
-	struct pfresolved_address	*old_addresses;
+	struct pfresolved_addrset	**setp, *old;
+	struct pfresolved_address	 address;
+	const uint32_t			*old_keys = NULL, *keys = NULL;
+	int				 cur_old = 0, num_old = 0, cur_new = 0;
+	int				 num_addresses = 0, cmp;
 	char				*addrs_str = NULL;
 	char				*added_addrs_str = NULL;
 	char				*removed_addrs_str = NULL;
 
-	if (af == AF_INET) {
-		old_addresses = host->pfh_addresses_v4;
-		num_old = host->pfh_num_addresses_v4;
-	} else {
-		old_addresses = host->pfh_addresses_v6;
-		num_old = host->pfh_num_addresses_v6;
+	setp = af == AF_INET ? &host->pfh_addrset_v4 : &host->pfh_addrset_v6;
+	old = *setp;
+
+	/* identical sets are shared, there is nothing to compare */
+	if (set == old) {
+		addrset_put(set);
+		log_info("%s: addresses for %s (%s) did not change: "
+		    "%d addresses", __func__, host->pfh_hostname,
+		    af == AF_INET ? "A" : "AAAA", set ? set->pfas_num : 0);
+		return (0);
 	}
 
-	if (num_addresses > 0)
-		qsort(addresses, num_addresses, sizeof(*addresses),
-		    parent_address_cmp);
+	if (old != NULL) {
+		old_keys = old->pfas_keys;
+		num_old = old->pfas_num;
+	}
+	if (set != NULL) {
+		keys = set->pfas_keys;
+		num_addresses = set->pfas_num;
+	}
 
 	/*
-	 * The old addresses have already been sorted when they were previously
-	 * assigned to the host.
+	 * Both sets are sorted. The keys are only converted into table
+	 * addresses when they are added or removed.
 	 */
-
 	while (cur_old < num_old && cur_new < num_addresses) {
-		cmp = address_cmp(&old_addresses[cur_old], &addresses[cur_new]);
+		cmp = addrset_key_cmp(af, ADDRSET_KEY(af, old_keys, cur_old),
+		    ADDRSET_KEY(af, keys, cur_new));
 
 		if (cmp == 0) {
+			addrset_address(af, ADDRSET_KEY(af, keys, cur_new),
+			    &address);
 			appendf(&addrs_str, "%s%s",
 			    addrs_str == NULL ? "" : ", ",
-			    print_address(&addresses[cur_new]));
+			    print_address(&address));
 
 			cur_old++;
 			cur_new++;
 		} else if (cmp < 0) {
+			addrset_address(af, ADDRSET_KEY(af, old_keys, cur_old),
+			    &address);
 			appendf(&removed_addrs_str, "%s%s",
 			    removed_addrs_str == NULL ? "" : ", ",
-			    print_address(&old_addresses[cur_old]));
-			parent_remove_table_entries(env, host,
-			    &old_addresses[cur_old]);
+			    print_address(&address));
+			parent_remove_table_entries(env, host, &address);
 
 			cur_old++;
 		} else {
+			addrset_address(af, ADDRSET_KEY(af, keys, cur_new),
+			    &address);
 			appendf(&addrs_str, "%s%s",
 			    addrs_str == NULL ? "" : ", ",
-			    print_address(&addresses[cur_new]));
+			    print_address(&address));
 			appendf(&added_addrs_str, "%s%s",
 			    added_addrs_str == NULL ? "" : ", ",
-			    print_address(&addresses[cur_new]));
-			parent_add_table_entries(env, host,
-			    &addresses[cur_new]);
+			    print_address(&address));
+			parent_add_table_entries(env, host, &address);
 
 			cur_new++;
 		}
 	}
 
 	while (cur_old < num_old) {
+		addrset_address(af, ADDRSET_KEY(af, old_keys, cur_old),
+		    &address);
 		appendf(&removed_addrs_str, "%s%s",
 		    removed_addrs_str == NULL ? "" : ", ",
-		    print_address(&old_addresses[cur_old]));
-		parent_remove_table_entries(env, host,
-		    &old_addresses[cur_old]);
+		    print_address(&address));
+		parent_remove_table_entries(env, host, &address);
 
 		cur_old++;
 	}
 
 	while (cur_new < num_addresses) {
+		addrset_address(af, ADDRSET_KEY(af, keys, cur_new), &address);
 		appendf(&addrs_str, "%s%s",
 		    addrs_str == NULL ? "" : ", ",
-		    print_address(&addresses[cur_new]));
+		    print_address(&address));
 		appendf(&added_addrs_str, "%s%s",
 		    added_addrs_str == NULL ? "" : ", ",
-		    print_address(&addresses[cur_new]));
-		parent_add_table_entries(env, host, &addresses[cur_new]);
+		    print_address(&address));
+		parent_add_table_entries(env, host, &address);
 
 		cur_new++;
 	}
 
-	if (af == AF_INET) {
-		free(host->pfh_addresses_v4);
-		host->pfh_addresses_v4 = addresses;
-		host->pfh_num_addresses_v4 = num_addresses;
-	} else {
-		free(host->pfh_addresses_v6);
-		host->pfh_addresses_v6 = addresses;
-		host->pfh_num_addresses_v6 = num_addresses;
-	}
-
+	*setp = set;
+	addrset_put(old);
 
 	if (added_addrs_str || removed_addrs_str) {
 		log_notice("%s: addresses for %s (%s) changed: addresses: %s, "
@@ -738,79 +1316,159 @@ parent_update_host_addresses(struct pfresolved *env,
 	free(addrs_str);
 	free(added_addrs_str);
 	free(removed_addrs_str);
+
+	return (1);
 }
 
 void
 parent_add_table_entries(struct pfresolved *env, struct pfresolved_host *host,
     struct pfresolved_address *address)
 {
-	struct pfresolved_table_ref	*table_ref;
+	int				 idx;
+
+	lookup_add(host, address);
+	TABLESET_FOREACH(idx, &host->pfh_tables)
+		parent_add_table_entry(env, env->sc_table_index[idx], host,
+		    address);
+}
+
+void
+parent_add_table_entry(struct pfresolved *env, struct pfresolved_table *table,
+    struct pfresolved_host *host, struct pfresolved_address *address)
+{
 	struct pfresolved_table_entry	*entry, search_key;
 
 	bzero(&search_key, sizeof(search_key));
-
-	RB_FOREACH(table_ref, pfresolved_table_refs, &host->pfh_tables) {
-		search_key.pfte_addr = *address;
-		entry = RB_FIND(pfresolved_table_entries,
-		    &table_ref->pftr_table->pft_entries, &search_key);
-		if (entry == NULL) {
-			if ((entry = calloc(1, sizeof(*entry))) == NULL)
-				fatal("%s: calloc", __func__);
-
-			entry->pfte_addr = *address;
-			RB_INSERT(pfresolved_table_entries,
-				&table_ref->pftr_table->pft_entries, entry);
-		} else if (entry->pfte_refcount < 0 ||
-		    (entry->pfte_refcount == 0 && !entry->pfte_static)) {
-			log_errorx("%s: entries for table %s are inconsistent: "
-			    "refcount was %d before incrementing for %s (%s)",
-			    __func__, table_ref->pftr_table->pft_name,
-			    entry->pfte_refcount, print_address(address),
-			    entry->pfte_static ? "static" : "not static");
-		}
-		entry->pfte_refcount++;
+	search_key.pfte_addr = *address;
+	entry = RB_FIND(pfresolved_table_entries, &table->pft_entries,
+	    &search_key);
+	if (entry == NULL) {
+		if ((entry = calloc(1, sizeof(*entry))) == NULL)
+			fatal("%s: calloc", __func__);
+
+		entry->pfte_addr = *address;
+		RB_INSERT(pfresolved_table_entries, &table->pft_entries, entry);
+		table->pft_num_entries++;
+		parent_monitor_event(env, CTL_EVENT_ADD, table, host, address);
+	} else if (entry->pfte_refcount < 0 ||
+	    (entry->pfte_refcount == 0 && !entry->pfte_static)) {
+		log_errorx("%s: entries for table %s are inconsistent: "
+		    "refcount was %d before incrementing for %s (%s)",
+		    __func__, table->pft_name,
+		    entry->pfte_refcount, print_address(address),
+		    entry->pfte_static ? "static" : "not static");
 	}
+	entry->pfte_refcount++;
 }
 
 void
 parent_remove_table_entries(struct pfresolved *env,
     struct pfresolved_host *host, struct pfresolved_address *address)
 {
-	struct pfresolved_table_ref	*table_ref;
+	int				 idx;
+
+	lookup_remove(host, address);
+	TABLESET_FOREACH(idx, &host->pfh_tables)
+		parent_remove_table_entry(env, env->sc_table_index[idx], host,
+		    address);
+}
+
+void
+parent_remove_table_entry(struct pfresolved *env,
+    struct pfresolved_table *table, struct pfresolved_host *host,
+    struct pfresolved_address *address)
+{
 	struct pfresolved_table_entry	*old_entry, search_key;
 
 	bzero(&search_key, sizeof(search_key));
+	search_key.pfte_addr = *address;
+	old_entry = RB_FIND(pfresolved_table_entries, &table->pft_entries,
+	    &search_key);
+	if (old_entry == NULL) {
+		log_errorx("%s: entries for table %s are inconsistent: "
+		    "old entry not found for %s",
+		    __func__, table->pft_name, print_address(address));
+		return;
+	}
 
-	RB_FOREACH(table_ref, pfresolved_table_refs, &host->pfh_tables) {
-		search_key.pfte_addr = *address;
-		old_entry = RB_FIND(pfresolved_table_entries,
-		    &table_ref->pftr_table->pft_entries, &search_key);
-		if (old_entry == NULL) {
-			log_errorx("%s: entries for table %s are inconsistent: "
-			    "old entry not found for %s",
-			    __func__, table_ref->pftr_table->pft_name,
-			    print_address(address));
-			continue;
-		}
+	if (old_entry->pfte_refcount <= 0) {
+		log_errorx("%s: entries for table %s are inconsistent: "
+		    "refcount was %d before decrementing for %s",
+		    __func__, table->pft_name, old_entry->pfte_refcount,
+		    print_address(address));
+	}
 
-		if (old_entry->pfte_refcount <= 0) {
-			log_errorx("%s: entries for table %s are inconsistent: "
-			    "refcount was %d before decrementing for %s",
-			    __func__, table_ref->pftr_table->pft_name,
-			    old_entry->pfte_refcount,
-			    print_address(address));
-		}
+	old_entry->pfte_refcount--;
+	if (old_entry->pfte_refcount > 0 || old_entry->pfte_static)
+		return;
 
-		old_entry->pfte_refcount--;
-		if (old_entry->pfte_refcount > 0 || old_entry->pfte_static)
-			continue;
+	RB_REMOVE(pfresolved_table_entries, &table->pft_entries, old_entry);
+	table->pft_num_entries--;
+	free(old_entry);
+	parent_monitor_event(env, CTL_EVENT_REMOVE, table, host, address);
+}
+
+/*
+ * Add or remove the entries for all current addresses of a host in a single
+ * table. The table is marked dirty if the host had any addresses.
+ */
+void
+parent_set_table_membership(struct pfresolved *env,
+    struct pfresolved_host *host, struct pfresolved_table *table, int add)
+{
+	parent_set_table_addrset(env, table, host, host->pfh_addrset_v4,
+	    AF_INET, add);
+	parent_set_table_addrset(env, table, host, host->pfh_addrset_v6,
+	    AF_INET6, add);
+}
+
+void
+parent_set_table_addrset(struct pfresolved *env,
+    struct pfresolved_table *table, struct pfresolved_host *host,
+    struct pfresolved_addrset *set, sa_family_t af, int add)
+{
+	struct pfresolved_address	 address;
+	int				 i;
 
-		RB_REMOVE(pfresolved_table_entries,
-		    &table_ref->pftr_table->pft_entries, old_entry);
-		free(old_entry);
+	if (set == NULL)
+		return;
+
+	for (i = 0; i < set->pfas_num; i++) {
+		addrset_address(af, ADDRSET_KEY(af, set->pfas_keys, i),
+		    &address);
+		if (add)
+			parent_add_table_entry(env, table, host, &address);
+		else
+			parent_remove_table_entry(env, table, host, &address);
+		table->pft_dirty = 1;
 	}
 }
 
+/*
+ * Tell the control process about an address that entered or left a pf
+ * table. The control process passes it to the subscribed monitors.
+ */
+void
+parent_monitor_event(struct pfresolved *env, enum ctl_event_type type,
+    struct pfresolved_table *table, struct pfresolved_host *host,
+    struct pfresolved_address *address)
+{
+	struct ctl_event	 ce;
+
+	if (!env->sc_monitor)
+		return;
+
+	bzero(&ce, sizeof(ce));
+	ce.ce_time = time(NULL);
+	ce.ce_type = type;
+	strlcpy(ce.ce_table, table->pft_name, sizeof(ce.ce_table));
+	strlcpy(ce.ce_hostname, host->pfh_hostname, sizeof(ce.ce_hostname));
+	ce.ce_addr = *address;
+
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_EVENT, -1,
+	    -1, &ce, sizeof(ce));
+}
+
 int
 parent_init_pftables(struct pfresolved *env)
 {
@@ -841,8 +1499,9 @@ parent_write_hints_file(struct pfresolved *env)
 	FILE				*file;
 	struct pfresolved_table		*table;
 	struct pfresolved_host		*host;
-	struct pfresolved_table_ref	*table_ref, search_key;
-	int				 has_address = 0, i;
+	struct pfresolved_addrset	*set;
+	struct pfresolved_address	 address;
+	int				 has_address = 0, i, j;
 
 	if (!env->sc_hints_file) {
 		log_info("%s: no hints file configured", __func__);
@@ -858,24 +1517,24 @@ parent_write_hints_file(struct pfresolved *env)
 		fprintf(file, "%s:\n", table->pft_name);
 
 		RB_FOREACH(host, pfresolved_hosts, &env->sc_hosts) {
-			bzero(&search_key, sizeof(search_key));
-			search_key.pftr_table = table;
-			table_ref = RB_FIND(pfresolved_table_refs,
-			    &host->pfh_tables, &search_key);
-			if (!table_ref)
+			if (!tableset_isset(&host->pfh_tables,
+			    table->pft_index))
 				continue;
 
 			fprintf(file, "- %s:", host->pfh_hostname);
 			has_address = 0;
-			for (i = 0; i < host->pfh_num_addresses_v4; i++) {
-				fprintf(file, "%s %s", has_address ? "," : "",
-				    print_address(&host->pfh_addresses_v4[i]));
-				has_address = 1;
-			}
-			for (i = 0; i < host->pfh_num_addresses_v6; i++) {
-				fprintf(file, "%s %s", has_address ? "," : "",
-				    print_address(&host->pfh_addresses_v6[i]));
-				has_address = 1;
+			for (j = 0; j < 2; j++) {
+				set = j == 0 ? host->pfh_addrset_v4 :
+				    host->pfh_addrset_v6;
+				for (i = 0; set && i < set->pfas_num; i++) {
+					addrset_address(set->pfas_af,
+					    ADDRSET_KEY(set->pfas_af,
+					    set->pfas_keys, i), &address);
+					fprintf(file, "%s %s",
+					    has_address ? "," : "",
+					    print_address(&address));
+					has_address = 1;
+				}
 			}
 			fprintf(file, "\n");
 		}
@@ -886,6 +1545,263 @@ parent_write_hints_file(struct pfresolved *env)
 	fclose(file);
 }
 
+void
+parent_show_stats(struct pfresolved *env, uint32_t peerid)
+{
+	static const char	*stages[STAGE_MAX] = {
+		"timer", "request", "resolve", "result", "update", "commit"
+	};
+	struct pfresolved_stats		*st = &env->sc_stats;
+	struct pfresolved_host		*host;
+	struct pfresolved_table		*table;
+	char				 label[STATS_LABEL_SIZE];
+	uint64_t			 resolved = 0, empty = 0, failing = 0;
+	uint64_t			 targets = 0;
+	int				 i;
+
+	stats_send(env, PROC_CONTROL, peerid, STATS_COUNTER, "results_total",
+	    NULL, "Results received from the forwarder", st->st_results);
+	stats_send(env, PROC_CONTROL, peerid, STATS_COUNTER, "retries_total",
+	    NULL, "Failed results that are retried", st->st_retries);
+	stats_send(env, PROC_CONTROL, peerid, STATS_COUNTER,
+	    "unchanged_results_total", NULL,
+	    "Results skipped by their fingerprint", env->sc_fingerprint_hits);
+	stats_send(env, PROC_CONTROL, peerid, STATS_COUNTER,
+	    "changed_results_total", NULL,
+	    "Results compared with the addresses of the host",
+	    env->sc_fingerprint_misses);
+	stats_send(env, PROC_CONTROL, peerid, STATS_COUNTER,
+	    "pf_commits_total", NULL, "Updates of pf tables",
+	    st->st_pf_commits);
+	stats_send(env, PROC_CONTROL, peerid, STATS_COUNTER,
+	    "pf_errors_total", NULL, "Failed updates of pf tables",
+	    st->st_pf_errors);
+	for (i = 0; i < STAGE_MAX; i++) {
+		/* the forwarder reports the stages it measures itself */
+		if (i == STAGE_REQUEST || i == STAGE_RESOLVE)
+			continue;
+		snprintf(label, sizeof(label), "stage=\"%s\"", stages[i]);
+		stats_send_histogram(env, PROC_CONTROL, peerid,
+		    "stage_duration_seconds", label,
+		    "Time spent in each processing stage", &st->st_stages[i]);
+	}
+
+	RB_FOREACH(host, pfresolved_hosts, &env->sc_hosts) {
+		if (host->pfh_tries_v4 > 0 || host->pfh_tries_v6 > 0)
+			failing++;
+		else if (host->pfh_addrset_v4 || host->pfh_addrset_v6)
+			resolved++;
+		else
+			empty++;
+	}
+	RB_FOREACH(host, pfresolved_hosts, &env->sc_canons)
+		targets++;
+
+	stats_send(env, PROC_CONTROL, peerid, STATS_GAUGE, "hosts",
+	    "state=\"resolved\"", "Hosts by state", resolved);
+	stats_send(env, PROC_CONTROL, peerid, STATS_GAUGE, "hosts",
+	    "state=\"empty\"", "Hosts by state", empty);
+	stats_send(env, PROC_CONTROL, peerid, STATS_GAUGE, "hosts",
+	    "state=\"failing\"", "Hosts by state", failing);
+	stats_send(env, PROC_CONTROL, peerid, STATS_GAUGE, "cname_targets",
+	    NULL, "CNAME targets resolved for aliases", targets);
+	stats_send(env, PROC_CONTROL, peerid, STATS_GAUGE, "address_sets",
+	    NULL, "Distinct address sets", addrset_count());
+
+	RB_FOREACH(table, pfresolved_tables, &env->sc_tables) {
+		snprintf(label, sizeof(label), "table=\"%s\"",
+		    table->pft_name);
+		stats_send(env, PROC_CONTROL, peerid, STATS_GAUGE,
+		    "table_entries", label, "Entries per pf table",
+		    table->pft_num_entries);
+		stats_send_histogram(env, PROC_CONTROL, peerid,
+		    "pf_commit_duration_seconds", label,
+		    "Time to update a pf table", &table->pft_commit_latency);
+	}
+
+	stats_send_process(env, PROC_CONTROL, peerid);
+}
+
+/*
+ * Hosts that are added or deleted over the control socket are not written
+ * back to the config file, a reload restores the configured tables. Only
+ * the changed table is written to pf.
+ */
+void
+parent_ctl_host(struct pfresolved *env, struct imsg *imsg)
+{
+	struct ctl_membership		 cm;
+	struct ctl_update		 cu;
+	struct pfresolved_table		*table, search_key;
+
+	bzero(&cu, sizeof(cu));
+
+	if (IMSG_DATA_SIZE(imsg) != sizeof(cm)) {
+		log_errorx("%s: bad length imsg received", __func__);
+		strlcpy(cu.cu_error, "bad request", sizeof(cu.cu_error));
+		goto done;
+	}
+	memcpy(&cm, imsg->data, sizeof(cm));
+	cm.cm_table[sizeof(cm.cm_table) - 1] = '\0';
+	cm.cm_hostname[sizeof(cm.cm_hostname) - 1] = '\0';
+	cu.cu_received = 1;
+
+	bzero(&search_key, sizeof(search_key));
+	strlcpy(search_key.pft_name, cm.cm_table, sizeof(search_key.pft_name));
+	if ((table = RB_FIND(pfresolved_tables, &env->sc_tables,
+	    &search_key)) == NULL) {
+		snprintf(cu.cu_error, sizeof(cu.cu_error), "unknown table %s",
+		    cm.cm_table);
+		cu.cu_failed++;
+		goto done;
+	}
+
+	if (imsg->hdr.type == IMSG_CTL_HOST_ADD)
+		parent_host_add(env, table, cm.cm_hostname, &cu);
+	else
+		parent_host_del(env, table, cm.cm_hostname, &cu);
+	parent_commit_tables(env);
+
+done:
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_UPDATE,
+	    imsg->hdr.peerid, -1, &cu, sizeof(cu));
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_END,
+	    imsg->hdr.peerid, -1, NULL, 0);
+}
+
+/*
+ * Static addresses can only be configured in the config file, names from
+ * the control socket must be hostnames.
+ */
+int
+parent_check_hostname(const char *hostname, struct ctl_update *cu)
+{
+	struct pfresolved_address	 address;
+
+	if (*hostname == '\0' ||
+	    inet_net_pton(AF_INET, hostname, &address.pfa_addr.in4,
+	    sizeof(address.pfa_addr.in4)) != -1 ||
+	    inet_net_pton(AF_INET6, hostname, &address.pfa_addr.in6,
+	    sizeof(address.pfa_addr.in6)) != -1) {
+		if (cu->cu_error[0] == '\0')
+			snprintf(cu->cu_error, sizeof(cu->cu_error),
+			    "invalid hostname %s", hostname);
+		cu->cu_failed++;
+		return (-1);
+	}
+	if (strlen(hostname) > HOST_NAME_MAX) {
+		if (cu->cu_error[0] == '\0')
+			snprintf(cu->cu_error, sizeof(cu->cu_error),
+			    "hostname too long");
+		cu->cu_failed++;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Add a host to a table. The entries for the addresses that are already
+ * known are added at once, a new host is resolved immediately. The table is
+ * marked dirty, the caller commits it.
+ */
+int
+parent_host_add(struct pfresolved *env, struct pfresolved_table *table,
+    const char *hostname, struct ctl_update *cu)
+{
+	struct pfresolved_host		*host, search_key;
+	int				 new = 0;
+
+	if (parent_check_hostname(hostname, cu) == -1)
+		return (-1);
+
+	bzero(&search_key, sizeof(search_key));
+	strlcpy(search_key.pfh_hostname, hostname,
+	    sizeof(search_key.pfh_hostname));
+
+	if ((host = RB_FIND(pfresolved_hosts, &env->sc_hosts,
+	    &search_key)) != NULL) {
+		if (tableset_isset(&host->pfh_tables, table->pft_index)) {
+			cu->cu_kept++;
+			return (0);
+		}
+	} else if ((host = RB_FIND(pfresolved_hosts, &env->sc_canons,
+	    &search_key)) != NULL) {
+		/* a CNAME target that is now configured itself */
+		RB_REMOVE(pfresolved_hosts, &env->sc_canons, host);
+		host->pfh_cname_target = 0;
+		RB_INSERT(pfresolved_hosts, &env->sc_hosts, host);
+		lookup_add_host(host);
+	} else {
+		if ((host = calloc(1, sizeof(*host))) == NULL)
+			fatal("%s: calloc", __func__);
+		strlcpy(host->pfh_hostname, hostname,
+		    sizeof(host->pfh_hostname));
+		TAILQ_INIT(&host->pfh_aliases);
+		RB_INSERT(pfresolved_hosts, &env->sc_hosts, host);
+		new = 1;
+	}
+
+	log_info("%s: adding %s to table %s", __func__, hostname,
+	    table->pft_name);
+
+	tableset_add(&host->pfh_tables, table->pft_index);
+	parent_set_table_membership(env, host, table, 1);
+	if (new)
+		parent_start_host_timers(env, host, 0);
+	cu->cu_added++;
+
+	return (1);
+}
+
+/*
+ * Remove a host from a table. A host that is in no table anymore is freed,
+ * unless other hosts still use it as their CNAME target.
+ */
+int
+parent_host_del(struct pfresolved *env, struct pfresolved_table *table,
+    const char *hostname, struct ctl_update *cu)
+{
+	struct pfresolved_host		*host, search_key;
+
+	bzero(&search_key, sizeof(search_key));
+	strlcpy(search_key.pfh_hostname, hostname,
+	    sizeof(search_key.pfh_hostname));
+
+	if ((host = RB_FIND(pfresolved_hosts, &env->sc_hosts,
+	    &search_key)) == NULL ||
+	    !tableset_isset(&host->pfh_tables, table->pft_index)) {
+		snprintf(cu->cu_error, sizeof(cu->cu_error),
+		    "%s is not in table %s", hostname, table->pft_name);
+		cu->cu_failed++;
+		return (-1);
+	}
+
+	log_info("%s: removing %s from table %s", __func__, hostname,
+	    table->pft_name);
+
+	parent_set_table_membership(env, host, table, 0);
+	tableset_del(&host->pfh_tables, table->pft_index);
+	cu->cu_removed++;
+
+	if (tableset_next(&host->pfh_tables, 0) != -1)
+		return (1);
+
+	parent_unlink_alias(env, host);
+	if (TAILQ_EMPTY(&host->pfh_aliases)) {
+		parent_free_host(env, host);
+		return (1);
+	}
+
+	/* keep resolving it for its aliases */
+	lookup_remove_host(host);
+	RB_REMOVE(pfresolved_hosts, &env->sc_hosts, host);
+	host->pfh_cname_target = 1;
+	RB_INSERT(pfresolved_hosts, &env->sc_canons, host);
+
+	return (1);
+}
+
 static __inline int
 pfte_cmp(struct pfresolved_table_entry *a, struct pfresolved_table_entry *b)
 {
@@ -902,14 +1818,6 @@ pft_cmp(struct pfresolved_table *a, struct pfresolved_table *b)
 
 RB_GENERATE(pfresolved_tables, pfresolved_table, pft_node, pft_cmp);
 
-static __inline int
-pftr_cmp(struct pfresolved_table_ref *a, struct pfresolved_table_ref *b)
-{
-	return (pft_cmp(a->pftr_table, b->pftr_table));
-}
-
-RB_GENERATE(pfresolved_table_refs, pfresolved_table_ref, pftr_node, pftr_cmp);
-
 static __inline int
 pfh_cmp(struct pfresolved_host *a, struct pfresolved_host *b)
 {
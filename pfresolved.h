@@ -21,6 +21,9 @@
 #define MIN_TTL_DEFAULT 10
 #define MAX_TTL_DEFAULT 86400
 
+/* Memory for validated DNSSEC keys, see -K */
+#define KEY_CACHE_SIZE "4m"
+
 /*
  * Failed queries are cached for 5 seconds by libunbound so there is no reason
  * to start with a lower base timeout.
@@ -28,6 +31,16 @@
 #define RETRY_TIMEOUT_BASE 5
 #define RETRY_TIMEOUT_MAX 3600
 
+#define DNS_CLASS_IN		1
+#define DNS_RR_TYPE_A		1
+#define DNS_RR_TYPE_CNAME	5
+#define DNS_RR_TYPE_SOA		6
+#define DNS_RR_TYPE_AAAA	28
+#define DNS_RR_TYPE_OPT		41
+#define DNS_RCODE_NOERROR	0
+#define DNS_RCODE_SERVFAIL	2
+#define DNS_RCODE_NXDOMAIN	3
+
 /*
  * Common daemon infrastructure, local imsg etc.
  */
@@ -56,7 +69,32 @@ enum imsg_type {
 	IMSG_CTL_PROCFD,
 	IMSG_RESOLVEREQ,
 	IMSG_RESOLVEREQ_SUCCESS,
-	IMSG_RESOLVEREQ_FAIL
+	IMSG_RESOLVEREQ_FAIL,
+	IMSG_RESOLVEREQ_PART,
+	IMSG_CTL_SHOW_RESOLVERS,
+	IMSG_CTL_SHOW_STATS,
+	IMSG_CTL_SHOW_HOSTS,
+	IMSG_CTL_SHOW_TABLES,
+	IMSG_CTL_HOST,
+	IMSG_CTL_TABLE,
+	IMSG_CTL_ADDRESSES,
+	IMSG_CTL_XON,
+	IMSG_CTL_XOFF,
+	IMSG_CTL_ABORT,
+	IMSG_CTL_TRACE,
+	IMSG_CTL_HOST_ADD,
+	IMSG_CTL_HOST_DEL,
+	IMSG_CTL_UPDATE,
+	IMSG_CTL_IMPORT_START,
+	IMSG_CTL_IMPORT_NAMES,
+	IMSG_CTL_IMPORT_END,
+	IMSG_CTL_MONITOR,
+	IMSG_CTL_EVENT,
+	IMSG_CTL_REFRESH_HOST,
+	IMSG_CTL_REFRESH_TABLE,
+	IMSG_CTL_REFRESH,
+	IMSG_CTL_LOOKUP,
+	IMSG_CTL_END
 };
 
 enum privsep_procid {
@@ -75,15 +113,35 @@ struct control_sock {
 	void		*cs_env;
 };
 
+/* IMSG_CTL_MONITOR from pfresolvectl, empty names match everything */
+struct ctl_filter {
+	char			 cf_table[PF_TABLE_NAME_SIZE];
+	char			 cf_hostname[HOST_NAME_MAX + 1];
+};
+
 struct ctl_conn {
 	TAILQ_ENTRY(ctl_conn)	 entry;
 	uint8_t			 flags;
 #define CTL_CONN_NOTIFY		 0x01
+#define CTL_CONN_DUMP		 0x02
+#define CTL_CONN_THROTTLED	 0x04
+#define CTL_CONN_IMPORT		 0x08
 	struct imsgev		 iev;
 	uint32_t		 peerid;
+	struct ctl_filter	 filter;
+	uint32_t		 dropped;
 };
 TAILQ_HEAD(ctl_connlist, ctl_conn);
 
+/*
+ * A connection that has more messages queued than the high mark stops the
+ * dump in the parent until it drained below the low mark. Events for a
+ * monitor that has more messages queued than the limit are dropped.
+ */
+#define CTL_MSG_HIGH_MARK	500
+#define CTL_MSG_LOW_MARK	50
+#define CTL_MSG_MONITOR_MAX	1000
+
 struct privsep_pipes {
 	int				*pp_pipes[PROC_MAX];
 };
@@ -99,6 +157,7 @@ struct privsep {
 	int				 ps_noaction;
 
 	struct control_sock		 ps_csock;
+	struct control_sock		 ps_rcsock;
 
 	unsigned int			 ps_instances[PROC_MAX];
 	unsigned int			 ps_ninstances;
@@ -111,6 +170,7 @@ struct privsep {
 	struct event			 ps_evsighup;
 	struct event			 ps_evsigpipe;
 	struct event			 ps_evsigusr1;
+	struct event_base		*ps_evbase;
 
 	struct pfresolved		*ps_env;
 };
@@ -145,11 +205,132 @@ enum dnssec_level {
 	DNSSEC_FORCE
 };
 
+enum forwarder_engine {
+	ENGINE_UNBOUND = 0,
+	ENGINE_STUB,
+	ENGINE_EVENT
+};
+
+enum resolver_state {
+	RESOLVER_UP = 0,
+	RESOLVER_DOWN,
+	RESOLVER_PROBE
+};
+
+/* per resolver statistics sent to pfresolvectl */
+struct ctl_resolver {
+	char			 cr_name[HOST_NAME_MAX + 1];
+	enum resolver_state	 cr_state;
+	uint32_t		 cr_srtt;
+	uint32_t		 cr_p95;
+	uint32_t		 cr_down;
+	uint64_t		 cr_queries;
+	uint64_t		 cr_answers;
+	uint64_t		 cr_failures;
+	uint64_t		 cr_timeouts;
+	uint64_t		 cr_hedges;
+};
+
+/*
+ * Histograms count microseconds in logarithmic buckets like HdrHistogram.
+ * Every power of two is split into four sub-buckets, so a quantile is
+ * accurate to 25%. Values up to 3 are exact, the last bucket ends at 2^41
+ * usec and also takes larger values.
+ */
+#define STATS_SUB_BITS		2
+#define STATS_SUB_BUCKETS	(1 << STATS_SUB_BITS)
+#define STATS_BUCKETS		(40 * STATS_SUB_BUCKETS)
+#define STATS_BUCKET_UPPER(i)						\
+	((i) < STATS_SUB_BUCKETS ? (uint64_t)(i) :			\
+	((uint64_t)(STATS_SUB_BUCKETS + (i) % STATS_SUB_BUCKETS + 1) <<	\
+	((i) / STATS_SUB_BUCKETS - 1)) - 1)
+#define STATS_NAME_SIZE		64
+#define STATS_LABEL_SIZE	96
+
+/* answers are counted per rcode, rcodes above REFUSED as other */
+#define STATS_RCODES		6
+
+enum stats_type {
+	STATS_COUNTER = 0,
+	STATS_GAUGE,
+	STATS_HISTOGRAM
+};
+
+/* the stages of a resolve request and the process that measures them */
+enum stats_stage {
+	STAGE_TIMER = 0,	/* parent: lateness of the resolve timer */
+	STAGE_REQUEST,		/* forwarder: request from the parent */
+	STAGE_RESOLVE,		/* forwarder: query to answer */
+	STAGE_RESULT,		/* parent: result from the forwarder */
+	STAGE_UPDATE,		/* parent: diff of the addresses */
+	STAGE_COMMIT,		/* parent: DIOCRSETADDRS ioctl */
+	STAGE_MAX
+};
+
+struct stats_histogram {
+	uint64_t		 sh_count;
+	uint64_t		 sh_sum;
+	uint64_t		 sh_buckets[STATS_BUCKETS];
+};
+
+/* a single metric sent to pfresolvectl */
+struct ctl_stats {
+	char			 cs_name[STATS_NAME_SIZE];
+	char			 cs_label[STATS_LABEL_SIZE];
+	char			 cs_help[STATS_LABEL_SIZE];
+	enum stats_type		 cs_type;
+	uint64_t		 cs_value;
+	struct stats_histogram	 cs_histogram;
+};
+
+/* counters of a process, each process only uses its own */
+struct pfresolved_stats {
+	uint64_t		 st_queries;
+	uint64_t		 st_query_failures;
+	uint64_t		 st_answers[STATS_RCODES + 1];
+	uint64_t		 st_bogus;
+	uint64_t		 st_insecure;
+	struct stats_histogram	 st_stages[STAGE_MAX];
+	uint64_t		 st_results;
+	uint64_t		 st_retries;
+	uint64_t		 st_pf_commits;
+	uint64_t		 st_pf_errors;
+};
+
+/*
+ * Each process records recent events in a ring buffer that is dumped with
+ * pfresolvectl trace and on fatal signals. The value depends on the type.
+ */
+#define TRACE_EVENTS		4096	/* power of two */
+#define TRACE_LOG_EVENTS	256	/* logged on fatal signals */
+#define TRACE_NAME_SIZE		32
+
+enum trace_type {
+	TRACE_TIMER = 0,	/* value: usec the timer was late */
+	TRACE_REQUEST,		/* value: 0 */
+	TRACE_ANSWER,		/* value: rcode */
+	TRACE_RESULT,		/* value: addresses in the final message */
+	TRACE_DIFF,		/* value: addresses of the host after change */
+	TRACE_COMMIT,		/* value: entries written to the pf table */
+	TRACE_ERROR		/* value: libunbound error or errno */
+};
+
+struct trace_event {
+	uint64_t		 te_usec;
+	int64_t			 te_value;
+	uint8_t			 te_type;
+	uint8_t			 te_proc;
+	uint8_t			 te_af;
+	char			 te_name[TRACE_NAME_SIZE];
+};
+
 struct pfresolved_timer {
 	struct event		 tmr_ev;
 	struct pfresolved	*tmr_env;
 	void			(*tmr_cb)(struct pfresolved *, void *);
 	void			*tmr_cbarg;
+	struct timespec		 tmr_deadline;
+	uint64_t		 tmr_late;	/* usec the last run was late */
 };
 
 /*
@@ -160,7 +341,7 @@ struct pfresolved_timer {
  *   1:n                                   1:n
  *    |                                     |
  *    v                                     v
- *   host -- 1:n --> table_ref -- 1:1 --> table
+ *   host ---------- 1:n --------------> table
  *    |                                     |
  *   1:n                                   1:n
  *    |                                     |
@@ -171,9 +352,10 @@ struct pfresolved_timer {
  *
  * The hosts are not directly part of a table to avoid data duplication since
  * they are allowed to be included in multiple tables. Instead the association
- * between hosts and tables is done indirectly: Each host contains an RB_TREE of
- * table refs that link to a table. Additionally, hosts contain an array of
- * addresses that is updated with each resolve.
+ * between hosts and tables is done indirectly: Each table has a dense number
+ * and each host contains a bitset of the numbers of its tables. The tables are
+ * found by their number in an array of pfresolved. Additionally, hosts refer
+ * to a shared set of addresses that is updated with each resolve.
  *
  * Each table contains an RB_TREE of table entries. These table entries contain
  * one address each that was either defined statically for that table or that
@@ -198,6 +380,22 @@ struct pfresolved_address {
 	int				 pfa_prefixlen;
 };
 
+/* length of a packed address key in an address set */
+#define ADDRSET_KEYLEN(af)	((af) == AF_INET ? \
+	sizeof(struct in_addr) : sizeof(struct in6_addr))
+#define ADDRSET_KEY(af, keys, i)	\
+	((const uint8_t *)(keys) + (i) * ADDRSET_KEYLEN(af))
+
+struct pfresolved_addrset {
+	RB_ENTRY(pfresolved_addrset)	 pfas_node;
+	uint64_t			 pfas_hash;
+	int				 pfas_refcnt;
+	int				 pfas_num;
+	sa_family_t			 pfas_af;
+	const void			*pfas_lookup;
+	uint32_t			 pfas_keys[];
+};
+
 struct pfresolved_table_entry {
 	struct pfresolved_address		 pfte_addr;
 	int					 pfte_static;
@@ -210,40 +408,148 @@ RB_PROTOTYPE(pfresolved_table_entries, pfresolved_table_entry, pfte_node, pfte_c
 
 struct pfresolved_table {
 	char					 pft_name[PF_TABLE_NAME_SIZE];
+	int					 pft_index;
 	struct pfresolved_table_entries		 pft_entries;
+	int					 pft_num_entries;
+	int					 pft_num_static;
+	int					 pft_dirty;
+	struct stats_histogram			 pft_commit_latency;
 	RB_ENTRY(pfresolved_table)		 pft_node;
 };
 RB_HEAD(pfresolved_tables, pfresolved_table);
 RB_PROTOTYPE(pfresolved_tables, pfresolved_table, pft_node, pft_cmp);
 
-struct pfresolved_table_ref {
-	struct pfresolved_table			*pftr_table;
-	RB_ENTRY(pfresolved_table_ref)	 	 pftr_node;
+/*
+ * Tables are numbered densely in the order of the config file. A host refers
+ * to its tables by a bitset of these numbers, the first TABLESET_INLINE
+ * tables need no memory besides the host.
+ */
+#define TABLESET_INLINE		64
+#define TABLESET_BITS		32
+
+struct pfresolved_tableset {
+	uint32_t			 pfts_inline[TABLESET_INLINE /
+					    TABLESET_BITS];
+	uint32_t			*pfts_words;
+	int				 pfts_nwords;
 };
-RB_HEAD(pfresolved_table_refs, pfresolved_table_ref);
-RB_PROTOTYPE(pfresolved_table_refs, pfresolved_table_ref, pftr_node, pftr_cmp);
+
+#define TABLESET_FOREACH(idx, set)					\
+	for ((idx) = tableset_next((set), 0); (idx) != -1;		\
+	    (idx) = tableset_next((set), (idx) + 1))
+
+TAILQ_HEAD(pfresolved_aliases, pfresolved_host);
 
 struct pfresolved_host {
 	char				 pfh_hostname[HOST_NAME_MAX + 1];
-	struct pfresolved_table_refs	 pfh_tables;
-	struct pfresolved_address	*pfh_addresses_v4;
-	int				 pfh_num_addresses_v4;
+	struct pfresolved_tableset	 pfh_tables;
+	struct pfresolved_addrset	*pfh_addrset_v4;
 	struct pfresolved_timer		 pfh_timer_v4;
 	int				 pfh_tries_v4;
-	struct pfresolved_address	*pfh_addresses_v6;
-	int				 pfh_num_addresses_v6;
+	struct pfresolved_addrset	*pfh_addrset_v6;
 	struct pfresolved_timer		 pfh_timer_v6;
 	int				 pfh_tries_v6;
+	uint32_t			*pfh_pending_v4;
+	int				 pfh_num_pending_v4;
+	uint32_t			*pfh_pending_v6;
+	int				 pfh_num_pending_v6;
+	int				 pfh_dual_wait;
+	int				 pfh_dual_timeout;
+	int				 pfh_cname_target;
+	struct pfresolved_host		*pfh_canon;
+	struct refresh_ctx		*pfh_refresh;
+	int				 pfh_refresh_af;
+	struct pfresolved_aliases	 pfh_aliases;
+	TAILQ_ENTRY(pfresolved_host)	 pfh_alias_entry;
 	RB_ENTRY(pfresolved_host)	 pfh_node;
 };
 RB_HEAD(pfresolved_hosts, pfresolved_host);
 RB_PROTOTYPE(pfresolved_hosts, pfresolved_host, pfh_node, pfh_cmp);
 
+/* a host sent to pfresolvectl, next is -1 if no resolve is scheduled */
+struct ctl_host {
+	char			 ch_hostname[HOST_NAME_MAX + 1];
+	char			 ch_canon[HOST_NAME_MAX + 1];
+	int			 ch_num_v4;
+	int			 ch_num_v6;
+	int			 ch_tries_v4;
+	int			 ch_tries_v6;
+	int			 ch_next_v4;
+	int			 ch_next_v6;
+	int			 ch_num_tables;
+};
+
+/* a table sent to pfresolvectl */
+struct ctl_table {
+	char			 ct_name[PF_TABLE_NAME_SIZE];
+	int			 ct_num_entries;
+	int			 ct_num_static;
+};
+
+/* IMSG_CTL_ADDRESSES carries an array of these */
+struct ctl_address {
+	struct pfresolved_address ca_addr;
+	int			 ca_negate;
+	int			 ca_static;
+};
+
+/* IMSG_CTL_HOST_ADD and IMSG_CTL_HOST_DEL */
+struct ctl_membership {
+	char			 cm_table[PF_TABLE_NAME_SIZE];
+	char			 cm_hostname[HOST_NAME_MAX + 1];
+};
+
+/* a forced resolve of a host or of all hosts of a table */
+struct ctl_refresh {
+	char			 rf_name[HOST_NAME_MAX + 1];
+	int			 rf_wait;
+	int			 rf_hosts;
+	int			 rf_seconds;
+	char			 rf_error[128];
+};
+
+/* a table that contains an address, because of a host or statically */
+struct ctl_lookup {
+	char			 cl_hostname[HOST_NAME_MAX + 1];
+	char			 cl_table[PF_TABLE_NAME_SIZE];
+	int			 cl_static;
+	int			 cl_negate;
+};
+
+/* an address that entered or left a pf table because of a host */
+enum ctl_event_type {
+	CTL_EVENT_ADD,
+	CTL_EVENT_REMOVE
+};
+
+/* ce_dropped counts the events not sent to a slow monitor before this one */
+struct ctl_event {
+	int64_t			 ce_time;
+	uint32_t		 ce_dropped;
+	enum ctl_event_type	 ce_type;
+	char			 ce_table[PF_TABLE_NAME_SIZE];
+	char			 ce_hostname[HOST_NAME_MAX + 1];
+	struct pfresolved_address ce_addr;
+};
+
+/* the result of a change to the table membership, cu_error is set on error */
+struct ctl_update {
+	int			 cu_received;
+	int			 cu_added;
+	int			 cu_removed;
+	int			 cu_kept;
+	int			 cu_failed;
+	char			 cu_error[128];
+};
+
 struct pfresolved {
 	int					 sc_no_daemon;
 	char					 sc_conffile[PATH_MAX];
 	struct pfresolved_tables		 sc_tables;
+	struct pfresolved_table		       **sc_table_index;
+	int					 sc_num_tables;
 	struct pfresolved_hosts			 sc_hosts;
+	struct pfresolved_hosts			 sc_canons;
 	int					 sc_pf_device;
 	int					 sc_min_ttl;
 	int					 sc_max_ttl;
@@ -251,6 +557,7 @@ struct pfresolved {
 	struct privsep				 sc_ps;
 	struct ub_ctx				*sc_ub_ctx;
 	struct event				 sc_ub_fd_event;
+	struct event_base			*sc_ub_evbase;
 	const char				*sc_outbound_ip;
 	const char			       **sc_resolvers;
 	int					 sc_num_resolvers;
@@ -258,13 +565,39 @@ struct pfresolved {
 	const char				*sc_cert_bundle;
 	enum dnssec_level			 sc_dnssec_level;
 	const char				*sc_trust_anchor;
+	enum forwarder_engine			 sc_engine;
+	int					 sc_hedge_budget;
+	int					 sc_key_cache;
+	int					 sc_dual_stack;
+	uint64_t				 sc_fingerprint_hits;
+	uint64_t				 sc_fingerprint_misses;
+	struct pfresolved_stats			 sc_stats;
+	int					 sc_monitor;
 };
 
 extern struct pfresolved	*pfresolved_env;
 
+/* pfresolved.c */
+int	 parent_check_hostname(const char *, struct ctl_update *);
+int	 parent_host_add(struct pfresolved *, struct pfresolved_table *,
+	    const char *, struct ctl_update *);
+int	 parent_host_del(struct pfresolved *, struct pfresolved_table *,
+	    const char *, struct ctl_update *);
+void	 parent_commit_tables(struct pfresolved *);
+
 /* forwarder.c */
 void	 forwarderproc(struct privsep *, struct privsep_proc *);
 
+/* stub.c */
+void	 stub_init(struct pfresolved *);
+void	 stub_start(struct pfresolved *);
+void	 stub_shutdown(struct pfresolved *);
+int	 stub_resolve(struct pfresolved *, const char *, int, void *,
+	    void (*)(void *, int, struct ub_result *));
+void	 stub_show_resolvers(struct pfresolved *, uint32_t);
+int	 stub_cname_ttl(const char *, uint8_t *, size_t);
+int	 stub_parse_answer(char *, int, uint8_t *, size_t, struct ub_result *);
+
 /* control.c */
 void	 control(struct privsep *, struct privsep_proc *);
 int	 control_init(struct privsep *, struct control_sock *);
@@ -284,6 +617,63 @@ void	 timer_set(struct pfresolved *, struct pfresolved_timer *,
 	    void (*)(struct pfresolved *, void *), void *);
 void	 timer_add(struct pfresolved *, struct pfresolved_timer *, int);
 void	 timer_del(struct pfresolved *, struct pfresolved_timer *);
+int	 timer_remaining(struct pfresolved_timer *);
+
+/* dump.c */
+void	 dump_start(struct pfresolved *, struct imsg *);
+void	 dump_throttle(struct pfresolved *, uint32_t, int);
+void	 dump_abort(struct pfresolved *, uint32_t);
+
+/* refresh.c */
+void	 refresh_start(struct pfresolved *, struct imsg *);
+void	 refresh_result(struct pfresolved *, struct pfresolved_host *,
+	    sa_family_t);
+void	 refresh_free_host(struct pfresolved *, struct pfresolved_host *);
+
+/* lookup.c */
+void	 lookup_add(struct pfresolved_host *, struct pfresolved_address *);
+void	 lookup_remove(struct pfresolved_host *, struct pfresolved_address *);
+void	 lookup_add_host(struct pfresolved_host *);
+void	 lookup_remove_host(struct pfresolved_host *);
+void	 lookup_start(struct pfresolved *, struct imsg *);
+
+/* import.c */
+void	 import_start(struct pfresolved *, struct imsg *);
+void	 import_names(struct pfresolved *, struct imsg *);
+void	 import_end(struct pfresolved *, struct imsg *);
+void	 import_abort(struct pfresolved *, uint32_t);
+
+/* addrset.c */
+uint64_t addrset_hash(sa_family_t, const void *, int);
+struct pfresolved_addrset *
+	 addrset_get(sa_family_t, const void *, int);
+struct pfresolved_addrset *
+	 addrset_ref(struct pfresolved_addrset *);
+void	 addrset_put(struct pfresolved_addrset *);
+int	 addrset_count(void);
+void	 addrset_address(sa_family_t, const void *,
+	    struct pfresolved_address *);
+const char *
+	 addrset_print_key(sa_family_t, const void *);
+int	 addrset_key_cmp(sa_family_t, const void *, const void *);
+void	 addrset_sort(sa_family_t, void *, int);
+
+/* stats.c */
+void	 stats_histogram_add(struct stats_histogram *, uint64_t);
+uint64_t stats_elapsed(const struct timespec *);
+void	 stats_send(struct pfresolved *, enum privsep_procid, uint32_t,
+	    enum stats_type, const char *, const char *, const char *,
+	    uint64_t);
+void	 stats_send_histogram(struct pfresolved *, enum privsep_procid,
+	    uint32_t, const char *, const char *, const char *,
+	    struct stats_histogram *);
+void	 stats_send_process(struct pfresolved *, enum privsep_procid,
+	    uint32_t);
+
+/* trace.c */
+void	 trace_add(enum trace_type, sa_family_t, const char *, int64_t);
+void	 trace_send(struct pfresolved *, enum privsep_procid, uint32_t);
+void	 trace_log(void);
 
 /* util.c */
 const char *
@@ -292,6 +682,11 @@ int	 address_cmp(const struct pfresolved_address *,
 	     const struct pfresolved_address *);
 void	 appendf(char **, char *, ...)
 	     __attribute__((__format__ (printf, 2, 3)));
+void	 tableset_add(struct pfresolved_tableset *, int);
+void	 tableset_del(struct pfresolved_tableset *, int);
+int	 tableset_isset(const struct pfresolved_tableset *, int);
+int	 tableset_next(const struct pfresolved_tableset *, int);
+void	 tableset_free(struct pfresolved_tableset *);
 
 /* proc.c */
 void	 proc_init(struct privsep *, struct privsep_proc *, unsigned int, int,
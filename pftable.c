@@ -19,16 +19,23 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "pfresolved.h"
 
+/* the buffer for DIOCRSETADDRS is reused and only grows */
+static struct pfr_addr	*pftable_buffer;
+static int		 pftable_buffer_size;
+
 int
 pftable_set_addresses(struct pfresolved *env, struct pfresolved_table *table)
 {
 	struct pfioc_table		 io;
 	struct pfresolved_table_entry	*entry;
-	struct pfr_addr			*buffer = NULL;
-	int				 count = 0, res;
+	struct pfr_addr			*addr;
+	struct timespec			 start;
+	uint64_t			 usec;
+	int				 count = 0, res, size;
 
 	bzero(&io, sizeof(io));
 
@@ -40,28 +47,37 @@ pftable_set_addresses(struct pfresolved *env, struct pfresolved_table *table)
 	}
 
 	RB_FOREACH(entry, pfresolved_table_entries, &table->pft_entries) {
-		if ((buffer = recallocarray(buffer, count, count + 1,
-		    sizeof(*buffer))) == NULL)
-			fatal("%s: recallocarray", __func__);
+		if (count == pftable_buffer_size) {
+			size = pftable_buffer_size ? pftable_buffer_size * 2 :
+			    64;
+			if ((pftable_buffer = recallocarray(pftable_buffer,
+			    pftable_buffer_size, size,
+			    sizeof(*pftable_buffer))) == NULL)
+				fatal("%s: recallocarray", __func__);
+			pftable_buffer_size = size;
+		}
+		addr = &pftable_buffer[count];
 
-		buffer[count].pfra_af = entry->pfte_addr.pfa_af;
+		bzero(addr, sizeof(*addr));
+		addr->pfra_af = entry->pfte_addr.pfa_af;
 		if (entry->pfte_addr.pfa_af == AF_INET) {
-			buffer[count].pfra_ip4addr = entry->pfte_addr.pfa_addr.in4;
+			addr->pfra_ip4addr = entry->pfte_addr.pfa_addr.in4;
 		} else {
-			buffer[count].pfra_ip6addr = entry->pfte_addr.pfa_addr.in6;
+			addr->pfra_ip6addr = entry->pfte_addr.pfa_addr.in6;
 		}
-		buffer[count].pfra_net = entry->pfte_addr.pfa_prefixlen;
-		buffer[count].pfra_not = entry->pfte_negate;
+		addr->pfra_net = entry->pfte_addr.pfa_prefixlen;
+		addr->pfra_not = entry->pfte_negate;
 		count++;
 	}
 
-	io.pfrio_buffer = buffer;
+	io.pfrio_buffer = pftable_buffer;
 	io.pfrio_size = count;
-	io.pfrio_esize = sizeof(*buffer);
+	io.pfrio_esize = sizeof(*pftable_buffer);
 
 	log_info("%s: updating addresses for pf table: %s", __func__,
 	    table->pft_name);
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	res = ioctl(env->sc_pf_device, DIOCRSETADDRS, &io);
 	if (res == -1 && errno == ESRCH) {
 		log_notice("%s: pf table %s does not exist, creating it",
@@ -74,18 +90,24 @@ pftable_set_addresses(struct pfresolved *env, struct pfresolved_table *table)
 		res = ioctl(env->sc_pf_device, DIOCRSETADDRS, &io);
 	}
 
+	usec = stats_elapsed(&start);
+	stats_histogram_add(&env->sc_stats.st_stages[STAGE_COMMIT], usec);
+	stats_histogram_add(&table->pft_commit_latency, usec);
+
+	env->sc_stats.st_pf_commits++;
 	if (res == -1) {
+		env->sc_stats.st_pf_errors++;
+		trace_add(TRACE_ERROR, AF_UNSPEC, table->pft_name, errno);
 		log_warn("%s: failed to update addresses for pf table %s",
 		    __func__, table->pft_name);
 	} else {
+		trace_add(TRACE_COMMIT, AF_UNSPEC, table->pft_name, count);
 		log_debug("%s: updated addresses for pf table %s: "
 		    "added: %d, deleted: %d, changed: %d",
 		    __func__, table->pft_name, io.pfrio_nadd, io.pfrio_ndel,
 		    io.pfrio_nchange);
 	}
 
-	free(buffer);
-
 	return (res);
 }
 
@@ -616,6 +616,8 @@ out:
 		free(strings);
 	}
 #endif
+	/* the recent events may explain how the process got here */
+	trace_log();
 	_exit(sig);
 }
 #endif
@@ -661,6 +663,8 @@ proc_run(struct privsep *ps, struct privsep_proc *p,
 	if (p->p_id == PROC_CONTROL && ps->ps_instance == 0) {
 		if (control_init(ps, &ps->ps_csock) == -1)
 			fatalx("%s: control_init", __func__);
+		if (control_init(ps, &ps->ps_rcsock) == -1)
+			fatalx("%s: control_init", __func__);
 	}
 
 	/* Use non-standard user */
@@ -689,7 +693,7 @@ proc_run(struct privsep *ps, struct privsep_proc *p,
 	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
 		fatal("%s: cannot drop privileges", __func__);
 
-	event_init();
+	ps->ps_evbase = event_init();
 
 	signal_set(&ps->ps_evsigint, SIGINT, proc_sig_handler, p);
 	signal_set(&ps->ps_evsigterm, SIGTERM, proc_sig_handler, p);
@@ -721,6 +725,8 @@ proc_run(struct privsep *ps, struct privsep_proc *p,
 	if (p->p_id == PROC_CONTROL && ps->ps_instance == 0) {
 		if (control_listen(&ps->ps_csock) == -1)
 			fatalx("%s: control_listen", __func__);
+		if (control_listen(&ps->ps_rcsock) == -1)
+			fatalx("%s: control_listen", __func__);
 	}
 
 #if DEBUG
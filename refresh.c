@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pfresolved.h"
+
+/*
+ * pfresolvectl refresh moves the resolve timers of a host or of all hosts
+ * of a table forward. At most REFRESH_RATE hosts per second are resolved
+ * this way, a large table is spread over several seconds.
+ *
+ * Each refresh remembers how many of its hosts are not resolved yet. A host
+ * belongs to the first refresh that scheduled it, a later refresh does not
+ * move its timer again. A waiting client gets IMSG_CTL_END when its refresh
+ * and all earlier ones are done, so all hosts it asked for are resolved and
+ * written to pf by then.
+ */
+
+#define REFRESH_RATE	100
+#define REFRESH_V4	0x01
+#define REFRESH_V6	0x02
+
+struct refresh_ctx {
+	TAILQ_ENTRY(refresh_ctx)	 rc_entry;
+	uint32_t			 rc_peerid;
+	int				 rc_wait;
+	int				 rc_pending;
+};
+TAILQ_HEAD(refresh_ctxs, refresh_ctx);
+
+int	 refresh_host(struct pfresolved *, struct refresh_ctx *,
+	    struct pfresolved_host *, int *);
+int	 refresh_delay(void);
+void	 refresh_done(struct pfresolved *, struct pfresolved_host *);
+void	 refresh_finish(struct pfresolved *);
+
+static struct refresh_ctxs	 refresh_ctxs =
+    TAILQ_HEAD_INITIALIZER(refresh_ctxs);
+static time_t			 refresh_second;
+static int			 refresh_slots;
+
+void
+refresh_start(struct pfresolved *env, struct imsg *imsg)
+{
+	struct ctl_refresh		 rf;
+	struct refresh_ctx		*rc;
+	struct pfresolved_host		*host, search_key;
+	struct pfresolved_table		*table, table_key;
+
+	if (IMSG_DATA_SIZE(imsg) != sizeof(rf)) {
+		log_errorx("%s: bad length imsg received", __func__);
+		return;
+	}
+	memcpy(&rf, imsg->data, sizeof(rf));
+	rf.rf_name[sizeof(rf.rf_name) - 1] = '\0';
+	rf.rf_hosts = 0;
+	rf.rf_seconds = 0;
+	bzero(rf.rf_error, sizeof(rf.rf_error));
+
+	if ((rc = calloc(1, sizeof(*rc))) == NULL)
+		fatal("%s: calloc", __func__);
+	rc->rc_peerid = imsg->hdr.peerid;
+	rc->rc_wait = rf.rf_wait;
+
+	bzero(&search_key, sizeof(search_key));
+	bzero(&table_key, sizeof(table_key));
+
+	if (imsg->hdr.type == IMSG_CTL_REFRESH_HOST) {
+		strlcpy(search_key.pfh_hostname, rf.rf_name,
+		    sizeof(search_key.pfh_hostname));
+		if ((host = RB_FIND(pfresolved_hosts, &env->sc_hosts,
+		    &search_key)) == NULL) {
+			snprintf(rf.rf_error, sizeof(rf.rf_error),
+			    "unknown host %s", rf.rf_name);
+		} else {
+			rf.rf_hosts += refresh_host(env, rc, host,
+			    &rf.rf_seconds);
+			/* the addresses of an alias come from its target */
+			if (host->pfh_canon != NULL)
+				rf.rf_hosts += refresh_host(env, rc,
+				    host->pfh_canon, &rf.rf_seconds);
+		}
+	} else {
+		strlcpy(table_key.pft_name, rf.rf_name,
+		    sizeof(table_key.pft_name));
+		if ((table = RB_FIND(pfresolved_tables, &env->sc_tables,
+		    &table_key)) == NULL) {
+			snprintf(rf.rf_error, sizeof(rf.rf_error),
+			    "unknown table %s", rf.rf_name);
+		} else {
+			RB_FOREACH(host, pfresolved_hosts, &env->sc_hosts) {
+				if (!tableset_isset(&host->pfh_tables,
+				    table->pft_index))
+					continue;
+				rf.rf_hosts += refresh_host(env, rc, host,
+				    &rf.rf_seconds);
+				if (host->pfh_canon != NULL)
+					rf.rf_hosts += refresh_host(env, rc,
+					    host->pfh_canon, &rf.rf_seconds);
+			}
+		}
+	}
+
+	log_info("%s: refreshing %d hosts for %s within %d seconds", __func__,
+	    rf.rf_hosts, rf.rf_name, rf.rf_seconds);
+
+	proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_REFRESH,
+	    rc->rc_peerid, -1, &rf, sizeof(rf));
+
+	/* without waiting the reply ends now, the refresh is still tracked */
+	if (!rc->rc_wait || rf.rf_error[0] != '\0') {
+		proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1, IMSG_CTL_END,
+		    rc->rc_peerid, -1, NULL, 0);
+		rc->rc_wait = 0;
+	}
+
+	TAILQ_INSERT_TAIL(&refresh_ctxs, rc, rc_entry);
+	refresh_finish(env);
+}
+
+/*
+ * Move the timers of a host forward unless the host is being resolved
+ * right now or an earlier refresh has scheduled it already.
+ */
+int
+refresh_host(struct pfresolved *env, struct refresh_ctx *rc,
+    struct pfresolved_host *host, int *seconds)
+{
+	int		 delay = -1, left, af = 0;
+
+	if (host->pfh_refresh != NULL)
+		return (0);
+
+	if ((left = timer_remaining(&host->pfh_timer_v4)) != -1) {
+		delay = refresh_delay();
+		if (left > delay)
+			timer_add(env, &host->pfh_timer_v4, delay);
+		/* in dual-stack mode the v4 timer is used for both families */
+		af |= env->sc_dual_stack ? REFRESH_V4 | REFRESH_V6 : REFRESH_V4;
+	}
+	if (!env->sc_dual_stack &&
+	    (left = timer_remaining(&host->pfh_timer_v6)) != -1) {
+		if (delay == -1)
+			delay = refresh_delay();
+		if (left > delay)
+			timer_add(env, &host->pfh_timer_v6, delay);
+		af |= REFRESH_V6;
+	}
+	if (af == 0)
+		return (0);
+
+	host->pfh_refresh = rc;
+	host->pfh_refresh_af = af;
+	rc->rc_pending++;
+	if (delay > *seconds)
+		*seconds = delay;
+
+	return (1);
+}
+
+/* seconds until the next free slot, the slots are shared by all refreshes */
+int
+refresh_delay(void)
+{
+	struct timespec		 now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (refresh_second < now.tv_sec) {
+		refresh_second = now.tv_sec;
+		refresh_slots = 0;
+	}
+	if (refresh_slots >= REFRESH_RATE) {
+		refresh_second++;
+		refresh_slots = 0;
+	}
+	refresh_slots++;
+
+	return (refresh_second - now.tv_sec);
+}
+
+/*
+ * Called after the result of a host was applied to the pf tables, AF_UNSPEC
+ * when both results of a dual-stack request are done.
+ */
+void
+refresh_result(struct pfresolved *env, struct pfresolved_host *host,
+    sa_family_t af)
+{
+	if (host->pfh_refresh == NULL)
+		return;
+
+	if (af == AF_INET)
+		host->pfh_refresh_af &= ~REFRESH_V4;
+	else if (af == AF_INET6)
+		host->pfh_refresh_af &= ~REFRESH_V6;
+	else
+		host->pfh_refresh_af = 0;
+	if (host->pfh_refresh_af == 0)
+		refresh_done(env, host);
+}
+
+void
+refresh_free_host(struct pfresolved *env, struct pfresolved_host *host)
+{
+	if (host->pfh_refresh != NULL)
+		refresh_done(env, host);
+}
+
+void
+refresh_done(struct pfresolved *env, struct pfresolved_host *host)
+{
+	host->pfh_refresh->rc_pending--;
+	host->pfh_refresh = NULL;
+	host->pfh_refresh_af = 0;
+	refresh_finish(env);
+}
+
+void
+refresh_finish(struct pfresolved *env)
+{
+	struct refresh_ctx	*rc;
+
+	while ((rc = TAILQ_FIRST(&refresh_ctxs)) != NULL &&
+	    rc->rc_pending == 0) {
+		if (rc->rc_wait)
+			proc_compose_imsg(&env->sc_ps, PROC_CONTROL, -1,
+			    IMSG_CTL_END, rc->rc_peerid, -1, NULL, 0);
+		TAILQ_REMOVE(&refresh_ctxs, rc, rc_entry);
+		free(rc);
+	}
+}
@@ -61,11 +61,37 @@ sub func {
 
 sub show {
 	my $self = shift;
+	my $table = shift // "regress-pfresolved";
 	my @sudo = $ENV{SUDO} ? $ENV{SUDO} : ();
 
-	my @cmd = (@sudo, qw(/sbin/pfctl -t regress-pfresolved -T show));
+	my @cmd = (@sudo, "/sbin/pfctl", "-t", $table, "-T", "show");
 	system(@cmd)
 	    and die die ref($self), " command '@cmd' failed: $?";
 }
 
+# print the distribution of the query latencies logged by the forwarder
+sub latency {
+	my $self = shift;
+	my $num = shift;
+	my $pfresolved = $self->{pfresolved};
+	my $timeout = $self->{timeout} || 15;
+
+	my $took = qr/forwarder_process_result: query for .* took (\d+) usec/;
+	my @lines = $pfresolved->loggrep($took, $timeout, $num)
+	    or die ref($self), " no '$took' in $pfresolved->{logfile}";
+	my @usec = sort { $a <=> $b } map { /$took/ ? $1 : () } @lines;
+	printf("latency: %d queries, p50 %d usec, p90 %d usec, max %d usec\n",
+	    scalar @usec, $usec[@usec / 2], $usec[@usec * 9 / 10], $usec[-1]);
+}
+
+sub pfresolvectl {
+	my $self = shift;
+	my @sudo = $ENV{SUDO} ? $ENV{SUDO} : ();
+	my $ctl = $ENV{PFRESOLVECTL} ? $ENV{PFRESOLVECTL} : "pfresolvectl";
+
+	my @cmd = (@sudo, $ctl, @_);
+	system(@cmd)
+	    and die ref($self), " command '@cmd' failed: $?";
+}
+
 1;
@@ -47,6 +47,14 @@ sub new {
 		print $fh "	$a\n";
 	}
 	print $fh  "}\n";
+	my $tables = $self->{table_list} || {};
+	foreach my $t (sort keys %$tables) {
+		print $fh "$t {\n";
+		foreach my $a (@{$tables->{$t}}) {
+			print $fh "	$a\n";
+		}
+		print $fh  "}\n";
+	}
 
 	return $self;
 }
@@ -82,7 +90,14 @@ sub child {
 	my @cmd = (@sudo, @env, @ktrace, $self->{execfile}, "-dvvv",
 	    "-f", $self->{conffile});
 	push @cmd, "-r", $resolver if $resolver;
+	push @cmd, map { ("-r", $_) } @{$self->{resolvers} || []};
 	push @cmd, "-m", $self->{min_ttl} if $self->{min_ttl};
+	push @cmd, "-e", $self->{engine} if $self->{engine};
+	push @cmd, "-H", $self->{hedge} if $self->{hedge};
+	push @cmd, "-K" if $self->{key_cache};
+	push @cmd, "-b" if $self->{dual_stack};
+	push @cmd, "-R", $self->{restricted_socket}
+	    if $self->{restricted_socket};
 	push @cmd, "-A", $self->{trust_anchor_file}
 	    if $self->{trust_anchor_file};
 	if ($self->{dnssec_level}) {
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check the radix sort of address keys against qsort(3) with the same order
+ * for every size from 0 to MAX_CHECK addresses of both families. The keys
+ * are either random or share a prefix and contain duplicates, so the radix
+ * sort also skips digits that are equal in all keys.
+ *
+ * With -b the time of addrset_sort() and qsort(3) is measured for 1 to 4096
+ * addresses, at powers of two and halfway between them.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pfresolved.h"
+
+#define MAX_CHECK	5000
+#define MAX_BENCH	4096
+#define BENCH_KEYS	(1024 * 1024)
+
+void	 fill(sa_family_t, uint8_t *, int, int);
+int	 qsort_cmp(const void *, const void *);
+void	 check(sa_family_t);
+double	 bench_one(sa_family_t, uint8_t *, uint8_t *, int, int);
+void	 bench_size(sa_family_t, uint8_t *, uint8_t *, int);
+void	 bench(sa_family_t);
+void	 usage(void);
+
+static sa_family_t	 qsort_af;
+
+/* the radix sort can only be checked with some addresses per digit */
+void
+fill(sa_family_t af, uint8_t *keys, int num, int dense)
+{
+	size_t		 len = ADDRSET_KEYLEN(af);
+	uint32_t	 r;
+	int		 i;
+
+	arc4random_buf(keys, num * len);
+	if (!dense)
+		return;
+
+	/* 192.0.2.0/24 and 2001:db8::/120 with duplicates */
+	for (i = 0; i < num; i++) {
+		r = arc4random_uniform(num / 2 + 1) & 0xff;
+		if (af == AF_INET) {
+			keys[i * len + 0] = 192;
+			keys[i * len + 1] = 0;
+			keys[i * len + 2] = 2;
+			keys[i * len + 3] = r;
+		} else {
+			memset(&keys[i * len], 0, len);
+			keys[i * len + 0] = 0x20;
+			keys[i * len + 1] = 0x01;
+			keys[i * len + 2] = 0x0d;
+			keys[i * len + 3] = 0xb8;
+			keys[i * len + 15] = r;
+		}
+	}
+}
+
+int
+qsort_cmp(const void *a, const void *b)
+{
+	return (addrset_key_cmp(qsort_af, a, b));
+}
+
+void
+check(sa_family_t af)
+{
+	size_t		 len = ADDRSET_KEYLEN(af);
+	uint8_t		*radix, *ref;
+	int		 num, dense;
+
+	if ((radix = calloc(MAX_CHECK, len)) == NULL ||
+	    (ref = calloc(MAX_CHECK, len)) == NULL)
+		err(1, "calloc");
+
+	qsort_af = af;
+	for (num = 0; num <= MAX_CHECK; num++) {
+		for (dense = 0; dense <= 1; dense++) {
+			fill(af, radix, num, dense);
+			memcpy(ref, radix, num * len);
+			addrset_sort(af, radix, num);
+			qsort(ref, num, len, qsort_cmp);
+			if (memcmp(radix, ref, num * len) != 0)
+				errx(1, "%s: %s sort of %d addresses differs",
+				    af == AF_INET ? "inet" : "inet6",
+				    dense ? "dense" : "random", num);
+		}
+	}
+	printf("%s: sorted 0 to %d addresses like qsort\n",
+	    af == AF_INET ? "inet" : "inet6", MAX_CHECK);
+
+	free(radix);
+	free(ref);
+}
+
+/* nanoseconds per sort, the input is copied from a fresh random array */
+double
+bench_one(sa_family_t af, uint8_t *keys, uint8_t *input, int num, int addrset)
+{
+	struct timespec	 start, end;
+	size_t		 len = ADDRSET_KEYLEN(af);
+	int		 i, rounds = BENCH_KEYS / num;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++) {
+		memcpy(keys, input, num * len);
+		if (addrset)
+			addrset_sort(af, keys, num);
+		else
+			qsort(keys, num, len, qsort_cmp);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (((end.tv_sec - start.tv_sec) * 1e9 +
+	    (end.tv_nsec - start.tv_nsec)) / rounds);
+}
+
+void
+bench_size(sa_family_t af, uint8_t *keys, uint8_t *input, int num)
+{
+	double		 sorted, ref;
+
+	fill(af, input, num, 0);
+	sorted = bench_one(af, keys, input, num, 1);
+	ref = bench_one(af, keys, input, num, 0);
+	printf("%-6s %6d %12.0f %12.0f %7.2f\n",
+	    af == AF_INET ? "inet" : "inet6", num, sorted, ref,
+	    sorted > 0 ? ref / sorted : 0.0);
+}
+
+void
+bench(sa_family_t af)
+{
+	size_t		 len = ADDRSET_KEYLEN(af);
+	uint8_t		*keys, *input;
+	int		 num;
+
+	if ((keys = calloc(MAX_BENCH, len)) == NULL ||
+	    (input = calloc(MAX_BENCH, len)) == NULL)
+		err(1, "calloc");
+
+	qsort_af = af;
+	printf("%-6s %6s %12s %12s %7s\n", "family", "num", "addrset ns",
+	    "qsort ns", "speedup");
+	for (num = 1; num <= MAX_BENCH; num *= 2) {
+		bench_size(af, keys, input, num);
+		if (num >= 8 && num < MAX_BENCH)
+			bench_size(af, keys, input, num + num / 2);
+	}
+
+	free(keys);
+	free(input);
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: addrset-sort [-b]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int		 ch, bflag = 0;
+
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		case 'b':
+			bflag = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	log_init(1, LOG_DAEMON);
+
+	if (bflag) {
+		bench(AF_INET);
+		bench(AF_INET6);
+	} else {
+		check(AF_INET);
+		check(AF_INET6);
+	}
+
+	return (0);
+}
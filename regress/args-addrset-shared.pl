@@ -0,0 +1,78 @@
+# Create zone file with A and AAAA records in zone regress.
+# Three hosts have the same addresses, a fourth host has other ones.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write hosts of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Check that the hosts with the same addresses share their address sets.
+# Change the IPv4 address of one of the sharing hosts and refresh.
+# Check that this host got its own set and the others kept theirs.
+# Reload the config and refresh, check that no set was leaked.
+# Check the pf table contents after each step.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    (map { ("$_	IN	A	192.0.2.1", "$_	IN	AAAA	2001:DB8::1") }
+		qw(foo bar baz)),
+	    "qux	IN	A	192.0.2.2",
+	    "qux	IN	AAAA	2001:DB8::2",
+	],
+    },
+    pfresolved => {
+	address_list => [ map { "$_.regress." } qw(foo bar baz qux) ],
+	loggrep => {
+	    qr/addresses for bar.regress. \(A\) changed:/ => 3,
+	    qr/addresses for foo.regress. \(A\) changed:/ => 2,
+	    qr/reload requested/ => 1,
+	},
+    },
+    pfctl => {
+	updated => [4, 1],
+	func => sub {
+	    my $self = shift;
+	    my $nsd = $self->{nsd};
+
+	    # wait until all hosts have both families
+	    $self->pfresolvectl(qw(refresh table regress-pfresolved wait));
+	    $self->show();
+	    $self->pfresolvectl(qw(show stats));
+
+	    $nsd->zone(
+		record_list => [
+		    (map { ("$_	IN	A	192.0.2.1",
+			"$_	IN	AAAA	2001:DB8::1") } qw(foo baz)),
+		    "bar	IN	A	192.0.2.3",
+		    "bar	IN	AAAA	2001:DB8::1",
+		    "qux	IN	A	192.0.2.2",
+		    "qux	IN	AAAA	2001:DB8::2",
+		],
+	    );
+	    $nsd->sighup();
+	    $self->pfresolvectl(qw(refresh table regress-pfresolved wait));
+	    $self->show();
+	    $self->pfresolvectl(qw(show stats));
+
+	    $self->pfresolvectl(qw(reload));
+	    $self->pfresolvectl(qw(refresh table regress-pfresolved wait));
+	    $self->show();
+	    $self->pfresolvectl(qw(show stats));
+	},
+	loggrep => {
+	    qr/^address_sets +4$/ => 1,
+	    qr/^address_sets +5$/ => 2,
+	    qr/^table_entries\{table="regress-pfresolved"\} +4$/ => 1,
+	    qr/^table_entries\{table="regress-pfresolved"\} +5$/ => 2,
+	    qr/^   192.0.2.1$/ => 3,
+	    qr/^   192.0.2.2$/ => 3,
+	    qr/^   192.0.2.3$/ => 2,
+	    qr/^   2001:db8::1$/ => 3,
+	    qr/^   2001:db8::2$/ => 3,
+	},
+    },
+);
+
+1;
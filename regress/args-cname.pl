@@ -0,0 +1,41 @@
+# Create zone file with two CNAMEs to the same A and AAAA records.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write aliases of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Read IP addresses from pf table with pfctl.
+# Check that pfresolved learned the CNAME target once for both aliases.
+# Check that pf table contains the IPv4 and IPv6 address of the target.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	CNAME	target",
+	    "bar	IN	CNAME	target",
+	    "target	IN	A	192.0.2.1",
+	    "target	IN	AAAA	2001:DB8::1",
+	],
+    },
+    pfresolved => {
+	address_list => [ map { "$_.regress." } qw(foo bar) ],
+	loggrep => {
+	    qr/resolving CNAME target target.regress./ => 1,
+	    qr/foo.regress. is an alias of target.regress./ => 1,
+	    qr/bar.regress. is an alias of target.regress./ => 1,
+	    qr{added: 192.0.2.1/32,} => 2,
+	    qr{added: 2001:db8::1/128,} => 2,
+	},
+    },
+    pfctl => {
+	updated => [2, 1],
+	loggrep => {
+	    qr/^   192.0.2.1$/ => 1,
+	    qr/^   2001:db8::1$/ => 1,
+	},
+    },
+);
+
+1;
@@ -0,0 +1,52 @@
+# Create zone file with A and AAAA records with TTL 2 seconds.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write host of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Wait until TTL has expired and pfresolved has resolved the host again.
+# Check that the fingerprint of the unchanged result was recognized.
+# Check that the pf table was not updated for the unchanged result.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	2	A	192.0.2.1",
+	    "foo	2	AAAA	2001:DB8::1",
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress." ],
+	min_ttl => 1,
+	loggrep => {
+	    qr{added: 192.0.2.1/32,} => 1,
+	    qr{added: 2001:db8::1/128,} => 1,
+	    qr/foo.regress. \(A\) did not change, \d+ of \d+ results/ => '>=1',
+	    qr/updated addresses for pf table .*: added: 1,/ => 2,
+	},
+    },
+    pfctl => {
+	updated => [2, 1],
+	func => sub {
+	    my $self = shift;
+	    my $pfresolved = $self->{pfresolved};
+
+	    # wait until TTL 2 has expired and pfresolvd delays another second
+	    my $timeout = 5;
+	    my $unchanged = qr/did not change, \d+ of \d+ results unchanged/;
+	    $pfresolved->loggrep($unchanged, $timeout, 2)
+		or die ref($self), " no '$unchanged' in ",
+		    "$pfresolved->{logfile} after $timeout seconds";
+
+	    $self->show();
+	},
+	loggrep => {
+	    qr/^   192.0.2.1$/ => 1,
+	    qr/^   2001:db8::1$/ => 1,
+	},
+    },
+);
+
+1;
@@ -0,0 +1,61 @@
+# Create zone file with A and AAAA records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write host foo of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Add host bar and delete host foo with pfresolvectl.
+# Check that only the addresses of bar are in the table.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	A	192.0.2.1",
+	    "foo	IN	AAAA	2001:DB8::1",
+	    "bar	IN	A	192.0.2.2",
+	    "bar	IN	AAAA	2001:DB8::2",
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress." ],
+	loggrep => {
+	    qr/adding bar.regress. to table regress-pfresolved/ => 1,
+	    qr/removing foo.regress. from table regress-pfresolved/ => 1,
+	},
+    },
+    pfctl => {
+	updated => [2, 1],
+	func => sub {
+	    my $self = shift;
+	    my $pfresolved = $self->{pfresolved};
+
+	    $self->pfresolvectl(qw(host add regress-pfresolved bar.regress.));
+	    $self->pfresolvectl(qw(host add regress-pfresolved bar.regress.));
+
+	    # the new host is resolved at once, wait for A and AAAA
+	    my $table = qr/updated addresses for pf table .*: added: 1,/;
+	    $pfresolved->loggrep($table, 5, 4)
+		or die ref($self), " no '$table' in $pfresolved->{logfile}";
+
+	    $self->pfresolvectl(qw(host delete regress-pfresolved foo.regress.));
+	    $table = qr/updated addresses for pf table .*, deleted: 2,/;
+	    $pfresolved->loggrep($table, 5, 1)
+		or die ref($self), " no '$table' in $pfresolved->{logfile}";
+
+	    $self->show();
+	},
+	loggrep => {
+	    qr/^received 1, added 1, removed 0, kept 0, failed 0$/ => 1,
+	    qr/^received 1, added 0, removed 0, kept 1, failed 0$/ => 1,
+	    qr/^received 1, added 0, removed 1, kept 0, failed 0$/ => 1,
+	    qr/^   192.0.2.1$/ => 0,
+	    qr/^   192.0.2.2$/ => 1,
+	    qr/^   2001:db8::1$/ => 0,
+	    qr/^   2001:db8::2$/ => 1,
+	},
+    },
+);
+
+1;
@@ -0,0 +1,61 @@
+# Create zone file with A and AAAA records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write hosts foo and bar of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Import a list with bar and baz into the table with pfresolvectl.
+# Check that foo was removed, bar was kept and baz was added.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	A	192.0.2.1",
+	    "bar	IN	A	192.0.2.2",
+	    "baz	IN	A	192.0.2.3",
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress.", "bar.regress." ],
+	loggrep => {
+	    qr/imported 2 hosts into table .*: added 1, removed 1, kept 1/ => 1,
+	},
+    },
+    pfctl => {
+	updated => [2, 1],
+	func => sub {
+	    my $self = shift;
+	    my $pfresolved = $self->{pfresolved};
+
+	    open(my $list, '>', "import.txt")
+		or die ref($self), " open import.txt failed: $!";
+	    print $list "# hosts of regress\n", "bar.regress.\n",
+		"baz.regress.\n", "\n", "bar.regress.\n";
+	    close($list);
+	    open(my $stdin, '<&', \*STDIN)
+		or die ref($self), " dup STDIN failed: $!";
+	    open(STDIN, '<', "import.txt")
+		or die ref($self), " open import.txt failed: $!";
+	    $self->pfresolvectl(qw(import regress-pfresolved));
+	    open(STDIN, '<&', $stdin)
+		or die ref($self), " restore STDIN failed: $!";
+
+	    # foo is removed at once, baz is added after it was resolved
+	    my $table = qr/updated addresses for pf table .*: added: 1,/;
+	    $pfresolved->loggrep($table, 5, 3)
+		or die ref($self), " no '$table' in $pfresolved->{logfile}";
+
+	    $self->show();
+	},
+	loggrep => {
+	    qr/^received 3, added 1, removed 1, kept 1, failed 0$/ => 1,
+	    qr/^   192.0.2.1$/ => 0,
+	    qr/^   192.0.2.2$/ => 1,
+	    qr/^   192.0.2.3$/ => 1,
+	},
+    },
+);
+
+1;
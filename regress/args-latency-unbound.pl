@@ -0,0 +1,41 @@
+# Create zone file with 100 hosts with an A record in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write hosts of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver and the unbound engine.
+# Wait until pfresolved has added all addresses to the pf table.
+# Print the distribution of the query latencies of the forwarder.
+# Compare the output with args-latency-event.pl to measure the engines.
+
+use strict;
+use warnings;
+
+my @hosts = map { "host$_" } 0..99;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    map { "$hosts[$_]	IN	A	192.0.2.$_" } 0..$#hosts,
+	],
+    },
+    pfresolved => {
+	address_list => [ map { "$_.regress." } @hosts ],
+	engine => "unbound",
+	loggrep => {
+	    qr/-e unbound/ => 1,
+	},
+    },
+    pfctl => {
+	updated => [100, 1],
+	func => sub {
+	    my $self = shift;
+
+	    # one A and one AAAA query per host
+	    $self->latency(200);
+	},
+	loggrep => {
+	    qr/^latency: 200 queries, p50 \d+ usec, / => 1,
+	},
+    },
+);
+
+1;
@@ -0,0 +1,51 @@
+# Create zone file with A and AAAA records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write hosts of regress zone and a static address into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Look up the addresses with pfresolvectl.
+# Check that the hosts that share an address are found.
+# Check that the static address is found.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	A	192.0.2.1",
+	    "foo	IN	AAAA	2001:DB8::1",
+	    "bar	IN	A	192.0.2.1",
+	    "bar	IN	AAAA	2001:DB8::2",
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress.", "bar.regress.", "192.0.2.9" ],
+    },
+    pfctl => {
+	updated => [3, 1],
+	func => sub {
+	    my $self = shift;
+	    my $pfresolved = $self->{pfresolved};
+
+	    # the shared address of bar does not change the table
+	    my $bar = qr/addresses for bar.regress. \(A\) changed/;
+	    $pfresolved->loggrep($bar, 5, 1)
+		or die ref($self), " no '$bar' in $pfresolved->{logfile}";
+
+	    $self->pfresolvectl(qw(lookup 192.0.2.1));
+	    $self->pfresolvectl(qw(lookup 2001:db8::2));
+	    $self->pfresolvectl(qw(lookup 192.0.2.9));
+
+	    eval { $self->pfresolvectl(qw(lookup 192.0.2.99)) };
+	    $@ or die ref($self), " lookup of unknown address succeeded";
+	},
+	loggrep => {
+	    qr/^regress-pfresolved +bar.regress.$/ => 2,
+	    qr/^regress-pfresolved +foo.regress.$/ => 1,
+	    qr/^regress-pfresolved +\(static\)$/ => 1,
+	},
+    },
+);
+
+1;
@@ -0,0 +1,74 @@
+# Create zone file with A and AAAA records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write host foo of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Start pfresolvectl monitor for the table in the background.
+# Add host bar and delete host foo with pfresolvectl.
+# Check that the monitor reported the added and removed addresses.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	A	192.0.2.1",
+	    "bar	IN	A	192.0.2.2",
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress." ],
+	loggrep => {
+	    qr/monitor enabled/ => 1,
+	},
+    },
+    pfctl => {
+	updated => [1, 1],
+	func => sub {
+	    my $self = shift;
+	    my $pfresolved = $self->{pfresolved};
+	    my @sudo = $ENV{SUDO} ? $ENV{SUDO} : "env";
+	    my $ctl = $ENV{PFRESOLVECTL} ? $ENV{PFRESOLVECTL} :
+		"pfresolvectl";
+
+	    defined(my $pid = fork())
+		or die ref($self), " fork failed: $!";
+	    if ($pid == 0) {
+		open(STDOUT, '>', "monitor.log")
+		    or die ref($self), " open monitor.log failed: $!";
+		exec(@sudo, $ctl, qw(monitor table regress-pfresolved));
+		die ref($self), " exec $ctl failed: $!";
+	    }
+	    $pfresolved->loggrep(qr/monitor enabled/, 5)
+		or die ref($self), " monitor not enabled";
+
+	    $self->pfresolvectl(qw(host add regress-pfresolved bar.regress.));
+	    my $table = qr/updated addresses for pf table .*: added: 1,/;
+	    $pfresolved->loggrep($table, 5, 2)
+		or die ref($self), " no '$table' in $pfresolved->{logfile}";
+	    $self->pfresolvectl(
+		qw(host delete regress-pfresolved foo.regress.));
+	    $table = qr/updated addresses for pf table .*, deleted: 1,/;
+	    $pfresolved->loggrep($table, 5, 1)
+		or die ref($self), " no '$table' in $pfresolved->{logfile}";
+
+	    # the monitor runs until it is killed
+	    sleep 1;
+	    system(@sudo, "pkill", "-x", "pfresolvectl");
+	    waitpid($pid, 0);
+
+	    open(my $log, '<', "monitor.log")
+		or die ref($self), " open monitor.log failed: $!";
+	    print while <$log>;
+	    close($log);
+	},
+	loggrep => {
+	    qr/ add +regress-pfresolved 192.0.2.2 bar.regress.$/ => 1,
+	    qr/ remove regress-pfresolved 192.0.2.1 foo.regress.$/ => 1,
+	    qr/dropped/ => 0,
+	},
+    },
+);
+
+1;
@@ -0,0 +1,54 @@
+# Create zone file with A and AAAA records in zone regress.
+# The addresses differ in their first, last and middle bytes.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write host of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Check that the addresses were sorted in address order.
+# Check that pf table, show host and lookup have the original addresses.
+
+use strict;
+use warnings;
+
+my @inet = qw(255.255.255.254 10.0.0.1 203.0.113.1 192.0.2.255);
+my @inet6 = qw(2001:db8:ffff::1 2001:db8::ff:0:1 2001:db8::1);
+
+our %args = (
+    nsd => {
+	record_list => [
+	    (map { "foo	IN	A	$_" } @inet),
+	    (map { "foo	IN	AAAA	$_" } @inet6),
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress." ],
+	loggrep => {
+	    qr{\(A\) changed: addresses: 10.0.0.1/32, 192.0.2.255/32, }.
+		qr{203.0.113.1/32, 255.255.255.254/32,} => 1,
+	    qr{\(AAAA\) changed: addresses: 2001:db8::1/128, }.
+		qr{2001:db8::ff:0:1/128, 2001:db8:ffff::1/128,} => 1,
+	},
+    },
+    pfctl => {
+	updated => [1, 4],
+	func => sub {
+	    my $self = shift;
+	    my $pfresolved = $self->{pfresolved};
+
+	    my $aaaa = qr/added: 3,/;
+	    $pfresolved->loggrep($aaaa, 5, 1)
+		or die ref($self), " no '$aaaa' in $pfresolved->{logfile}";
+
+	    $self->show();
+	    $self->pfresolvectl(qw(show host foo.regress.));
+	    $self->pfresolvectl("lookup", $_) foreach @inet, @inet6;
+	},
+	loggrep => {
+	    (map { (qr/^   \Q$_\E$/ => 1, qr/^address: \Q$_\E$/ => 1) }
+		@inet, @inet6),
+	    qr/^regress-pfresolved +foo.regress.$/ => 7,
+	},
+    },
+);
+
+1;
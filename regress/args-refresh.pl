@@ -0,0 +1,71 @@
+# Create zone file with A and AAAA records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write hosts of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Write new zone file with all adresses changed.
+# Refresh host foo and wait, then refresh the table and wait.
+# Check that pf table contains the new addresses before the TTL expired.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	A	192.0.2.1",
+	    "foo	IN	AAAA	2001:DB8::1",
+	    "bar	IN	A	192.0.2.2",
+	    "bar	IN	AAAA	2001:DB8::2",
+	],
+    },
+    pfresolved => {
+	address_list => [ map { "$_.regress." } qw(foo bar) ],
+	loggrep => {
+	    qr/refreshing 1 hosts for foo.regress. within 0 seconds/ => 1,
+	    qr/refreshing 2 hosts for regress-pfresolved within 0 seconds/
+		=> 1,
+	    qr{added: 192.0.2.10/32,} => 1,
+	    qr{added: 2001:db8::20/128,} => 1,
+	},
+    },
+    pfctl => {
+	updated => [4, 1],
+	func => sub {
+	    my $self = shift;
+	    my $nsd = $self->{nsd};
+
+	    $nsd->zone(
+		record_list => [
+		    "foo	IN	A	192.0.2.10",
+		    "foo	IN	AAAA	2001:DB8::10",
+		    "bar	IN	A	192.0.2.20",
+		    "bar	IN	AAAA	2001:DB8::20",
+		],
+	    );
+	    $nsd->sighup();
+
+	    # wait returns after the addresses were written to pf
+	    $self->pfresolvectl(qw(refresh host foo.regress. wait));
+	    $self->show();
+	    $self->pfresolvectl(qw(refresh table regress-pfresolved wait));
+	    $self->show();
+
+	    eval { $self->pfresolvectl(qw(refresh host unknown.regress.)) };
+	    $@ or die ref($self), " refresh of unknown host succeeded";
+	},
+	loggrep => {
+	    qr/^refreshing 1 hosts, last request in 0 seconds$/ => 1,
+	    qr/^refreshing 2 hosts, last request in 0 seconds$/ => 1,
+	    qr/^refresh done$/ => 2,
+	    qr/^   192.0.2.10$/ => 2,
+	    qr/^   192.0.2.2$/ => 1,
+	    qr/^   192.0.2.20$/ => 1,
+	    qr/^   2001:db8::10$/ => 2,
+	    qr/^   2001:db8::2$/ => 1,
+	    qr/^   2001:db8::20$/ => 1,
+	},
+    },
+);
+
+1;
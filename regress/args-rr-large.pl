@@ -0,0 +1,35 @@
+# Create zone file with 3000 A records for one name in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write host of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Read IP addresses from pf table with pfctl.
+# Check that the result was split into several messages.
+# Check that pf table contains all 3000 IPv4 addresses.
+
+use strict;
+use warnings;
+
+my @addresses = map { my $i = $_; map { "10.0.$i.$_" } 1..250 } 0..11;
+
+our %args = (
+    nsd => {
+	record_list => [ map { "large	IN	A	$_" } @addresses ],
+    },
+    pfresolved => {
+	address_list => [ "large.regress." ],
+	loggrep => {
+	    qr/query for large.regress. \(A\): address 2999: 10.0.11.250/ => 1,
+	    qr/addresses for large.regress. \(A\) changed/ => 1,
+	    qr/maximum of \d+ addresses exceeded/ => 0,
+	},
+    },
+    pfctl => {
+	updated => [1, 3000],
+	loggrep => {
+	    qr/^   10\.0\.\d+\.\d+$/ => 3000,
+	},
+    },
+);
+
+1;
@@ -0,0 +1,49 @@
+# Create zone file with A and AAAA records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write hosts of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Show hosts and tables with pfresolvectl, also as JSON.
+# Check that the host, its addresses and the table entries are shown.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	A	192.0.2.1",
+	    "foo	IN	AAAA	2001:DB8::1",
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress." ],
+    },
+    pfctl => {
+	updated => [2, 1],
+	func => sub {
+	    my $self = shift;
+
+	    $self->pfresolvectl(qw(show hosts));
+	    $self->pfresolvectl(qw(show host foo.regress.));
+	    $self->pfresolvectl(qw(show tables));
+	    $self->pfresolvectl(qw(show table regress-pfresolved));
+	    $self->pfresolvectl(qw(-j show hosts));
+	    $self->pfresolvectl(qw(-j show table regress-pfresolved));
+	},
+	loggrep => {
+	    qr/^foo.regress. +1 +1 +\d+s +\d+s +0 +1 -$/ => 1,
+	    qr/^host: foo.regress.$/ => 1,
+	    qr/^table: regress-pfresolved$/ => 2,
+	    qr/^address: 192.0.2.1$/ => 2,
+	    qr/^address: 2001:db8::1$/ => 2,
+	    qr/^regress-pfresolved +2 +0$/ => 1,
+	    qr/^entries: 2, static: 0$/ => 1,
+	    qr/^\[\{"hostname":"foo.regress.","cname":null,"a":\{"addresses":1,/
+		=> 1,
+	    qr/"addresses":\[\{"address":"192.0.2.1","negate":false,/ => 1,
+	},
+    },
+);
+
+1;
@@ -0,0 +1,60 @@
+# Create zone file with A and AAAA records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write hosts of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver and a restricted control socket.
+# Wait until pfresolved creates table regress-pfresolved.
+# Get the metrics with pfresolvectl from the restricted socket.
+# Check that queries, answers and pf table updates were counted.
+# Check that the latency of the stages and pf commits was measured.
+# Check that reload is not allowed on the restricted socket.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	A	192.0.2.1",
+	    "foo	IN	AAAA	2001:DB8::1",
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress." ],
+	restricted_socket => "pfresolved-ro.sock",
+	loggrep => {
+	    qr/-R pfresolved-ro.sock/ => 1,
+	    qr/imsg \d+ not allowed on restricted socket/ => 1,
+	    qr/reload requested/ => 0,
+	},
+    },
+    pfctl => {
+	updated => [2, 1],
+	func => sub {
+	    my $self = shift;
+
+	    $self->pfresolvectl(qw(-s pfresolved-ro.sock show metrics));
+	    $self->pfresolvectl(qw(-s pfresolved-ro.sock reload));
+	    $self->pfresolvectl(qw(-s pfresolved-ro.sock show stats));
+	},
+	loggrep => {
+	    qr/^# TYPE pfresolved_queries_total counter$/ => 1,
+	    qr/^pfresolved_queries_total [1-9]/ => 1,
+	    qr/^pfresolved_answers_total\{rcode="NOERROR"\} [1-9]/ => 1,
+	    qr/^pfresolved_pf_commits_total [1-9]/ => 1,
+	    qr/^pfresolved_table_entries\{table="regress-pfresolved"\} 2$/ =>
+		1,
+	    qr/^pfresolved_hosts\{state="resolved"\} 1$/ => 1,
+	    qr/^pfresolved_stage_duration_seconds_bucket\{stage="resolve",le="\+Inf"\} [1-9]/ =>
+		1,
+	    qr/^pfresolved_stage_duration_seconds_count\{stage="commit"\} [1-9]/ =>
+		1,
+	    qr/^pfresolved_pf_commit_duration_seconds_count\{table="regress-pfresolved"\} [1-9]/ =>
+		1,
+	    qr/^stage_duration_seconds\{stage="timer"\} +count \d+, p50 / =>
+		1,
+	    qr/^queries_total +[1-9]/ => 1,
+	},
+    },
+);
+
+1;
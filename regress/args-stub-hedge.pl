@@ -0,0 +1,38 @@
+# Create zone file with A records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write hosts of regress zone into pfresolved config.
+# Start pfresolved with the stub engine and hedging, nsd and a dead resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Read IP addresses from pf table with pfctl.
+# Check that pfresolved added all addresses.
+# Check that pf table contains all IPv4 addresses.
+
+use strict;
+use warnings;
+use Socket;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    map { "host$_	IN	A	192.0.2.$_" } 1..8,
+	],
+    },
+    pfresolved => {
+	address_list => [ map { "host$_.regress." } 1..8 ],
+	engine => "stub",
+	hedge => 10,
+	resolvers => [ "127.0.0.1\@9" ],
+	loggrep => {
+	    qr/-H 10/ => 1,
+	    qr{added: 192.0.2.\d/32,} => 8,
+	},
+    },
+    pfctl => {
+	updated => [8, 1],
+	loggrep => {
+	    qr/^   192.0.2.[1-8]$/ => 8,
+	},
+    },
+);
+
+1;
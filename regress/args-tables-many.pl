@@ -0,0 +1,74 @@
+# Create zone file with A records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write 70 tables into pfresolved config, more than fit into the inline
+# table bitset of a host.  Host foo is in all tables, host bar only in
+# the last one.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved has added the addresses to all tables.
+# Change the addresses of both hosts and refresh, then reload and refresh.
+# Check the contents of the first and the last pf table after each step.
+# Check that bar is only in the last table.
+
+use strict;
+use warnings;
+
+my @tables = map { "regress-pfresolved-$_" } 1..69;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	A	192.0.2.1",
+	    "bar	IN	A	192.0.2.2",
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress." ],
+	table_list => {
+	    (map { $_ => [ "foo.regress." ] } @tables[0..67]),
+	    $tables[68] => [ "foo.regress.", "bar.regress." ],
+	},
+	loggrep => {
+	    qr/reload requested/ => 1,
+	},
+    },
+    pfctl => {
+	updated => [71, 1],
+	func => sub {
+	    my $self = shift;
+	    my $nsd = $self->{nsd};
+
+	    $self->pfresolvectl(qw(refresh table regress-pfresolved-69 wait));
+	    $self->show();
+	    $self->show("regress-pfresolved-69");
+	    $self->pfresolvectl(qw(show tables));
+
+	    $nsd->zone(
+		record_list => [
+		    "foo	IN	A	192.0.2.10",
+		    "bar	IN	A	192.0.2.20",
+		],
+	    );
+	    $nsd->sighup();
+	    $self->pfresolvectl(qw(refresh table regress-pfresolved-69 wait));
+	    $self->show();
+	    $self->show("regress-pfresolved-69");
+
+	    $self->pfresolvectl(qw(reload));
+	    $self->pfresolvectl(qw(refresh table regress-pfresolved-69 wait));
+	    $self->show();
+	    $self->show("regress-pfresolved-69");
+	    $self->pfresolvectl(qw(show tables));
+	},
+	loggrep => {
+	    qr/^   192.0.2.1$/ => 2,
+	    qr/^   192.0.2.2$/ => 1,
+	    qr/^   192.0.2.10$/ => 4,
+	    qr/^   192.0.2.20$/ => 2,
+	    qr/^regress-pfresolved +1 +0$/ => 2,
+	    qr/^regress-pfresolved-\d+ +1 +0$/ => 136,
+	    qr/^regress-pfresolved-69 +2 +0$/ => 2,
+	},
+    },
+);
+
+1;
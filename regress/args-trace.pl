@@ -0,0 +1,43 @@
+# Create zone file with A and AAAA records in zone regress.
+# Start nsd with zone file listening on 127.0.0.1.
+# Write hosts of regress zone into pfresolved config.
+# Start pfresolved with nsd as resolver.
+# Wait until pfresolved creates table regress-pfresolved.
+# Dump the event trace of parent and forwarder with pfresolvectl.
+# Check that resolve timers, requests, answers, results and pf table
+# commits were traced with their host.
+
+use strict;
+use warnings;
+
+our %args = (
+    nsd => {
+	record_list => [
+	    "foo	IN	A	192.0.2.1",
+	    "foo	IN	AAAA	2001:DB8::1",
+	],
+    },
+    pfresolved => {
+	address_list => [ "foo.regress." ],
+    },
+    pfctl => {
+	updated => [2, 1],
+	func => sub {
+	    my $self = shift;
+
+	    $self->pfresolvectl(qw(trace));
+	},
+	loggrep => {
+	    qr/^ +AGE PROCESS +EVENT +TYPE NAME +VALUE$/ => 1,
+	    qr/ parent +timer +AAAA foo.regress. +\d+$/ => 1,
+	    qr/ parent +request A +foo.regress. +0$/ => 1,
+	    qr/ forwarder request AAAA foo.regress. +0$/ => 1,
+	    qr/ forwarder answer +A +foo.regress. +0$/ => 1,
+	    qr/ parent +result +AAAA foo.regress. +1$/ => 1,
+	    qr/ parent +diff +A +foo.regress. +1$/ => 1,
+	    qr/ parent +commit +- +regress-pfresolved +[12]$/ => 2,
+	},
+    },
+);
+
+1;
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Send rounds of queries through the DNS-over-TLS connections of the stub
+ * engine and count how many connections, handshakes and writes they need.
+ * The libtls functions are replaced by a plain TCP transport, so this
+ * measures the connection pool and the pipelining, not the cost of TLS.
+ * The responder is a child process that answers every query with a single
+ * A record.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "pfresolved.h"
+
+#define ROUND_DEFAULT	1000
+#define ROUNDS		3
+#define POOL_SIZE	2	/* STUB_DOT_CONNS of stub.c */
+
+struct tls {
+	int		 t_fd;
+};
+
+struct tls_config {
+	int		 tc_dummy;
+};
+
+int	 __real_connect(int, const struct sockaddr *, socklen_t);
+int	 __wrap_connect(int, const struct sockaddr *, socklen_t);
+void	 responder(int);
+void	 answer(int);
+void	 done_cb(void *, int, struct ub_result *);
+int	 round_run(struct pfresolved *, int);
+
+static unsigned long	 num_connect, num_handshake, num_write;
+static int		 num_done, num_failed, num_queries;
+
+/* the stub engine needs this for pfresolvectl show resolvers only */
+int
+proc_compose_imsg(struct privsep *ps, enum privsep_procid id, int n,
+    uint16_t type, uint32_t peerid, int fd, void *data, uint16_t datalen)
+{
+	return (0);
+}
+
+int
+__wrap_connect(int s, const struct sockaddr *sa, socklen_t salen)
+{
+	num_connect++;
+	return (__real_connect(s, sa, salen));
+}
+
+struct tls_config *
+tls_config_new(void)
+{
+	return (calloc(1, sizeof(struct tls_config)));
+}
+
+void
+tls_config_free(struct tls_config *config)
+{
+	free(config);
+}
+
+int
+tls_config_set_ca_mem(struct tls_config *config, const uint8_t *ca,
+    size_t len)
+{
+	return (0);
+}
+
+int
+tls_config_set_session_fd(struct tls_config *config, int session_fd)
+{
+	return (0);
+}
+
+void
+tls_config_insecure_noverifyname(struct tls_config *config)
+{
+}
+
+const char *
+tls_config_error(struct tls_config *config)
+{
+	return ("no error");
+}
+
+const char *
+tls_default_ca_cert_file(void)
+{
+	return ("/etc/ssl/cert.pem");
+}
+
+uint8_t *
+tls_load_file(const char *file, size_t *len, char *password)
+{
+	*len = 1;
+	return (calloc(1, 1));
+}
+
+void
+tls_unload_file(uint8_t *buf, size_t len)
+{
+	free(buf);
+}
+
+struct tls *
+tls_client(void)
+{
+	return (calloc(1, sizeof(struct tls)));
+}
+
+int
+tls_configure(struct tls *ctx, struct tls_config *config)
+{
+	return (0);
+}
+
+int
+tls_connect_socket(struct tls *ctx, int s, const char *servername)
+{
+	ctx->t_fd = s;
+	return (0);
+}
+
+int
+tls_handshake(struct tls *ctx)
+{
+	num_handshake++;
+	return (0);
+}
+
+ssize_t
+tls_read(struct tls *ctx, void *buf, size_t buflen)
+{
+	ssize_t		 n;
+
+	if ((n = read(ctx->t_fd, buf, buflen)) == -1 && errno == EAGAIN)
+		return (TLS_WANT_POLLIN);
+	return (n);
+}
+
+ssize_t
+tls_write(struct tls *ctx, const void *buf, size_t buflen)
+{
+	ssize_t		 n;
+
+	num_write++;
+	if ((n = write(ctx->t_fd, buf, buflen)) == -1 && errno == EAGAIN)
+		return (TLS_WANT_POLLOUT);
+	return (n);
+}
+
+int
+tls_close(struct tls *ctx)
+{
+	return (0);
+}
+
+void
+tls_free(struct tls *ctx)
+{
+	free(ctx);
+}
+
+const char *
+tls_error(struct tls *ctx)
+{
+	return (strerror(errno));
+}
+
+int
+tls_conn_session_resumed(struct tls *ctx)
+{
+	return (0);
+}
+
+void
+responder(int fd)
+{
+	int		 s;
+
+	signal(SIGCHLD, SIG_IGN);
+	for (;;) {
+		if ((s = accept(fd, NULL, NULL)) == -1)
+			err(1, "accept");
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			close(fd);
+			answer(s);
+			_exit(0);
+		}
+		close(s);
+	}
+}
+
+/* answer all length prefixed queries of a connection in order */
+void
+answer(int s)
+{
+	static const uint8_t	 rr[] = {
+		0xc0, 0x0c,		/* name is the question */
+		0x00, 0x01, 0x00, 0x01,	/* A, IN */
+		0x00, 0x00, 0x00, 0x3c,	/* ttl 60 */
+		0x00, 0x04, 192, 0, 2, 1
+	};
+	static uint8_t		 rbuf[65536], wbuf[65536];
+	size_t			 rlen = 0, wlen, off, len, qoff;
+	ssize_t			 n;
+	uint8_t			*pkt;
+
+	for (;;) {
+		if ((n = read(s, rbuf + rlen, sizeof(rbuf) - rlen)) == -1)
+			err(1, "read");
+		if (n == 0)
+			return;
+		rlen += n;
+
+		off = wlen = 0;
+		while (rlen - off >= 2) {
+			len = (rbuf[off] << 8) | rbuf[off + 1];
+			if (rlen - off < 2 + len)
+				break;
+			if (wlen + 2 + len + sizeof(rr) > sizeof(wbuf)) {
+				if (write(s, wbuf, wlen) != (ssize_t)wlen)
+					err(1, "write");
+				wlen = 0;
+			}
+			pkt = wbuf + wlen + 2;
+			memcpy(pkt, rbuf + off + 2, len);
+			off += 2 + len;
+			if (len < 12)
+				continue;
+
+			/* skip the question name, its type and class */
+			for (qoff = 12; qoff < len && pkt[qoff] != 0;
+			    qoff += pkt[qoff] + 1)
+				;
+			qoff += 5;
+
+			pkt[2] = 0x81;		/* QR, RD */
+			pkt[3] = 0x80;		/* RA, NOERROR */
+			pkt[6] = 0;
+			pkt[7] = 1;		/* one answer */
+			memset(&pkt[8], 0, 4);	/* no other sections */
+			memcpy(&pkt[qoff], rr, sizeof(rr));
+			pkt[-2] = (qoff + sizeof(rr)) >> 8;
+			pkt[-1] = (qoff + sizeof(rr)) & 0xff;
+			wlen += 2 + qoff + sizeof(rr);
+		}
+		memmove(rbuf, rbuf + off, rlen - off);
+		rlen -= off;
+
+		if (wlen > 0 && write(s, wbuf, wlen) != (ssize_t)wlen)
+			err(1, "write");
+	}
+}
+
+void
+done_cb(void *arg, int error, struct ub_result *result)
+{
+	if (error != 0 || result->rcode != 0 || !result->havedata)
+		num_failed++;
+	if (++num_done == num_queries)
+		event_loopexit(NULL);
+}
+
+int
+round_run(struct pfresolved *env, int round)
+{
+	struct timespec		 start, end;
+	char			 name[HOST_NAME_MAX + 1];
+	double			 msec;
+	int			 i, error;
+
+	num_done = num_failed = 0;
+	num_connect = num_handshake = num_write = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_queries; i++) {
+		snprintf(name, sizeof(name), "host%d.regress.", i);
+		if ((error = stub_resolve(env, name, 1, NULL, done_cb)) != 0)
+			errx(1, "stub_resolve %s: %d", name, error);
+	}
+	event_dispatch();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	msec = (end.tv_sec - start.tv_sec) * 1000.0 +
+	    (end.tv_nsec - start.tv_nsec) / 1000000.0;
+	printf("round %d: %d queries, %d failed, %.0f ms, %lu connects, "
+	    "%lu handshakes, %lu writes, %.1f queries per write\n", round,
+	    num_queries, num_failed, msec, num_connect, num_handshake,
+	    num_write, num_write ? (double)num_queries / num_write : 0.0);
+
+	if (num_failed > 0)
+		errx(1, "%d queries failed", num_failed);
+
+	return (num_connect);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pfresolved	 env;
+	struct sockaddr_in	 sin;
+	socklen_t		 sinlen = sizeof(sin);
+	const char		*resolvers[1], *errstr;
+	char			 resolver[32];
+	pid_t			 pid;
+	int			 fd, round, connects = 0;
+
+	num_queries = ROUND_DEFAULT;
+	if (argc > 1) {
+		num_queries = strtonum(argv[1], 1, 30000, &errstr);
+		if (errstr != NULL)
+			errx(1, "number of queries is %s: %s", errstr, argv[1]);
+	}
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "bind");
+	if (getsockname(fd, (struct sockaddr *)&sin, &sinlen) == -1)
+		err(1, "getsockname");
+	if (listen(fd, 8) == -1)
+		err(1, "listen");
+
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		responder(fd);
+		_exit(0);
+	}
+	close(fd);
+
+	log_init(1, LOG_DAEMON);
+	log_setverbose(0);
+	event_init();
+
+	snprintf(resolver, sizeof(resolver), "127.0.0.1@%d",
+	    ntohs(sin.sin_port));
+	resolvers[0] = resolver;
+	memset(&env, 0, sizeof(env));
+	env.sc_resolvers = resolvers;
+	env.sc_num_resolvers = 1;
+	env.sc_use_dot = 1;
+	if ((env.sc_ps.ps_pw = getpwuid(getuid())) == NULL)
+		err(1, "getpwuid");
+	stub_init(&env);
+	stub_start(&env);
+
+	/* connections are opened once and reused by all later rounds */
+	for (round = 1; round <= ROUNDS; round++) {
+		if ((connects += round_run(&env, round)) > POOL_SIZE)
+			errx(1, "round %d opened %d connections", round,
+			    connects);
+	}
+
+	stub_shutdown(&env);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	return (0);
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Send a burst of queries through the stub engine to a responder on the
+ * loopback interface and count the system calls the engine needs for it.
+ * The heap allocations of the stub engine are counted as well, after the
+ * first round it must not allocate anymore.
+ * The responder is a child process that answers every query with a single
+ * A record.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <event.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pfresolved.h"
+
+#define BURST_DEFAULT	1000
+#define SOCKBUF_SIZE	(4 * 1024 * 1024)
+
+int	 __real_sendmmsg(int, struct mmsghdr *, unsigned int, int);
+int	 __real_recvmmsg(int, struct mmsghdr *, unsigned int, int,
+	    struct timespec *);
+int	 __wrap_sendmmsg(int, struct mmsghdr *, unsigned int, int);
+int	 __wrap_recvmmsg(int, struct mmsghdr *, unsigned int, int,
+	    struct timespec *);
+void	*__real_malloc(size_t);
+void	*__real_calloc(size_t, size_t);
+void	*__real_realloc(void *, size_t);
+void	*__wrap_malloc(size_t);
+void	*__wrap_calloc(size_t, size_t);
+void	*__wrap_realloc(void *, size_t);
+void	 responder(int);
+void	 done_cb(void *, int, struct ub_result *);
+unsigned long	 burst(struct pfresolved *, int);
+
+static unsigned long	 num_sendmmsg, num_recvmmsg, num_alloc;
+static int		 num_done, num_failed, num_queries;
+
+/* the stub engine needs this for pfresolvectl show resolvers only */
+int
+proc_compose_imsg(struct privsep *ps, enum privsep_procid id, int n,
+    uint16_t type, uint32_t peerid, int fd, void *data, uint16_t datalen)
+{
+	return (0);
+}
+
+int
+__wrap_sendmmsg(int s, struct mmsghdr *msgs, unsigned int n, int flags)
+{
+	num_sendmmsg++;
+	return (__real_sendmmsg(s, msgs, n, flags));
+}
+
+int
+__wrap_recvmmsg(int s, struct mmsghdr *msgs, unsigned int n, int flags,
+    struct timespec *timeout)
+{
+	num_recvmmsg++;
+	return (__real_recvmmsg(s, msgs, n, flags, timeout));
+}
+
+void *
+__wrap_malloc(size_t size)
+{
+	num_alloc++;
+	return (__real_malloc(size));
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+	num_alloc++;
+	return (__real_calloc(nmemb, size));
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	num_alloc++;
+	return (__real_realloc(ptr, size));
+}
+
+void
+responder(int fd)
+{
+	static const uint8_t	 rr[] = {
+		0xc0, 0x0c,		/* name is the question */
+		0x00, 0x01, 0x00, 0x01,	/* A, IN */
+		0x00, 0x00, 0x00, 0x3c,	/* ttl 60 */
+		0x00, 0x04, 192, 0, 2, 1
+	};
+	struct sockaddr_storage	 ss;
+	socklen_t		 sslen;
+	uint8_t			 pkt[512];
+	ssize_t			 n;
+	size_t			 off;
+
+	for (;;) {
+		sslen = sizeof(ss);
+		if ((n = recvfrom(fd, pkt, sizeof(pkt), 0,
+		    (struct sockaddr *)&ss, &sslen)) == -1)
+			err(1, "recvfrom");
+		if (n < 12)
+			continue;
+
+		/* skip the question name, its type and class */
+		for (off = 12; off < (size_t)n && pkt[off] != 0;
+		    off += pkt[off] + 1)
+			;
+		off += 5;
+		if (off + sizeof(rr) > sizeof(pkt))
+			continue;
+
+		pkt[2] = 0x81;		/* QR, RD */
+		pkt[3] = 0x80;		/* RA, NOERROR */
+		pkt[6] = 0;
+		pkt[7] = 1;		/* one answer */
+		memset(&pkt[8], 0, 4);	/* no authority and additional */
+		memcpy(&pkt[off], rr, sizeof(rr));
+
+		if (sendto(fd, pkt, off + sizeof(rr), 0,
+		    (struct sockaddr *)&ss, sslen) == -1)
+			err(1, "sendto");
+	}
+}
+
+void
+done_cb(void *arg, int err, struct ub_result *result)
+{
+	if (err != 0 || result->rcode != 0 || !result->havedata)
+		num_failed++;
+	if (++num_done == num_queries)
+		event_loopexit(NULL);
+}
+
+unsigned long
+burst(struct pfresolved *env, int round)
+{
+	struct timespec		 start, end;
+	char			 name[HOST_NAME_MAX + 1];
+	double			 msec;
+	int			 i, error;
+
+	num_done = num_failed = 0;
+	num_sendmmsg = num_recvmmsg = num_alloc = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_queries; i++) {
+		snprintf(name, sizeof(name), "host%d.regress.", i);
+		if ((error = stub_resolve(env, name, 1, NULL, done_cb)) != 0)
+			errx(1, "stub_resolve %s: %d", name, error);
+	}
+	event_dispatch();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	msec = (end.tv_sec - start.tv_sec) * 1000.0 +
+	    (end.tv_nsec - start.tv_nsec) / 1000000.0;
+	printf("round %d: %d queries, %d failed, %.0f ms, %lu sendmmsg, "
+	    "%lu recvmmsg, %.1f queries per sendmmsg, %lu allocations\n",
+	    round, num_queries, num_failed, msec, num_sendmmsg, num_recvmmsg,
+	    num_sendmmsg ? (double)num_queries / num_sendmmsg : 0.0,
+	    num_alloc);
+
+	if (num_failed > 0)
+		errx(1, "%d queries failed", num_failed);
+
+	return (num_alloc);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pfresolved	 env;
+	struct sockaddr_in	 sin;
+	socklen_t		 sinlen = sizeof(sin);
+	const char		*resolvers[1], *errstr;
+	char			 resolver[32];
+	pid_t			 pid;
+	int			 fd, bufsize = SOCKBUF_SIZE;
+
+	num_queries = BURST_DEFAULT;
+	if (argc > 1) {
+		num_queries = strtonum(argv[1], 1, 1000000, &errstr);
+		if (errstr != NULL)
+			errx(1, "number of queries is %s: %s", errstr, argv[1]);
+	}
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(1, "socket");
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize,
+	    sizeof(bufsize)) == -1)
+		err(1, "setsockopt");
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "bind");
+	if (getsockname(fd, (struct sockaddr *)&sin, &sinlen) == -1)
+		err(1, "getsockname");
+
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		responder(fd);
+		_exit(0);
+	}
+	close(fd);
+
+	log_init(1, LOG_DAEMON);
+	log_setverbose(0);
+	event_init();
+
+	snprintf(resolver, sizeof(resolver), "127.0.0.1@%d",
+	    ntohs(sin.sin_port));
+	resolvers[0] = resolver;
+	memset(&env, 0, sizeof(env));
+	env.sc_resolvers = resolvers;
+	env.sc_num_resolvers = 1;
+	stub_init(&env);
+	stub_start(&env);
+
+	/* the first round fills the free list of queries */
+	burst(&env, 1);
+	if (burst(&env, 2) > 0)
+		errx(1, "queries were allocated after the first round");
+
+	stub_shutdown(&env);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	return (0);
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pfresolved.h"
+
+/*
+ * Every process keeps its own counters in sc_stats. On request each process
+ * sends its metrics as struct ctl_stats, pfresolvectl formats them.
+ */
+
+void
+stats_histogram_add(struct stats_histogram *sh, uint64_t usec)
+{
+	int		 msb, i;
+
+	sh->sh_count++;
+	sh->sh_sum += usec;
+
+	if (usec < STATS_SUB_BUCKETS) {
+		sh->sh_buckets[usec]++;
+		return;
+	}
+
+	/* the highest bit selects the power of two, the next bits the sub */
+	for (msb = 63; (usec >> msb) == 0; msb--)
+		;
+	i = (msb - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS +
+	    ((usec >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+	if (i >= STATS_BUCKETS)
+		i = STATS_BUCKETS - 1;
+	sh->sh_buckets[i]++;
+}
+
+/*
+ * Microseconds since a timestamp of the monotonic clock. The clock is the
+ * same in all processes, so timestamps can be sent along with messages.
+ */
+uint64_t
+stats_elapsed(const struct timespec *start)
+{
+	struct timespec		 now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespeccmp(&now, start, <))
+		return (0);
+	timespecsub(&now, start, &now);
+
+	return ((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+void
+stats_send(struct pfresolved *env, enum privsep_procid id, uint32_t peerid,
+    enum stats_type type, const char *name, const char *label,
+    const char *help, uint64_t value)
+{
+	struct ctl_stats	 cs;
+
+	bzero(&cs, sizeof(cs));
+	strlcpy(cs.cs_name, name, sizeof(cs.cs_name));
+	if (label != NULL)
+		strlcpy(cs.cs_label, label, sizeof(cs.cs_label));
+	strlcpy(cs.cs_help, help, sizeof(cs.cs_help));
+	cs.cs_type = type;
+	cs.cs_value = value;
+
+	proc_compose_imsg(&env->sc_ps, id, -1, IMSG_CTL_SHOW_STATS, peerid, -1,
+	    &cs, sizeof(cs));
+}
+
+void
+stats_send_histogram(struct pfresolved *env, enum privsep_procid id,
+    uint32_t peerid, const char *name, const char *label, const char *help,
+    struct stats_histogram *sh)
+{
+	struct ctl_stats	 cs;
+
+	bzero(&cs, sizeof(cs));
+	strlcpy(cs.cs_name, name, sizeof(cs.cs_name));
+	if (label != NULL)
+		strlcpy(cs.cs_label, label, sizeof(cs.cs_label));
+	strlcpy(cs.cs_help, help, sizeof(cs.cs_help));
+	cs.cs_type = STATS_HISTOGRAM;
+	cs.cs_histogram = *sh;
+
+	proc_compose_imsg(&env->sc_ps, id, -1, IMSG_CTL_SHOW_STATS, peerid, -1,
+	    &cs, sizeof(cs));
+}
+
+/*
+ * Metrics that every process has: its memory use and the number of messages
+ * waiting to be sent between the parent and the forwarder.
+ */
+void
+stats_send_process(struct pfresolved *env, enum privsep_procid id,
+    uint32_t peerid)
+{
+	struct rusage		 ru;
+	struct imsgev		*iev;
+	char			 label[STATS_LABEL_SIZE];
+	enum privsep_procid	 queue_id;
+
+	queue_id = privsep_process == PROC_PARENT ? PROC_FORWARDER :
+	    PROC_PARENT;
+
+	snprintf(label, sizeof(label), "process=\"%s\"",
+	    privsep_process == PROC_PARENT ? "parent" : "forwarder");
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		stats_send(env, id, peerid, STATS_GAUGE,
+		    "memory_max_rss_bytes", label, "Maximum resident set size",
+		    (uint64_t)ru.ru_maxrss * 1024);
+
+	iev = proc_iev(&env->sc_ps, queue_id, 0);
+	stats_send(env, id, peerid, STATS_GAUGE, "imsg_queued", label,
+	    "Messages waiting to be sent", iev->ibuf.w.queued);
+}
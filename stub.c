@@ -0,0 +1,2111 @@
+/*
+ * Copyright (c) 2025 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <event.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "pfresolved.h"
+
+/*
+ * A minimal stub resolver that forwards A and AAAA queries to the configured
+ * resolvers. It is used instead of libunbound in forwarding mode without
+ * DNSSEC, where the iterator and validator of libunbound and its worker thread
+ * are not needed.
+ *
+ * Queries are collected in a send queue and written with sendmmsg(2) once the
+ * current event loop iteration is done. Answers are read with recvmmsg(2).
+ * Every query uses a random ID on a random socket out of a small pool, each
+ * socket is bound to a random source port by the kernel. Truncated answers are
+ * retried over TCP.
+ *
+ * With DNS-over-TLS every resolver gets a small pool of persistent TLS
+ * connections instead. Queries are pipelined on these connections and the
+ * answers are matched by their ID in any order. TLS sessions are resumed when
+ * a connection has to be established again. Failing connections are retried
+ * with an exponential backoff.
+ *
+ * The smoothed round trip time and the failures of every resolver are tracked.
+ * Queries go to the fastest resolvers, slower ones are only used on retry.
+ * A resolver that fails repeatedly is taken out of the rotation for an
+ * increasing time, after that a single query probes whether it has recovered.
+ *
+ * Optionally, a query that is not answered within the 95th percentile of the
+ * latency of its resolver is hedged: it is sent to a second resolver and the
+ * first answer wins. The number of hedged queries is limited by a budget.
+ */
+
+#define STUB_SOCKETS		8
+#define STUB_BATCH		64
+#define STUB_UDP_BUFSIZE	4096
+#define STUB_EDNS_BUFSIZE	1232
+#define STUB_QUERY_SIZE		512
+#define STUB_TIMEOUT_MSEC	1500
+#define STUB_TCP_TIMEOUT	5
+#define STUB_MAX_TRIES		4
+#define STUB_MAX_RR		4096
+#define STUB_MAX_CNAME		16
+#define STUB_DOT_CONNS		2
+#define STUB_DOT_PIPELINE	32
+#define STUB_DOT_BACKOFF_MAX	64
+#define STUB_RTT_BAND_MSEC	20
+#define STUB_EXPLORE		32
+#define STUB_FAIL_THRESHOLD	5
+#define STUB_DOWN_MIN		5
+#define STUB_DOWN_MAX		300
+#define STUB_HIST_BUCKETS	17
+#define STUB_HIST_MAX		1024
+#define STUB_HEDGE_MIN_SAMPLES	20
+#define STUB_HEDGE_WINDOW	10000
+
+#define DNS_HEADER_SIZE		12
+#define DNS_MAX_MSGSIZE		65535
+#define DNS_FLAG_QR		0x8000
+#define DNS_FLAG_TC		0x0200
+#define DNS_FLAG_RD		0x0100
+#define DNS_RCODE_MASK		0x000f
+
+#define MINIMUM(a, b)		(((a) < (b)) ? (a) : (b))
+
+enum stub_conn_state {
+	STUB_CONN_CLOSED = 0,
+	STUB_CONN_CONNECT,
+	STUB_CONN_HANDSHAKE,
+	STUB_CONN_READY
+};
+
+struct stub_resolver;
+
+struct stub_conn {
+	struct stub_resolver	*dc_res;
+	enum stub_conn_state	 dc_state;
+	int			 dc_fd;
+	struct tls		*dc_tls;
+	struct event		 dc_ev;
+	short			 dc_want;
+	uint8_t			*dc_wbuf;
+	size_t			 dc_wlen;
+	size_t			 dc_wsize;
+	uint8_t			*dc_rbuf;
+	size_t			 dc_rlen;
+	int			 dc_inflight;
+	int			 dc_failures;
+	time_t			 dc_next_connect;
+	uint64_t		 dc_last_read;
+};
+
+struct stub_resolver {
+	struct sockaddr_storage	 sr_ss;
+	socklen_t		 sr_sslen;
+	char			 sr_name[INET6_ADDRSTRLEN + 8];
+	char			 sr_auth_name[HOST_NAME_MAX + 1];
+	struct tls_config	*sr_tls_config;
+	int			 sr_session_fd;
+	struct stub_conn	 sr_conns[STUB_DOT_CONNS];
+	enum resolver_state	 sr_state;
+	uint32_t		 sr_srtt;
+	int			 sr_consec_fail;
+	int			 sr_down_count;
+	time_t			 sr_down_until;
+	uint64_t		 sr_queries;
+	uint64_t		 sr_answers;
+	uint64_t		 sr_failures;
+	uint64_t		 sr_timeouts;
+	uint64_t		 sr_hedges;
+	uint32_t		 sr_hist[STUB_HIST_BUCKETS];
+	uint32_t		 sr_hist_total;
+};
+
+struct stub_socket {
+	int			 ss_fd;
+	int			 ss_af;
+	struct event		 ss_ev;
+};
+
+enum stub_tcp_state {
+	STUB_TCP_NONE = 0,
+	STUB_TCP_CONNECT,
+	STUB_TCP_WRITE,
+	STUB_TCP_READ
+};
+
+struct stub_query {
+	RB_ENTRY(stub_query)	 sq_node;
+	TAILQ_ENTRY(stub_query)	 sq_entry;
+	struct pfresolved	*sq_env;
+	int			 sq_intree;
+	struct stub_socket	*sq_sock;
+	struct stub_conn	*sq_conn;
+	uint16_t		 sq_id;
+	int			 sq_qtype;
+	char			 sq_name[HOST_NAME_MAX + 2];
+	uint8_t			 sq_pkt[STUB_QUERY_SIZE];
+	size_t			 sq_pktlen;
+	int			 sq_resolver;
+	int			 sq_probe;
+	uint64_t		 sq_sent;
+	int			 sq_tries;
+	int			 sq_queued;
+	int			 sq_waiting;
+	struct event		 sq_timer;
+	struct event		 sq_hedge_timer;
+	struct stub_query	*sq_hedge;
+	struct stub_query	*sq_primary;
+	enum stub_tcp_state	 sq_tcp_state;
+	int			 sq_tcp_fd;
+	struct event		 sq_tcp_ev;
+	uint8_t			*sq_tcp_buf;
+	size_t			 sq_tcp_len;
+	size_t			 sq_tcp_off;
+	void			*sq_arg;
+	void			(*sq_cb)(void *, int, struct ub_result *);
+};
+RB_HEAD(stub_queries, stub_query);
+TAILQ_HEAD(stub_queue, stub_query);
+
+static struct stub_resolver	*stub_resolvers;
+static int			 stub_num_resolvers;
+static int			 stub_use_dot;
+static int			 stub_hedge_budget;
+static uint64_t			 stub_hedge_queries;
+static uint64_t			 stub_hedge_sent;
+static struct stub_socket	 stub_sockets[2][STUB_SOCKETS];
+static struct sockaddr_storage	 stub_outbound;
+static socklen_t		 stub_outboundlen;
+static struct stub_queries	 stub_queries = RB_INITIALIZER(&stub_queries);
+static struct stub_queue	 stub_sendq = TAILQ_HEAD_INITIALIZER(stub_sendq);
+static struct stub_queue	 stub_freeq = TAILQ_HEAD_INITIALIZER(stub_freeq);
+static struct stub_queue	 stub_waitq = TAILQ_HEAD_INITIALIZER(stub_waitq);
+static struct event		 stub_flush_ev;
+static struct event		 stub_wait_ev;
+
+static uint8_t			 stub_rbuf[STUB_BATCH][STUB_UDP_BUFSIZE];
+static struct sockaddr_storage	 stub_rfrom[STUB_BATCH];
+
+static struct ub_result		 stub_result;
+static char			*stub_data[STUB_MAX_RR + 1];
+static int			 stub_len[STUB_MAX_RR];
+static char			 stub_canonname[HOST_NAME_MAX + 2];
+
+int	 stub_parse_resolver(const char *, struct stub_resolver *);
+void	 stub_tls_init(struct pfresolved *, struct stub_resolver *,
+	    uint8_t *, size_t);
+void	 stub_open_sockets(struct pfresolved *, int);
+struct stub_socket *
+	 stub_socket_by_af(int);
+struct stub_query *
+	 stub_query_get(void);
+void	 stub_query_put(struct stub_query *);
+int	 stub_encode_query(struct stub_query *);
+void	 stub_query_send(struct stub_query *);
+void	 stub_query_unlink(struct stub_query *);
+void	 stub_query_wait(struct stub_query *);
+void	 stub_query_unprobe(struct stub_query *);
+void	 stub_wait_cb(int, short, void *);
+void	 stub_query_retry(struct stub_query *, int);
+void	 stub_query_fail(struct stub_query *, int);
+void	 stub_query_cancel(struct stub_query *);
+void	 stub_hedge_cb(int, short, void *);
+void	 stub_hedge_done(void *, int, struct ub_result *);
+void	 stub_query_done(struct stub_query *, int, struct ub_result *);
+void	 stub_query_answer(struct stub_query *, uint8_t *, size_t, int);
+int	 stub_question_cmp(struct stub_query *, const uint8_t *, size_t);
+void	 stub_flush_cb(int, short, void *);
+void	 stub_recv_cb(int, short, void *);
+void	 stub_timeout_cb(int, short, void *);
+void	 stub_tcp_start(struct stub_query *);
+void	 stub_tcp_close(struct stub_query *);
+void	 stub_tcp_cb(int, short, void *);
+void	 stub_dot_send(struct stub_query *);
+struct stub_conn *
+	 stub_dot_conn_get(struct stub_resolver *);
+int	 stub_dot_connect(struct stub_conn *);
+void	 stub_dot_close(struct stub_conn *, int);
+void	 stub_dot_cb(int, short, void *);
+int	 stub_dot_io(struct stub_conn *);
+void	 stub_dot_update(struct stub_conn *);
+time_t	 stub_now(void);
+uint64_t stub_msec(void);
+void	 stub_resolver_select(struct stub_query *, int);
+void	 stub_resolver_success(struct stub_query *);
+void	 stub_resolver_failure(struct stub_query *, int);
+void	 stub_resolver_down(struct stub_resolver *);
+void	 stub_resolver_rtt(struct stub_resolver *, uint64_t);
+uint32_t stub_resolver_p95(struct stub_resolver *);
+int	 stub_resolver_match(struct sockaddr_storage *,
+	    struct stub_resolver *);
+int	 stub_read_name(const uint8_t *, size_t, size_t, char *, size_t);
+int	 stub_read_rr(const uint8_t *, size_t, size_t *, char *, size_t,
+	    uint16_t *, uint32_t *, size_t *, uint16_t *);
+void	 stub_normalize_name(const char *, char *);
+int	 stub_follow_cname(const uint8_t *, size_t, size_t, int, char *,
+	    size_t, uint32_t *);
+int	 stub_query_cmp(struct stub_query *, struct stub_query *);
+
+RB_PROTOTYPE(stub_queries, stub_query, sq_node, stub_query_cmp);
+
+/*
+ * Called before chroot(2) and before privileges are dropped: parse the
+ * resolvers and load everything that is needed for DNS-over-TLS.
+ */
+void
+stub_init(struct pfresolved *env)
+{
+	struct sockaddr_in	*sin;
+	struct sockaddr_in6	*sin6;
+	const char		*ca_file;
+	uint8_t			*ca = NULL;
+	size_t			 ca_len = 0;
+	int			 i;
+
+	if (env->sc_num_resolvers == 0)
+		fatalx("%s: the stub engine requires at least one resolver",
+		    __func__);
+
+	if ((stub_resolvers = calloc(env->sc_num_resolvers,
+	    sizeof(*stub_resolvers))) == NULL)
+		fatal("%s: calloc", __func__);
+
+	stub_use_dot = env->sc_use_dot;
+	stub_hedge_budget = env->sc_hedge_budget;
+	if (stub_use_dot) {
+		ca_file = env->sc_cert_bundle ? env->sc_cert_bundle :
+		    tls_default_ca_cert_file();
+		if ((ca = tls_load_file(ca_file, &ca_len, NULL)) == NULL)
+			fatal("%s: failed to load %s", __func__, ca_file);
+	}
+
+	for (i = 0; i < env->sc_num_resolvers; i++) {
+		if (stub_parse_resolver(env->sc_resolvers[i],
+		    &stub_resolvers[i]) == -1)
+			fatalx("%s: invalid resolver: %s", __func__,
+			    env->sc_resolvers[i]);
+		if (stub_use_dot)
+			stub_tls_init(env, &stub_resolvers[i], ca, ca_len);
+	}
+	stub_num_resolvers = env->sc_num_resolvers;
+
+	if (ca != NULL)
+		tls_unload_file(ca, ca_len);
+
+	if (env->sc_outbound_ip) {
+		sin = (struct sockaddr_in *)&stub_outbound;
+		sin6 = (struct sockaddr_in6 *)&stub_outbound;
+		if (inet_pton(AF_INET, env->sc_outbound_ip,
+		    &sin->sin_addr) == 1) {
+			sin->sin_family = AF_INET;
+			stub_outboundlen = sizeof(*sin);
+		} else if (inet_pton(AF_INET6, env->sc_outbound_ip,
+		    &sin6->sin6_addr) == 1) {
+			sin6->sin6_family = AF_INET6;
+			stub_outboundlen = sizeof(*sin6);
+		} else
+			fatalx("%s: invalid outbound ip: %s", __func__,
+			    env->sc_outbound_ip);
+	}
+}
+
+/*
+ * Called when the event loop of the forwarder process is set up.
+ */
+void
+stub_start(struct pfresolved *env)
+{
+	struct stub_resolver	*res;
+	int			 i, has_v4 = 0, has_v6 = 0;
+
+	for (i = 0; i < stub_num_resolvers; i++) {
+		res = &stub_resolvers[i];
+		if (res->sr_ss.ss_family == AF_INET)
+			has_v4 = 1;
+		else
+			has_v6 = 1;
+
+		/* libtls checks the owner of the file against our uid */
+		if (res->sr_tls_config != NULL &&
+		    tls_config_set_session_fd(res->sr_tls_config,
+		    res->sr_session_fd) == -1)
+			log_warn("%s: no session resumption for %s: %s",
+			    __func__, res->sr_name,
+			    tls_config_error(res->sr_tls_config));
+	}
+
+	if (stub_use_dot) {
+		evtimer_set(&stub_wait_ev, stub_wait_cb, env);
+		return;
+	}
+
+	if (has_v4)
+		stub_open_sockets(env, AF_INET);
+	if (has_v6)
+		stub_open_sockets(env, AF_INET6);
+
+	evtimer_set(&stub_flush_ev, stub_flush_cb, env);
+}
+
+void
+stub_shutdown(struct pfresolved *env)
+{
+	struct stub_query	*q, *tmp;
+	struct stub_resolver	*res;
+	int			 i, j;
+
+	RB_FOREACH_SAFE(q, stub_queries, &stub_queries, tmp) {
+		RB_REMOVE(stub_queries, &stub_queries, q);
+		stub_tcp_close(q);
+		evtimer_del(&q->sq_timer);
+		free(q);
+	}
+	while ((q = TAILQ_FIRST(&stub_waitq)) != NULL) {
+		TAILQ_REMOVE(&stub_waitq, q, sq_entry);
+		evtimer_del(&q->sq_timer);
+		free(q);
+	}
+	while ((q = TAILQ_FIRST(&stub_freeq)) != NULL) {
+		TAILQ_REMOVE(&stub_freeq, q, sq_entry);
+		free(q);
+	}
+
+	for (i = 0; i < stub_num_resolvers; i++) {
+		res = &stub_resolvers[i];
+		if (res->sr_tls_config == NULL)
+			continue;
+		for (j = 0; j < STUB_DOT_CONNS; j++) {
+			stub_dot_close(&res->sr_conns[j], 0);
+			free(res->sr_conns[j].dc_wbuf);
+			free(res->sr_conns[j].dc_rbuf);
+		}
+		tls_config_free(res->sr_tls_config);
+		close(res->sr_session_fd);
+	}
+
+	if (stub_use_dot)
+		evtimer_del(&stub_wait_ev);
+	else
+		evtimer_del(&stub_flush_ev);
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < STUB_SOCKETS; j++) {
+			if (stub_sockets[i][j].ss_af == 0)
+				continue;
+			event_del(&stub_sockets[i][j].ss_ev);
+			close(stub_sockets[i][j].ss_fd);
+		}
+	}
+
+	free(stub_resolvers);
+}
+
+int
+stub_parse_resolver(const char *str, struct stub_resolver *res)
+{
+	struct sockaddr_in	*sin = (struct sockaddr_in *)&res->sr_ss;
+	struct sockaddr_in6	*sin6 = (struct sockaddr_in6 *)&res->sr_ss;
+	char			 buf[INET6_ADDRSTRLEN + HOST_NAME_MAX + 8];
+	char			*p;
+	const char		*errstr;
+	int			 port = stub_use_dot ? 853 : 53;
+
+	if (strlcpy(buf, str, sizeof(buf)) >= sizeof(buf))
+		return (-1);
+
+	/* the authentication name is only used for DNS-over-TLS */
+	if ((p = strchr(buf, '#')) != NULL) {
+		*p++ = '\0';
+		if (strlcpy(res->sr_auth_name, p, sizeof(res->sr_auth_name)) >=
+		    sizeof(res->sr_auth_name))
+			return (-1);
+	}
+
+	if ((p = strchr(buf, '@')) != NULL) {
+		*p++ = '\0';
+		port = strtonum(p, 1, 65535, &errstr);
+		if (errstr)
+			return (-1);
+	}
+
+	bzero(&res->sr_ss, sizeof(res->sr_ss));
+	if (inet_pton(AF_INET, buf, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		res->sr_sslen = sizeof(*sin);
+	} else if (inet_pton(AF_INET6, buf, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		res->sr_sslen = sizeof(*sin6);
+	} else
+		return (-1);
+
+	snprintf(res->sr_name, sizeof(res->sr_name), "%s@%d", buf, port);
+
+	return (0);
+}
+
+void
+stub_tls_init(struct pfresolved *env, struct stub_resolver *res, uint8_t *ca,
+    size_t ca_len)
+{
+	struct passwd		*pw = env->sc_ps.ps_pw;
+	char			 path[] = "/tmp/pfresolved-session.XXXXXXXXXX";
+	int			 i;
+
+	if ((res->sr_tls_config = tls_config_new()) == NULL)
+		fatal("%s: tls_config_new", __func__);
+	if (tls_config_set_ca_mem(res->sr_tls_config, ca, ca_len) == -1)
+		fatalx("%s: tls_config_set_ca_mem: %s", __func__,
+		    tls_config_error(res->sr_tls_config));
+
+	/* like libunbound, only verify the name if one was given */
+	if (res->sr_auth_name[0] == '\0')
+		tls_config_insecure_noverifyname(res->sr_tls_config);
+
+	/*
+	 * The session file is shared by all connections to this resolver.
+	 * Only the file descriptor is needed, it survives the chroot.
+	 */
+	if ((res->sr_session_fd = mkstemp(path)) == -1)
+		fatal("%s: mkstemp", __func__);
+	if (unlink(path) == -1)
+		fatal("%s: unlink %s", __func__, path);
+	if (fchown(res->sr_session_fd, pw->pw_uid, pw->pw_gid) == -1)
+		fatal("%s: fchown", __func__);
+
+	for (i = 0; i < STUB_DOT_CONNS; i++) {
+		res->sr_conns[i].dc_res = res;
+		res->sr_conns[i].dc_fd = -1;
+	}
+}
+
+void
+stub_open_sockets(struct pfresolved *env, int af)
+{
+	struct stub_socket	*s;
+	int			 i;
+
+	for (i = 0; i < STUB_SOCKETS; i++) {
+		s = &stub_sockets[af == AF_INET ? 0 : 1][i];
+
+		if ((s->ss_fd = socket(af, SOCK_DGRAM | SOCK_NONBLOCK,
+		    0)) == -1)
+			fatal("%s: socket", __func__);
+
+		if (stub_outbound.ss_family == af &&
+		    bind(s->ss_fd, (struct sockaddr *)&stub_outbound,
+		    stub_outboundlen) == -1)
+			fatal("%s: bind", __func__);
+
+		s->ss_af = af;
+		event_set(&s->ss_ev, s->ss_fd, EV_READ | EV_PERSIST,
+		    stub_recv_cb, s);
+		event_add(&s->ss_ev, NULL);
+	}
+}
+
+struct stub_socket *
+stub_socket_by_af(int af)
+{
+	return (&stub_sockets[af == AF_INET ? 0 : 1]
+	    [arc4random_uniform(STUB_SOCKETS)]);
+}
+
+int
+stub_resolve(struct pfresolved *env, const char *name, int qtype, void *arg,
+    void (*cb)(void *, int, struct ub_result *))
+{
+	struct stub_query	*q;
+	size_t			 len;
+
+	if ((q = stub_query_get()) == NULL)
+		return (UB_NOMEM);
+
+	len = strlcpy(q->sq_name, name, sizeof(q->sq_name) - 1);
+	if (len == 0 || len >= sizeof(q->sq_name) - 1) {
+		stub_query_put(q);
+		return (UB_SYNTAX);
+	}
+	if (q->sq_name[len - 1] != '.')
+		q->sq_name[len] = '.';
+
+	q->sq_env = env;
+	q->sq_qtype = qtype;
+	q->sq_arg = arg;
+	q->sq_cb = cb;
+	q->sq_tcp_fd = -1;
+
+	if (stub_encode_query(q) == -1) {
+		stub_query_put(q);
+		return (UB_SYNTAX);
+	}
+
+	evtimer_set(&q->sq_timer, stub_timeout_cb, q);
+	evtimer_set(&q->sq_hedge_timer, stub_hedge_cb, q);
+
+	/* the hedge budget only applies to a recent window of queries */
+	if (++stub_hedge_queries > STUB_HEDGE_WINDOW) {
+		stub_hedge_queries /= 2;
+		stub_hedge_sent /= 2;
+	}
+
+	stub_resolver_select(q, -1);
+	stub_query_send(q);
+
+	return (0);
+}
+
+/*
+ * Finished queries are kept on a free list, so memory is only allocated
+ * until the maximum number of concurrent queries has been reached.
+ */
+struct stub_query *
+stub_query_get(void)
+{
+	struct stub_query	*q;
+
+	if ((q = TAILQ_FIRST(&stub_freeq)) == NULL)
+		return (calloc(1, sizeof(*q)));
+
+	TAILQ_REMOVE(&stub_freeq, q, sq_entry);
+	memset(q, 0, sizeof(*q));
+	return (q);
+}
+
+void
+stub_query_put(struct stub_query *q)
+{
+	TAILQ_INSERT_HEAD(&stub_freeq, q, sq_entry);
+}
+
+int
+stub_encode_query(struct stub_query *q)
+{
+	uint8_t		*p = q->sq_pkt;
+	const char	*label, *dot;
+	size_t		 len;
+
+	/* header: id is set when sending, RD, one question, one additional */
+	bzero(p, DNS_HEADER_SIZE);
+	p[2] = DNS_FLAG_RD >> 8;
+	p[5] = 1;
+	p[11] = 1;
+	p += DNS_HEADER_SIZE;
+
+	for (label = q->sq_name; *label != '\0'; label = dot + 1) {
+		if ((dot = strchr(label, '.')) == NULL)
+			return (-1);
+		len = dot - label;
+		if (len == 0 || len > 63)
+			return (-1);
+		*p++ = len;
+		memcpy(p, label, len);
+		p += len;
+	}
+	*p++ = 0;
+
+	*p++ = q->sq_qtype >> 8;
+	*p++ = q->sq_qtype & 0xff;
+	*p++ = DNS_CLASS_IN >> 8;
+	*p++ = DNS_CLASS_IN & 0xff;
+
+	/* EDNS0 OPT record advertising our receive buffer size */
+	*p++ = 0;
+	*p++ = DNS_RR_TYPE_OPT >> 8;
+	*p++ = DNS_RR_TYPE_OPT & 0xff;
+	*p++ = STUB_EDNS_BUFSIZE >> 8;
+	*p++ = STUB_EDNS_BUFSIZE & 0xff;
+	memset(p, 0, 6);
+	p += 6;
+
+	q->sq_pktlen = p - q->sq_pkt;
+
+	return (0);
+}
+
+void
+stub_query_send(struct stub_query *q)
+{
+	struct stub_resolver	*res = &stub_resolvers[q->sq_resolver];
+	struct timeval		 tv = { 0, 0 };
+	uint32_t		 p95;
+
+	stub_query_unlink(q);
+
+	/* pick a new random socket or a connection for every attempt */
+	if (stub_use_dot) {
+		if ((q->sq_conn = stub_dot_conn_get(res)) == NULL) {
+			stub_query_wait(q);
+			return;
+		}
+		q->sq_conn->dc_inflight++;
+	} else
+		q->sq_sock = stub_socket_by_af(res->sr_ss.ss_family);
+
+	q->sq_tries++;
+	q->sq_sent = stub_msec();
+	res->sr_queries++;
+
+	do {
+		q->sq_id = arc4random_uniform(65536);
+	} while (RB_INSERT(stub_queries, &stub_queries, q) != NULL);
+	q->sq_intree = 1;
+
+	q->sq_pkt[0] = q->sq_id >> 8;
+	q->sq_pkt[1] = q->sq_id & 0xff;
+
+	log_debug("%s: query %s (%d) to %s, id %u, try %d", __func__,
+	    q->sq_name, q->sq_qtype, res->sr_name, q->sq_id, q->sq_tries);
+
+	if (stub_hedge_budget > 0 && q->sq_tries == 1 &&
+	    q->sq_primary == NULL && (p95 = stub_resolver_p95(res)) > 0 &&
+	    p95 < STUB_TIMEOUT_MSEC) {
+		tv.tv_sec = p95 / 1000;
+		tv.tv_usec = (p95 % 1000) * 1000;
+		evtimer_add(&q->sq_hedge_timer, &tv);
+		tv.tv_sec = tv.tv_usec = 0;
+	}
+
+	if (q->sq_conn != NULL) {
+		stub_dot_send(q);
+		return;
+	}
+
+	if (!q->sq_queued) {
+		TAILQ_INSERT_TAIL(&stub_sendq, q, sq_entry);
+		q->sq_queued = 1;
+	}
+	if (!evtimer_pending(&stub_flush_ev, NULL))
+		evtimer_add(&stub_flush_ev, &tv);
+
+	tv.tv_sec = STUB_TIMEOUT_MSEC / 1000;
+	tv.tv_usec = (STUB_TIMEOUT_MSEC % 1000) * 1000;
+	evtimer_add(&q->sq_timer, &tv);
+}
+
+/*
+ * Remove the query from the lookup tree, answers for the previous attempt do
+ * no longer match. A query waiting for a connection stops waiting.
+ */
+void
+stub_query_unlink(struct stub_query *q)
+{
+	if (q->sq_intree) {
+		RB_REMOVE(stub_queries, &stub_queries, q);
+		q->sq_intree = 0;
+	}
+	if (q->sq_waiting) {
+		TAILQ_REMOVE(&stub_waitq, q, sq_entry);
+		q->sq_waiting = 0;
+	}
+	if (q->sq_conn != NULL) {
+		q->sq_conn->dc_inflight--;
+		q->sq_conn = NULL;
+	}
+	q->sq_sock = NULL;
+}
+
+/*
+ * All connections to the resolver are closed and wait for their reconnect
+ * backoff. Nothing has been sent, so neither a try nor a failure of the
+ * resolver is counted. Another resolver is used if it has a connection,
+ * otherwise the query waits until a connection may be opened again.
+ */
+void
+stub_query_wait(struct stub_query *q)
+{
+	struct timeval		 tv = { STUB_TCP_TIMEOUT, 0 };
+	int			 first = q->sq_resolver;
+
+	log_debug("%s: no connection to %s for %s", __func__,
+	    stub_resolvers[first].sr_name, q->sq_name);
+
+	stub_query_unprobe(q);
+	stub_resolver_select(q, first);
+	if (q->sq_resolver != first &&
+	    stub_dot_conn_get(&stub_resolvers[q->sq_resolver]) != NULL) {
+		stub_query_send(q);
+		return;
+	}
+	stub_query_unprobe(q);
+
+	TAILQ_INSERT_TAIL(&stub_waitq, q, sq_entry);
+	q->sq_waiting = 1;
+
+	/* give up if no connection can be used for a while */
+	if (!evtimer_pending(&q->sq_timer, NULL))
+		evtimer_add(&q->sq_timer, &tv);
+	if (!evtimer_pending(&stub_wait_ev, NULL)) {
+		tv.tv_sec = 1;
+		evtimer_add(&stub_wait_ev, &tv);
+	}
+}
+
+/* a probe without an answer does not tell anything, probe again */
+void
+stub_query_unprobe(struct stub_query *q)
+{
+	if (q->sq_probe) {
+		stub_resolvers[q->sq_resolver].sr_state = RESOLVER_DOWN;
+		q->sq_probe = 0;
+	}
+}
+
+/*
+ * Try the waiting queries again once per second. Queries that still have
+ * no connection are queued again behind the ones that were waiting.
+ */
+void
+stub_wait_cb(int fd, short event, void *arg)
+{
+	struct stub_query	*q;
+	int			 n = 0;
+
+	TAILQ_FOREACH(q, &stub_waitq, sq_entry)
+		n++;
+
+	while (n-- > 0 && (q = TAILQ_FIRST(&stub_waitq)) != NULL) {
+		stub_query_unlink(q);
+		stub_resolver_select(q, -1);
+		stub_query_send(q);
+	}
+}
+
+void
+stub_query_retry(struct stub_query *q, int err)
+{
+	struct ub_result	*result = NULL;
+
+	stub_tcp_close(q);
+	stub_query_unprobe(q);
+
+	if (q->sq_tries >= STUB_MAX_TRIES) {
+		stub_query_done(q, err, result);
+		return;
+	}
+
+	/* only the first attempt of a query is hedged */
+	evtimer_del(&q->sq_hedge_timer);
+	stub_resolver_select(q, q->sq_resolver);
+	stub_query_send(q);
+}
+
+/*
+ * The current attempt failed because of the resolver, account for that
+ * before moving on.
+ */
+void
+stub_query_fail(struct stub_query *q, int err)
+{
+	stub_resolver_failure(q, 0);
+	stub_query_retry(q, err);
+}
+
+void
+stub_query_done(struct stub_query *q, int err, struct ub_result *result)
+{
+	stub_query_unlink(q);
+	if (q->sq_queued)
+		TAILQ_REMOVE(&stub_sendq, q, sq_entry);
+	evtimer_del(&q->sq_timer);
+	evtimer_del(&q->sq_hedge_timer);
+	if (q->sq_hedge != NULL) {
+		stub_query_cancel(q->sq_hedge);
+		q->sq_hedge = NULL;
+	}
+
+	/* the result may point into the TCP buffer */
+	q->sq_cb(q->sq_arg, err, result);
+
+	stub_tcp_close(q);
+	stub_query_put(q);
+}
+
+/*
+ * Drop a hedged query that is no longer needed.
+ */
+void
+stub_query_cancel(struct stub_query *q)
+{
+	stub_query_unlink(q);
+	if (q->sq_queued)
+		TAILQ_REMOVE(&stub_sendq, q, sq_entry);
+	evtimer_del(&q->sq_timer);
+	stub_tcp_close(q);
+	if (q->sq_probe)
+		stub_resolvers[q->sq_resolver].sr_state = RESOLVER_DOWN;
+	stub_query_put(q);
+}
+
+void
+stub_hedge_cb(int fd, short event, void *arg)
+{
+	struct stub_query	*q = arg, *h;
+
+	if (q->sq_hedge != NULL ||
+	    stub_hedge_sent * 100 >= stub_hedge_queries * stub_hedge_budget)
+		return;
+
+	if ((h = stub_query_get()) == NULL) {
+		log_error("%s: calloc", __func__);
+		return;
+	}
+	h->sq_env = q->sq_env;
+	h->sq_qtype = q->sq_qtype;
+	strlcpy(h->sq_name, q->sq_name, sizeof(h->sq_name));
+	memcpy(h->sq_pkt, q->sq_pkt, q->sq_pktlen);
+	h->sq_pktlen = q->sq_pktlen;
+	h->sq_tcp_fd = -1;
+	h->sq_primary = q;
+	h->sq_arg = h;
+	h->sq_cb = stub_hedge_done;
+	/* the hedged query gets a single attempt */
+	h->sq_tries = STUB_MAX_TRIES - 1;
+	evtimer_set(&h->sq_timer, stub_timeout_cb, h);
+	evtimer_set(&h->sq_hedge_timer, stub_hedge_cb, h);
+
+	stub_resolver_select(h, q->sq_resolver);
+	if (h->sq_resolver == q->sq_resolver) {
+		stub_query_put(h);
+		return;
+	}
+
+	log_debug("%s: hedging %s (%d) to %s", __func__, q->sq_name,
+	    q->sq_qtype, stub_resolvers[h->sq_resolver].sr_name);
+
+	q->sq_hedge = h;
+	stub_hedge_sent++;
+	stub_resolvers[h->sq_resolver].sr_hedges++;
+	stub_query_send(h);
+}
+
+/*
+ * The hedged query finished. A usable answer also finishes the original
+ * query, otherwise that one just carries on.
+ */
+void
+stub_hedge_done(void *arg, int err, struct ub_result *result)
+{
+	struct stub_query	*h = arg, *q = h->sq_primary;
+
+	q->sq_hedge = NULL;
+
+	if (err != 0 || result == NULL || (result->rcode != DNS_RCODE_NOERROR &&
+	    result->rcode != DNS_RCODE_NXDOMAIN))
+		return;
+
+	log_debug("%s: %s (%d) answered first by %s", __func__, q->sq_name,
+	    q->sq_qtype, stub_resolvers[h->sq_resolver].sr_name);
+
+	stub_query_done(q, 0, result);
+}
+
+void
+stub_flush_cb(int fd, short event, void *arg)
+{
+	struct mmsghdr		 msgs[STUB_BATCH];
+	struct iovec		 iovs[STUB_BATCH];
+	struct stub_query	*q, *tmp;
+	struct stub_socket	*s;
+	struct stub_resolver	*res;
+	int			 i, j, n, sent;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < STUB_SOCKETS; j++) {
+			s = &stub_sockets[i][j];
+			if (s->ss_af == 0)
+				continue;
+
+			do {
+				n = 0;
+				TAILQ_FOREACH_SAFE(q, &stub_sendq, sq_entry,
+				    tmp) {
+					if (q->sq_sock != s)
+						continue;
+
+					res = &stub_resolvers[q->sq_resolver];
+					iovs[n].iov_base = q->sq_pkt;
+					iovs[n].iov_len = q->sq_pktlen;
+					bzero(&msgs[n], sizeof(msgs[n]));
+					msgs[n].msg_hdr.msg_name = &res->sr_ss;
+					msgs[n].msg_hdr.msg_namelen =
+					    res->sr_sslen;
+					msgs[n].msg_hdr.msg_iov = &iovs[n];
+					msgs[n].msg_hdr.msg_iovlen = 1;
+
+					TAILQ_REMOVE(&stub_sendq, q, sq_entry);
+					q->sq_queued = 0;
+
+					if (++n == STUB_BATCH)
+						break;
+				}
+				if (n == 0)
+					break;
+
+				/*
+				 * Queries that could not be sent are retried
+				 * when their timeout expires.
+				 */
+				if ((sent = sendmmsg(s->ss_fd, msgs, n,
+				    0)) == -1)
+					log_error("%s: sendmmsg", __func__);
+				else if (sent < n)
+					log_info("%s: sent %d of %d queries",
+					    __func__, sent, n);
+			} while (n == STUB_BATCH);
+		}
+	}
+}
+
+void
+stub_recv_cb(int fd, short event, void *arg)
+{
+	struct stub_socket	*s = arg;
+	struct mmsghdr		 msgs[STUB_BATCH];
+	struct iovec		 iovs[STUB_BATCH];
+	struct stub_query	*q, key;
+	uint8_t			*pkt;
+	size_t			 len;
+	int			 i, n;
+
+	do {
+		for (i = 0; i < STUB_BATCH; i++) {
+			iovs[i].iov_base = stub_rbuf[i];
+			iovs[i].iov_len = sizeof(stub_rbuf[i]);
+			bzero(&msgs[i], sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &stub_rfrom[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(stub_rfrom[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		if ((n = recvmmsg(fd, msgs, STUB_BATCH, MSG_DONTWAIT,
+		    NULL)) == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				log_error("%s: recvmmsg", __func__);
+			return;
+		}
+
+		for (i = 0; i < n; i++) {
+			pkt = stub_rbuf[i];
+			len = msgs[i].msg_len;
+
+			if (len < DNS_HEADER_SIZE)
+				continue;
+
+			key.sq_sock = s;
+			key.sq_conn = NULL;
+			key.sq_id = (pkt[0] << 8) | pkt[1];
+			if ((q = RB_FIND(stub_queries, &stub_queries,
+			    &key)) == NULL) {
+				log_debug("%s: no query for id %u", __func__,
+				    key.sq_id);
+				continue;
+			}
+
+			/* only the resolver that was asked may answer */
+			if (!stub_resolver_match(&stub_rfrom[i],
+			    &stub_resolvers[q->sq_resolver])) {
+				log_debug("%s: answer for %s from wrong address",
+				    __func__, q->sq_name);
+				continue;
+			}
+
+			stub_query_answer(q, pkt, len,
+			    msgs[i].msg_hdr.msg_flags & MSG_TRUNC);
+		}
+	} while (n == STUB_BATCH);
+}
+
+int
+stub_resolver_match(struct sockaddr_storage *ss, struct stub_resolver *res)
+{
+	struct sockaddr_in	*sin, *rsin;
+	struct sockaddr_in6	*sin6, *rsin6;
+
+	if (res->sr_ss.ss_family != ss->ss_family)
+		return (0);
+
+	if (ss->ss_family == AF_INET) {
+		sin = (struct sockaddr_in *)ss;
+		rsin = (struct sockaddr_in *)&res->sr_ss;
+		return (sin->sin_port == rsin->sin_port &&
+		    sin->sin_addr.s_addr == rsin->sin_addr.s_addr);
+	}
+
+	sin6 = (struct sockaddr_in6 *)ss;
+	rsin6 = (struct sockaddr_in6 *)&res->sr_ss;
+	return (sin6->sin6_port == rsin6->sin6_port &&
+	    IN6_ARE_ADDR_EQUAL(&sin6->sin6_addr, &rsin6->sin6_addr));
+}
+
+void
+stub_query_answer(struct stub_query *q, uint8_t *pkt, size_t len,
+    int truncated)
+{
+	struct stub_resolver	*res = &stub_resolvers[q->sq_resolver];
+	uint16_t		 flags;
+	int			 rcode;
+
+	flags = (pkt[2] << 8) | pkt[3];
+	if (!(flags & DNS_FLAG_QR))
+		return;
+
+	/* the question section must match our query */
+	if (stub_question_cmp(q, pkt, len) != 0) {
+		log_debug("%s: question mismatch for %s from %s", __func__,
+		    q->sq_name, res->sr_name);
+		return;
+	}
+
+	if ((flags & DNS_FLAG_TC) || truncated) {
+		/* there is nothing to fall back to over TLS */
+		if (q->sq_conn == NULL && q->sq_tcp_state == STUB_TCP_NONE) {
+			log_debug("%s: truncated answer for %s from %s, "
+			    "retrying over tcp", __func__, q->sq_name,
+			    res->sr_name);
+			stub_tcp_start(q);
+			return;
+		}
+	}
+
+	rcode = flags & DNS_RCODE_MASK;
+	if (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN) {
+		log_debug("%s: rcode %d for %s from %s", __func__, rcode,
+		    q->sq_name, res->sr_name);
+		if (q->sq_tries < STUB_MAX_TRIES) {
+			stub_query_fail(q, UB_SERVFAIL);
+			return;
+		}
+		stub_resolver_failure(q, 0);
+	}
+
+	if (stub_parse_answer(q->sq_name, q->sq_qtype, pkt, len,
+	    &stub_result) == -1) {
+		log_warn("%s: malformed answer for %s from %s", __func__,
+		    q->sq_name, res->sr_name);
+		stub_query_fail(q, UB_SERVFAIL);
+		return;
+	}
+
+	if (rcode == DNS_RCODE_NOERROR || rcode == DNS_RCODE_NXDOMAIN)
+		stub_resolver_success(q);
+	stub_query_done(q, 0, &stub_result);
+}
+
+/*
+ * Compare the question section of an answer with the one of our query. The
+ * query ends with the OPT record, the question is everything before that.
+ */
+int
+stub_question_cmp(struct stub_query *q, const uint8_t *pkt, size_t len)
+{
+	size_t		 i, qlen = q->sq_pktlen - 11;
+
+	if (len < qlen || pkt[4] != 0 || pkt[5] != 1)
+		return (-1);
+
+	for (i = DNS_HEADER_SIZE; i < qlen; i++) {
+		if (tolower(pkt[i]) != tolower(q->sq_pkt[i]))
+			return (-1);
+	}
+
+	return (0);
+}
+
+void
+stub_timeout_cb(int fd, short event, void *arg)
+{
+	struct stub_query	*q = arg;
+	struct stub_conn	*c = q->sq_conn;
+
+	/* the resolvers are not to blame if there was no connection at all */
+	if (q->sq_waiting) {
+		log_debug("%s: no connection for query %s (%d)", __func__,
+		    q->sq_name, q->sq_qtype);
+		stub_query_done(q, UB_SOCKET, NULL);
+		return;
+	}
+
+	log_debug("%s: query %s (%d) to %s timed out", __func__, q->sq_name,
+	    q->sq_qtype, stub_resolvers[q->sq_resolver].sr_name);
+
+	/*
+	 * A connection that did not send anything since this query, the
+	 * oldest one on it, was written is considered dead.
+	 */
+	if (c != NULL && (c->dc_state != STUB_CONN_READY ||
+	    c->dc_last_read < q->sq_sent)) {
+		stub_dot_close(c, 1);
+		return;
+	}
+
+	stub_resolver_failure(q, 1);
+	stub_query_retry(q, UB_SERVFAIL);
+}
+
+void
+stub_tcp_start(struct stub_query *q)
+{
+	struct stub_resolver	*res = &stub_resolvers[q->sq_resolver];
+	struct timeval		 tv = { STUB_TCP_TIMEOUT, 0 };
+	int			 fd;
+
+	/* late UDP answers must no longer match this query */
+	stub_query_unlink(q);
+
+	if ((fd = socket(res->sr_ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK,
+	    0)) == -1) {
+		log_error("%s: socket", __func__);
+		stub_query_fail(q, UB_SOCKET);
+		return;
+	}
+	q->sq_tcp_fd = fd;
+
+	if (stub_outbound.ss_family == res->sr_ss.ss_family &&
+	    bind(fd, (struct sockaddr *)&stub_outbound,
+	    stub_outboundlen) == -1) {
+		log_error("%s: bind", __func__);
+		stub_query_fail(q, UB_SOCKET);
+		return;
+	}
+
+	if (connect(fd, (struct sockaddr *)&res->sr_ss, res->sr_sslen) == -1 &&
+	    errno != EINPROGRESS) {
+		log_error("%s: connect %s", __func__, res->sr_name);
+		stub_query_fail(q, UB_SOCKET);
+		return;
+	}
+
+	if ((q->sq_tcp_buf = malloc(2 + DNS_MAX_MSGSIZE)) == NULL)
+		fatal("%s: malloc", __func__);
+
+	/* the query is sent with a two byte length prefix */
+	q->sq_tcp_buf[0] = q->sq_pktlen >> 8;
+	q->sq_tcp_buf[1] = q->sq_pktlen & 0xff;
+	memcpy(q->sq_tcp_buf + 2, q->sq_pkt, q->sq_pktlen);
+	q->sq_tcp_len = 2 + q->sq_pktlen;
+	q->sq_tcp_off = 0;
+	q->sq_tcp_state = STUB_TCP_CONNECT;
+
+	event_set(&q->sq_tcp_ev, fd, EV_WRITE, stub_tcp_cb, q);
+	event_add(&q->sq_tcp_ev, NULL);
+	evtimer_add(&q->sq_timer, &tv);
+}
+
+void
+stub_tcp_close(struct stub_query *q)
+{
+	if (q->sq_tcp_fd != -1) {
+		if (q->sq_tcp_state != STUB_TCP_NONE)
+			event_del(&q->sq_tcp_ev);
+		close(q->sq_tcp_fd);
+		q->sq_tcp_fd = -1;
+	}
+	free(q->sq_tcp_buf);
+	q->sq_tcp_buf = NULL;
+	q->sq_tcp_state = STUB_TCP_NONE;
+}
+
+void
+stub_tcp_cb(int fd, short event, void *arg)
+{
+	struct stub_query	*q = arg;
+	ssize_t			 n;
+	size_t			 len;
+	int			 error;
+	socklen_t		 errlen = sizeof(error);
+
+	switch (q->sq_tcp_state) {
+	case STUB_TCP_CONNECT:
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error,
+		    &errlen) == -1 || error != 0) {
+			log_debug("%s: connect to %s failed", __func__,
+			    stub_resolvers[q->sq_resolver].sr_name);
+			stub_query_fail(q, UB_SOCKET);
+			return;
+		}
+		q->sq_tcp_state = STUB_TCP_WRITE;
+		/* FALLTHROUGH */
+	case STUB_TCP_WRITE:
+		n = write(fd, q->sq_tcp_buf + q->sq_tcp_off,
+		    q->sq_tcp_len - q->sq_tcp_off);
+		if (n == -1 && errno != EAGAIN && errno != EINTR) {
+			stub_query_fail(q, UB_SOCKET);
+			return;
+		}
+		if (n > 0)
+			q->sq_tcp_off += n;
+		if (q->sq_tcp_off < q->sq_tcp_len) {
+			event_set(&q->sq_tcp_ev, fd, EV_WRITE, stub_tcp_cb, q);
+			event_add(&q->sq_tcp_ev, NULL);
+			return;
+		}
+		q->sq_tcp_state = STUB_TCP_READ;
+		q->sq_tcp_off = 0;
+		q->sq_tcp_len = 2;
+		break;
+	case STUB_TCP_READ:
+		n = read(fd, q->sq_tcp_buf + q->sq_tcp_off,
+		    q->sq_tcp_len - q->sq_tcp_off);
+		if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+			stub_query_fail(q, UB_SOCKET);
+			return;
+		}
+		if (n > 0)
+			q->sq_tcp_off += n;
+		if (q->sq_tcp_off == 2 && q->sq_tcp_len == 2) {
+			len = (q->sq_tcp_buf[0] << 8) | q->sq_tcp_buf[1];
+			if (len < DNS_HEADER_SIZE) {
+				stub_query_fail(q, UB_SERVFAIL);
+				return;
+			}
+			q->sq_tcp_len = 2 + len;
+		}
+		if (q->sq_tcp_off == q->sq_tcp_len) {
+			if (memcmp(q->sq_tcp_buf + 2, q->sq_pkt, 2) != 0) {
+				stub_query_fail(q, UB_SERVFAIL);
+				return;
+			}
+			stub_query_answer(q, q->sq_tcp_buf + 2,
+			    q->sq_tcp_len - 2, 0);
+			return;
+		}
+		break;
+	case STUB_TCP_NONE:
+		return;
+	}
+
+	event_set(&q->sq_tcp_ev, fd, EV_READ, stub_tcp_cb, q);
+	event_add(&q->sq_tcp_ev, NULL);
+}
+
+void
+stub_dot_send(struct stub_query *q)
+{
+	struct stub_conn	*c = q->sq_conn;
+	struct timeval		 tv = { STUB_TCP_TIMEOUT, 0 };
+	uint8_t			*p;
+	size_t			 need;
+
+	/* append the query with its length prefix to the write buffer */
+	need = c->dc_wlen + 2 + q->sq_pktlen;
+	if (need > c->dc_wsize) {
+		if ((p = realloc(c->dc_wbuf, need)) == NULL)
+			fatal("%s: realloc", __func__);
+		c->dc_wbuf = p;
+		c->dc_wsize = need;
+	}
+	p = c->dc_wbuf + c->dc_wlen;
+	p[0] = q->sq_pktlen >> 8;
+	p[1] = q->sq_pktlen & 0xff;
+	memcpy(p + 2, q->sq_pkt, q->sq_pktlen);
+	c->dc_wlen = need;
+
+	if (c->dc_state == STUB_CONN_READY)
+		stub_dot_update(c);
+
+	evtimer_add(&q->sq_timer, &tv);
+}
+
+/*
+ * Use the least loaded established connection. Another connection is opened
+ * when all of them have too many queries in flight.
+ */
+struct stub_conn *
+stub_dot_conn_get(struct stub_resolver *res)
+{
+	struct stub_conn	*c, *best = NULL;
+	time_t			 now;
+	int			 i;
+
+	for (i = 0; i < STUB_DOT_CONNS; i++) {
+		c = &res->sr_conns[i];
+		if (c->dc_state == STUB_CONN_READY &&
+		    (best == NULL || c->dc_inflight < best->dc_inflight))
+			best = c;
+	}
+	if (best != NULL && best->dc_inflight < STUB_DOT_PIPELINE)
+		return (best);
+
+	/* queries are written once the handshake is done */
+	for (i = 0; i < STUB_DOT_CONNS; i++) {
+		c = &res->sr_conns[i];
+		if (c->dc_state == STUB_CONN_CONNECT ||
+		    c->dc_state == STUB_CONN_HANDSHAKE)
+			return (c);
+	}
+
+	now = stub_now();
+	for (i = 0; i < STUB_DOT_CONNS; i++) {
+		c = &res->sr_conns[i];
+		if (c->dc_state == STUB_CONN_CLOSED &&
+		    c->dc_next_connect <= now && stub_dot_connect(c) == 0)
+			return (c);
+	}
+
+	return (best);
+}
+
+int
+stub_dot_connect(struct stub_conn *c)
+{
+	struct stub_resolver	*res = c->dc_res;
+
+	if ((c->dc_fd = socket(res->sr_ss.ss_family,
+	    SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+		log_error("%s: socket", __func__);
+		return (-1);
+	}
+
+	if (stub_outbound.ss_family == res->sr_ss.ss_family &&
+	    bind(c->dc_fd, (struct sockaddr *)&stub_outbound,
+	    stub_outboundlen) == -1) {
+		log_error("%s: bind", __func__);
+		stub_dot_close(c, 1);
+		return (-1);
+	}
+
+	if (connect(c->dc_fd, (struct sockaddr *)&res->sr_ss,
+	    res->sr_sslen) == -1 && errno != EINPROGRESS) {
+		log_error("%s: connect %s", __func__, res->sr_name);
+		stub_dot_close(c, 1);
+		return (-1);
+	}
+
+	if (c->dc_rbuf == NULL &&
+	    (c->dc_rbuf = malloc(2 + DNS_MAX_MSGSIZE)) == NULL)
+		fatal("%s: malloc", __func__);
+
+	log_debug("%s: connecting to %s", __func__, res->sr_name);
+
+	c->dc_state = STUB_CONN_CONNECT;
+	event_set(&c->dc_ev, c->dc_fd, EV_WRITE, stub_dot_cb, c);
+	event_add(&c->dc_ev, NULL);
+
+	return (0);
+}
+
+/*
+ * Close the connection and send the queries that were still in flight again.
+ * After a failure the connection is not used for an increasing time.
+ */
+void
+stub_dot_close(struct stub_conn *c, int failed)
+{
+	struct stub_queue	 retry = TAILQ_HEAD_INITIALIZER(retry);
+	struct stub_query	*q, *tmp, *oldest = NULL;
+	int			 backoff;
+
+	if (c->dc_tls != NULL) {
+		tls_close(c->dc_tls);
+		tls_free(c->dc_tls);
+		c->dc_tls = NULL;
+	}
+	if (c->dc_fd != -1) {
+		if (c->dc_state != STUB_CONN_CLOSED)
+			event_del(&c->dc_ev);
+		close(c->dc_fd);
+		c->dc_fd = -1;
+	}
+	c->dc_state = STUB_CONN_CLOSED;
+	c->dc_want = 0;
+	c->dc_wlen = 0;
+	c->dc_rlen = 0;
+
+	if (failed) {
+		backoff = 1 << MINIMUM(c->dc_failures, 6);
+		backoff = MINIMUM(backoff, STUB_DOT_BACKOFF_MAX);
+		c->dc_failures++;
+		c->dc_next_connect = stub_now() + backoff;
+		log_info("%s: connection to %s failed, retry in %d seconds",
+		    __func__, c->dc_res->sr_name, backoff);
+	}
+
+	/* DNS-over-TLS queries are never on the UDP send queue */
+	RB_FOREACH_SAFE(q, stub_queries, &stub_queries, tmp) {
+		if (q->sq_conn != c)
+			continue;
+		stub_query_unlink(q);
+		TAILQ_INSERT_TAIL(&retry, q, sq_entry);
+		if (oldest == NULL || q->sq_sent < oldest->sq_sent)
+			oldest = q;
+	}
+
+	/* a failed connection counts once for the resolver, not per query */
+	if (failed && oldest != NULL)
+		stub_resolver_failure(oldest, 0);
+
+	TAILQ_FOREACH_SAFE(q, &retry, sq_entry, tmp) {
+		TAILQ_REMOVE(&retry, q, sq_entry);
+		evtimer_del(&q->sq_timer);
+		stub_query_retry(q, UB_SOCKET);
+	}
+}
+
+void
+stub_dot_cb(int fd, short event, void *arg)
+{
+	struct stub_conn	*c = arg;
+	struct stub_resolver	*res = c->dc_res;
+	int			 error, ret;
+	socklen_t		 errlen = sizeof(error);
+
+	switch (c->dc_state) {
+	case STUB_CONN_CONNECT:
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error,
+		    &errlen) == -1 || error != 0) {
+			log_debug("%s: connect to %s failed", __func__,
+			    res->sr_name);
+			stub_dot_close(c, 1);
+			return;
+		}
+		if ((c->dc_tls = tls_client()) == NULL)
+			fatal("%s: tls_client", __func__);
+		if (tls_configure(c->dc_tls, res->sr_tls_config) == -1 ||
+		    tls_connect_socket(c->dc_tls, fd, res->sr_auth_name[0] ?
+		    res->sr_auth_name : NULL) == -1) {
+			log_warn("%s: %s: %s", __func__, res->sr_name,
+			    tls_error(c->dc_tls));
+			stub_dot_close(c, 1);
+			return;
+		}
+		c->dc_state = STUB_CONN_HANDSHAKE;
+		/* FALLTHROUGH */
+	case STUB_CONN_HANDSHAKE:
+		ret = tls_handshake(c->dc_tls);
+		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
+			event_set(&c->dc_ev, fd, ret == TLS_WANT_POLLIN ?
+			    EV_READ : EV_WRITE, stub_dot_cb, c);
+			event_add(&c->dc_ev, NULL);
+			return;
+		}
+		if (ret == -1) {
+			log_warn("%s: handshake with %s failed: %s", __func__,
+			    res->sr_name, tls_error(c->dc_tls));
+			stub_dot_close(c, 1);
+			return;
+		}
+		log_debug("%s: connected to %s, session %s", __func__,
+		    res->sr_name, tls_conn_session_resumed(c->dc_tls) ?
+		    "resumed" : "new");
+		c->dc_state = STUB_CONN_READY;
+		c->dc_failures = 0;
+		c->dc_last_read = stub_msec();
+		break;
+	case STUB_CONN_READY:
+		if (stub_dot_io(c) == -1)
+			return;
+		break;
+	case STUB_CONN_CLOSED:
+		return;
+	}
+
+	stub_dot_update(c);
+}
+
+/*
+ * Write the pending queries and handle all complete answers. Returns -1 if
+ * the connection has been closed.
+ */
+int
+stub_dot_io(struct stub_conn *c)
+{
+	struct stub_resolver	*res = c->dc_res;
+	struct stub_query	*q, key;
+	ssize_t			 n;
+	size_t			 len, off;
+
+	c->dc_want = 0;
+
+	while (c->dc_wlen > 0) {
+		n = tls_write(c->dc_tls, c->dc_wbuf, c->dc_wlen);
+		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
+			break;
+		if (n == -1) {
+			log_warn("%s: write to %s: %s", __func__,
+			    res->sr_name, tls_error(c->dc_tls));
+			stub_dot_close(c, 1);
+			return (-1);
+		}
+		memmove(c->dc_wbuf, c->dc_wbuf + n, c->dc_wlen - n);
+		c->dc_wlen -= n;
+	}
+
+	/* libtls may have buffered more than one record, read until empty */
+	for (;;) {
+		n = tls_read(c->dc_tls, c->dc_rbuf + c->dc_rlen,
+		    2 + DNS_MAX_MSGSIZE - c->dc_rlen);
+		if (n == TLS_WANT_POLLIN)
+			break;
+		if (n == TLS_WANT_POLLOUT) {
+			c->dc_want = EV_WRITE;
+			break;
+		}
+		if (n == -1) {
+			log_warn("%s: read from %s: %s", __func__,
+			    res->sr_name, tls_error(c->dc_tls));
+			stub_dot_close(c, 1);
+			return (-1);
+		}
+		if (n == 0) {
+			log_debug("%s: connection closed by %s", __func__,
+			    res->sr_name);
+			stub_dot_close(c, 0);
+			return (-1);
+		}
+		c->dc_rlen += n;
+		c->dc_last_read = stub_msec();
+
+		/* answers may arrive in any order */
+		off = 0;
+		while (c->dc_rlen - off >= 2) {
+			len = (c->dc_rbuf[off] << 8) | c->dc_rbuf[off + 1];
+			if (c->dc_rlen - off < 2 + len)
+				break;
+			off += 2;
+			if (len >= DNS_HEADER_SIZE) {
+				key.sq_sock = NULL;
+				key.sq_conn = c;
+				key.sq_id = (c->dc_rbuf[off] << 8) |
+				    c->dc_rbuf[off + 1];
+				if ((q = RB_FIND(stub_queries, &stub_queries,
+				    &key)) != NULL)
+					stub_query_answer(q, c->dc_rbuf + off,
+					    len, 0);
+				else
+					log_debug("%s: no query for id %u",
+					    __func__, key.sq_id);
+			}
+			off += len;
+		}
+		memmove(c->dc_rbuf, c->dc_rbuf + off, c->dc_rlen - off);
+		c->dc_rlen -= off;
+	}
+
+	return (0);
+}
+
+void
+stub_dot_update(struct stub_conn *c)
+{
+	short		 events = EV_READ;
+
+	if (c->dc_wlen > 0 || (c->dc_want & EV_WRITE))
+		events |= EV_WRITE;
+
+	event_del(&c->dc_ev);
+	event_set(&c->dc_ev, c->dc_fd, events, stub_dot_cb, c);
+	event_add(&c->dc_ev, NULL);
+}
+
+time_t
+stub_now(void)
+{
+	struct timespec		 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("%s: clock_gettime", __func__);
+
+	return (ts.tv_sec);
+}
+
+uint64_t
+stub_msec(void)
+{
+	struct timespec		 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("%s: clock_gettime", __func__);
+
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Choose the resolver for the next attempt of a query. A resolver that is due
+ * for a probe is taken first. Otherwise one of the resolvers whose smoothed
+ * RTT is close to the best one is picked, with an occasional random choice so
+ * that the RTT of the others stays current. If all resolvers are down, the
+ * one that comes back first is used anyway.
+ */
+void
+stub_resolver_select(struct stub_query *q, int exclude)
+{
+	struct stub_resolver	*res;
+	time_t			 now = stub_now();
+	uint32_t		 best = UINT32_MAX;
+	int			 i, n = 0, pick = -1, up = 0;
+
+	if (stub_num_resolvers == 1)
+		exclude = -1;
+
+	for (i = 0; i < stub_num_resolvers; i++) {
+		res = &stub_resolvers[i];
+		if (i == exclude)
+			continue;
+		if (res->sr_state == RESOLVER_DOWN &&
+		    res->sr_down_until <= now) {
+			log_debug("%s: probing resolver %s", __func__,
+			    res->sr_name);
+			res->sr_state = RESOLVER_PROBE;
+			q->sq_resolver = i;
+			q->sq_probe = 1;
+			return;
+		}
+		if (res->sr_state != RESOLVER_UP)
+			continue;
+		up++;
+		best = MINIMUM(best, res->sr_srtt);
+	}
+
+	if (up > 1 && arc4random_uniform(STUB_EXPLORE) == 0)
+		best = UINT32_MAX - STUB_RTT_BAND_MSEC;
+
+	for (i = 0; i < stub_num_resolvers; i++) {
+		res = &stub_resolvers[i];
+		if (i == exclude || res->sr_state != RESOLVER_UP ||
+		    res->sr_srtt > best + STUB_RTT_BAND_MSEC)
+			continue;
+		if (arc4random_uniform(++n) == 0)
+			pick = i;
+	}
+
+	if (pick == -1) {
+		for (i = 0; i < stub_num_resolvers; i++) {
+			res = &stub_resolvers[i];
+			if (pick == -1 || res->sr_down_until <
+			    stub_resolvers[pick].sr_down_until)
+				pick = i;
+		}
+	}
+
+	q->sq_resolver = pick;
+}
+
+void
+stub_resolver_success(struct stub_query *q)
+{
+	struct stub_resolver	*res = &stub_resolvers[q->sq_resolver];
+	uint64_t		 rtt;
+	int			 i;
+
+	rtt = stub_msec() - q->sq_sent;
+	stub_resolver_rtt(res, rtt);
+
+	/* log2 histogram of the latency in milliseconds */
+	for (i = 0; i < STUB_HIST_BUCKETS - 1 && rtt >= (2ULL << i); i++)
+		;
+	res->sr_hist[i]++;
+	if (++res->sr_hist_total >= STUB_HIST_MAX) {
+		res->sr_hist_total = 0;
+		for (i = 0; i < STUB_HIST_BUCKETS; i++) {
+			res->sr_hist[i] /= 2;
+			res->sr_hist_total += res->sr_hist[i];
+		}
+	}
+
+	res->sr_answers++;
+	res->sr_consec_fail = 0;
+	res->sr_down_count = 0;
+	if (res->sr_state != RESOLVER_UP) {
+		log_info("%s: resolver %s is up again", __func__, res->sr_name);
+		res->sr_state = RESOLVER_UP;
+	}
+	q->sq_probe = 0;
+}
+
+void
+stub_resolver_failure(struct stub_query *q, int timeout)
+{
+	struct stub_resolver	*res = &stub_resolvers[q->sq_resolver];
+
+	res->sr_failures++;
+	if (timeout) {
+		res->sr_timeouts++;
+		stub_resolver_rtt(res, stub_msec() - q->sq_sent);
+	}
+	res->sr_consec_fail++;
+
+	if (res->sr_state == RESOLVER_PROBE || (res->sr_state == RESOLVER_UP &&
+	    res->sr_consec_fail >= STUB_FAIL_THRESHOLD))
+		stub_resolver_down(res);
+	q->sq_probe = 0;
+}
+
+void
+stub_resolver_down(struct stub_resolver *res)
+{
+	int			 secs;
+
+	secs = STUB_DOWN_MIN << MINIMUM(res->sr_down_count, 6);
+	secs = MINIMUM(secs, STUB_DOWN_MAX);
+	res->sr_down_count++;
+	res->sr_down_until = stub_now() + secs;
+	res->sr_state = RESOLVER_DOWN;
+
+	log_info("%s: resolver %s is down for %d seconds after %d failures",
+	    __func__, res->sr_name, secs, res->sr_consec_fail);
+}
+
+void
+stub_resolver_rtt(struct stub_resolver *res, uint64_t rtt)
+{
+	rtt = MINIMUM(rtt, UINT32_MAX / 8);
+	if (rtt == 0)
+		rtt = 1;
+
+	if (res->sr_srtt == 0)
+		res->sr_srtt = rtt;
+	else
+		res->sr_srtt = (7 * (uint64_t)res->sr_srtt + rtt) / 8;
+}
+
+/*
+ * Return the upper bound of the histogram bucket that contains the 95th
+ * percentile or 0 if there are not enough samples yet.
+ */
+uint32_t
+stub_resolver_p95(struct stub_resolver *res)
+{
+	uint32_t		 sum = 0;
+	int			 i;
+
+	if (res->sr_hist_total < STUB_HEDGE_MIN_SAMPLES)
+		return (0);
+
+	for (i = 0; i < STUB_HIST_BUCKETS; i++) {
+		sum += res->sr_hist[i];
+		if ((uint64_t)sum * 100 >= (uint64_t)res->sr_hist_total * 95)
+			return (2U << i);
+	}
+
+	return (0);
+}
+
+void
+stub_show_resolvers(struct pfresolved *env, uint32_t peerid)
+{
+	struct stub_resolver	*res;
+	struct ctl_resolver	 cr;
+	time_t			 now = stub_now();
+	int			 i;
+
+	for (i = 0; i < stub_num_resolvers; i++) {
+		res = &stub_resolvers[i];
+
+		bzero(&cr, sizeof(cr));
+		strlcpy(cr.cr_name, res->sr_name, sizeof(cr.cr_name));
+		cr.cr_state = res->sr_state;
+		cr.cr_srtt = res->sr_srtt;
+		cr.cr_p95 = stub_resolver_p95(res);
+		if (res->sr_state == RESOLVER_DOWN && res->sr_down_until > now)
+			cr.cr_down = res->sr_down_until - now;
+		cr.cr_queries = res->sr_queries;
+		cr.cr_answers = res->sr_answers;
+		cr.cr_failures = res->sr_failures;
+		cr.cr_timeouts = res->sr_timeouts;
+		cr.cr_hedges = res->sr_hedges;
+
+		proc_compose_imsg(&env->sc_ps, PROC_PARENT, -1,
+		    IMSG_CTL_SHOW_RESOLVERS, peerid, -1, &cr, sizeof(cr));
+	}
+}
+
+/*
+ * Read a possibly compressed domain name starting at offset off and write it
+ * in lower case presentation format with a trailing dot into buf. Returns the
+ * offset of the first byte after the name or -1 if the name is malformed.
+ */
+int
+stub_read_name(const uint8_t *pkt, size_t len, size_t off, char *buf,
+    size_t buflen)
+{
+	size_t		 pos = 0, i;
+	int		 next = -1, jumps = 0;
+	uint8_t		 label;
+
+	for (;;) {
+		if (off >= len)
+			return (-1);
+		label = pkt[off];
+
+		if ((label & 0xc0) == 0xc0) {
+			if (off + 1 >= len || ++jumps > 64)
+				return (-1);
+			if (next == -1)
+				next = off + 2;
+			off = ((label & 0x3f) << 8) | pkt[off + 1];
+			continue;
+		}
+		if (label & 0xc0)
+			return (-1);
+
+		off++;
+		if (label == 0)
+			break;
+
+		if (off + label > len || pos + label + 2 > buflen)
+			return (-1);
+		for (i = 0; i < label; i++)
+			buf[pos++] = tolower((unsigned char)pkt[off + i]);
+		buf[pos++] = '.';
+		off += label;
+	}
+
+	if (pos == 0) {
+		if (buflen < 2)
+			return (-1);
+		buf[pos++] = '.';
+	}
+	buf[pos] = '\0';
+
+	return (next == -1 ? (int)off : next);
+}
+
+int
+stub_read_rr(const uint8_t *pkt, size_t len, size_t *off, char *owner,
+    size_t ownerlen, uint16_t *type, uint32_t *ttl, size_t *rdata,
+    uint16_t *rdlen)
+{
+	int		 n;
+	size_t		 pos;
+
+	if ((n = stub_read_name(pkt, len, *off, owner, ownerlen)) == -1)
+		return (-1);
+	pos = n;
+	if (pos + 10 > len)
+		return (-1);
+
+	*type = (pkt[pos] << 8) | pkt[pos + 1];
+	*ttl = ((uint32_t)pkt[pos + 4] << 24) | (pkt[pos + 5] << 16) |
+	    (pkt[pos + 6] << 8) | pkt[pos + 7];
+	*rdlen = (pkt[pos + 8] << 8) | pkt[pos + 9];
+	*rdata = pos + 10;
+	*off = *rdata + *rdlen;
+
+	return (*off > len ? -1 : 0);
+}
+
+/*
+ * Parse an answer to an A or AAAA query into a result like the one libunbound
+ * returns. The data of the result points into the packet and is only valid
+ * until the next call.
+ */
+int
+stub_parse_answer(char *qname, int qtype, uint8_t *pkt, size_t len,
+    struct ub_result *result)
+{
+	char		 owner[HOST_NAME_MAX + 2], target[HOST_NAME_MAX + 2];
+	char		 name[HOST_NAME_MAX + 2];
+	uint16_t	 qdcount, ancount, nscount, type, rdlen;
+	uint32_t	 ttl, minttl = UINT32_MAX, negttl = UINT32_MAX;
+	size_t		 off, answers, rdata;
+	int		 i, n, num = 0, total = 0, rcode;
+
+	if (len < DNS_HEADER_SIZE)
+		return (-1);
+
+	stub_normalize_name(qname, name);
+
+	qdcount = (pkt[4] << 8) | pkt[5];
+	ancount = (pkt[6] << 8) | pkt[7];
+	nscount = (pkt[8] << 8) | pkt[9];
+	rcode = pkt[3] & DNS_RCODE_MASK;
+
+	if (qdcount != 1)
+		return (-1);
+
+	if ((n = stub_read_name(pkt, len, DNS_HEADER_SIZE, owner,
+	    sizeof(owner))) == -1)
+		return (-1);
+	answers = n + 4;
+	if (answers > len)
+		return (-1);
+
+	strlcpy(target, name, sizeof(target));
+	if (stub_follow_cname(pkt, len, answers, ancount, target,
+	    sizeof(target), &minttl) == -1)
+		return (-1);
+
+	/* collect the addresses of the final target */
+	off = answers;
+	for (i = 0; i < ancount; i++) {
+		if (stub_read_rr(pkt, len, &off, owner, sizeof(owner),
+		    &type, &ttl, &rdata, &rdlen) == -1)
+			return (-1);
+		if (type != qtype || strcmp(owner, target) != 0)
+			continue;
+		if (total++ >= STUB_MAX_RR)
+			continue;
+		stub_data[num] = (char *)pkt + rdata;
+		stub_len[num] = rdlen;
+		minttl = MINIMUM(minttl, ttl);
+		num++;
+	}
+	stub_data[num] = NULL;
+	if (total > num)
+		log_warn("%s: answer for %s has %d records, using the first %d",
+		    __func__, qname, total, num);
+
+	/* negative answers are cached for the minimum of the SOA */
+	for (i = 0; i < nscount; i++) {
+		if (stub_read_rr(pkt, len, &off, owner, sizeof(owner),
+		    &type, &ttl, &rdata, &rdlen) == -1)
+			return (-1);
+		if (type != DNS_RR_TYPE_SOA || rdlen < 22)
+			continue;
+		negttl = ((uint32_t)pkt[off - 4] << 24) |
+		    (pkt[off - 3] << 16) | (pkt[off - 2] << 8) | pkt[off - 1];
+		negttl = MINIMUM(negttl, ttl);
+	}
+
+	bzero(result, sizeof(*result));
+	result->answer_packet = pkt;
+	result->answer_len = len;
+	result->qname = qname;
+	result->qtype = qtype;
+	result->qclass = DNS_CLASS_IN;
+	result->data = stub_data;
+	result->len = stub_len;
+	result->rcode = rcode;
+	result->havedata = num > 0;
+	result->nxdomain = rcode == DNS_RCODE_NXDOMAIN;
+	if (strcmp(target, name) != 0) {
+		strlcpy(stub_canonname, target, sizeof(stub_canonname));
+		result->canonname = stub_canonname;
+	}
+	if (num == 0)
+		minttl = MINIMUM(minttl, negttl);
+	result->ttl = minttl == UINT32_MAX ? 0 : MINIMUM(minttl, INT32_MAX);
+
+	return (0);
+}
+
+/*
+ * Return the lowest TTL of the CNAME chain that starts at the queried name,
+ * or -1 if the name is not an alias.
+ */
+int
+stub_cname_ttl(const char *qname, uint8_t *pkt, size_t len)
+{
+	char		 owner[HOST_NAME_MAX + 2], target[HOST_NAME_MAX + 2];
+	char		 name[HOST_NAME_MAX + 2];
+	uint16_t	 qdcount, ancount;
+	uint32_t	 ttl = UINT32_MAX;
+	int		 n;
+
+	if (len < DNS_HEADER_SIZE)
+		return (-1);
+
+	stub_normalize_name(qname, name);
+
+	qdcount = (pkt[4] << 8) | pkt[5];
+	ancount = (pkt[6] << 8) | pkt[7];
+	if (qdcount != 1)
+		return (-1);
+
+	if ((n = stub_read_name(pkt, len, DNS_HEADER_SIZE, owner,
+	    sizeof(owner))) == -1 || (size_t)n + 4 > len)
+		return (-1);
+
+	strlcpy(target, name, sizeof(target));
+	if (stub_follow_cname(pkt, len, n + 4, ancount, target,
+	    sizeof(target), &ttl) == -1 || ttl == UINT32_MAX)
+		return (-1);
+
+	return (MINIMUM(ttl, INT32_MAX));
+}
+
+/* compare names in lower case and with a trailing dot */
+void
+stub_normalize_name(const char *qname, char *name)
+{
+	int		 i;
+
+	for (i = 0; qname[i] != '\0' && i < HOST_NAME_MAX; i++)
+		name[i] = tolower((unsigned char)qname[i]);
+	if (i == 0 || name[i - 1] != '.')
+		name[i++] = '.';
+	name[i] = '\0';
+}
+
+/*
+ * Follow the CNAME chain from target in the answer section, so the order
+ * of the records does not matter. Target is replaced with the final name
+ * and ttl is lowered to the TTL of each CNAME on the way.
+ */
+int
+stub_follow_cname(const uint8_t *pkt, size_t len, size_t answers, int ancount,
+    char *target, size_t targetlen, uint32_t *minttl)
+{
+	char		 owner[HOST_NAME_MAX + 2];
+	uint16_t	 type, rdlen;
+	uint32_t	 ttl;
+	size_t		 off, rdata;
+	int		 i, pass, changed;
+
+	for (pass = 0; pass < STUB_MAX_CNAME; pass++) {
+		changed = 0;
+		off = answers;
+		for (i = 0; i < ancount; i++) {
+			if (stub_read_rr(pkt, len, &off, owner, sizeof(owner),
+			    &type, &ttl, &rdata, &rdlen) == -1)
+				return (-1);
+			if (type != DNS_RR_TYPE_CNAME ||
+			    strcmp(owner, target) != 0)
+				continue;
+			if (stub_read_name(pkt, len, rdata, target,
+			    targetlen) == -1)
+				return (-1);
+			*minttl = MINIMUM(*minttl, ttl);
+			changed = 1;
+			break;
+		}
+		if (!changed)
+			break;
+	}
+
+	return (0);
+}
+
+int
+stub_query_cmp(struct stub_query *a, struct stub_query *b)
+{
+	if (a->sq_sock < b->sq_sock)
+		return (-1);
+	if (a->sq_sock > b->sq_sock)
+		return (1);
+	if (a->sq_conn < b->sq_conn)
+		return (-1);
+	if (a->sq_conn > b->sq_conn)
+		return (1);
+	return (a->sq_id - b->sq_id);
+}
+
+RB_GENERATE(stub_queries, stub_query, sq_node, stub_query_cmp);
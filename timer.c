@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <ctype.h>
@@ -51,6 +52,10 @@ timer_add(struct pfresolved *env, struct pfresolved_timer *tmr, int timeout)
 {
 	struct timeval		 tv = { timeout };
 
+	/* remember when the timer is due to measure how late it fires */
+	clock_gettime(CLOCK_MONOTONIC, &tmr->tmr_deadline);
+	tmr->tmr_deadline.tv_sec += timeout;
+
 	evtimer_add(&tmr->tmr_ev, &tv);
 }
 
@@ -62,11 +67,34 @@ timer_del(struct pfresolved *env, struct pfresolved_timer *tmr)
 		evtimer_del(&tmr->tmr_ev);
 }
 
+/* seconds until the timer fires, -1 if it is not scheduled */
+int
+timer_remaining(struct pfresolved_timer *tmr)
+{
+	struct timespec		 now, left;
+
+	if (tmr->tmr_cb == NULL || !evtimer_initialized(&tmr->tmr_ev) ||
+	    !evtimer_pending(&tmr->tmr_ev, NULL))
+		return (-1);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespeccmp(&tmr->tmr_deadline, &now, <))
+		return (0);
+	timespecsub(&tmr->tmr_deadline, &now, &left);
+
+	return (left.tv_sec);
+}
+
 void
 timer_callback(int fd, short event, void *arg)
 {
 	struct pfresolved_timer		*tmr = arg;
 
+	/* the callback knows the host and traces the delay itself */
+	tmr->tmr_late = stats_elapsed(&tmr->tmr_deadline);
+	stats_histogram_add(&tmr->tmr_env->sc_stats.st_stages[STAGE_TIMER],
+	    tmr->tmr_late);
+
 	if (tmr->tmr_cb)
 		tmr->tmr_cb(tmr->tmr_env, tmr->tmr_cbarg);
 }
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2024 genua GmbH
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "pfresolved.h"
+
+/*
+ * The processes are single threaded, recording an event only fills the next
+ * slot of the ring and overwrites the oldest one. Nothing is allocated and
+ * no lock is needed. Hosts are identified by their name, truncated to fit
+ * into the fixed size event.
+ */
+
+#define TRACE_PER_IMSG	((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / \
+	sizeof(struct trace_event))
+
+static struct trace_event	 trace_ring[TRACE_EVENTS];
+static uint64_t			 trace_next;
+
+void
+trace_add(enum trace_type type, sa_family_t af, const char *name,
+    int64_t value)
+{
+	struct trace_event	*te;
+	struct timespec		 now;
+
+	te = &trace_ring[trace_next++ & (TRACE_EVENTS - 1)];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	te->te_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	te->te_value = value;
+	te->te_type = type;
+	te->te_proc = privsep_process;
+	te->te_af = af;
+	if (name != NULL)
+		strlcpy(te->te_name, name, sizeof(te->te_name));
+	else
+		te->te_name[0] = '\0';
+}
+
+/* send the events from the oldest to the newest */
+void
+trace_send(struct pfresolved *env, enum privsep_procid id, uint32_t peerid)
+{
+	uint64_t		 first, i;
+	size_t			 num;
+
+	first = trace_next > TRACE_EVENTS ? trace_next - TRACE_EVENTS : 0;
+
+	for (i = first; i < trace_next; i += num) {
+		num = trace_next - i;
+		if (num > TRACE_PER_IMSG)
+			num = TRACE_PER_IMSG;
+		/* a chunk must not wrap around the end of the ring */
+		if (num > TRACE_EVENTS - (i & (TRACE_EVENTS - 1)))
+			num = TRACE_EVENTS - (i & (TRACE_EVENTS - 1));
+		proc_compose_imsg(&env->sc_ps, id, -1, IMSG_CTL_TRACE, peerid,
+		    -1, &trace_ring[i & (TRACE_EVENTS - 1)],
+		    num * sizeof(*trace_ring));
+	}
+}
+
+/*
+ * Called from the fatal signal handler. Like the other messages there, this
+ * is not async signal safe, but the process is dying anyway.
+ */
+void
+trace_log(void)
+{
+	static const char	*types[] = {
+		"timer", "request", "answer", "result", "diff", "commit",
+		"error"
+	};
+	struct trace_event	*te;
+	uint64_t		 i, first;
+
+	first = trace_next > TRACE_LOG_EVENTS ? trace_next - TRACE_LOG_EVENTS :
+	    0;
+	for (i = first; i < trace_next; i++) {
+		te = &trace_ring[i & (TRACE_EVENTS - 1)];
+		log_info("%s: %llu.%06llu %s %s %s %lld", __func__,
+		    (unsigned long long)(te->te_usec / 1000000),
+		    (unsigned long long)(te->te_usec % 1000000),
+		    te->te_type < nitems(types) ? types[te->te_type] : "?",
+		    te->te_af == AF_INET ? "A" : te->te_af == AF_INET6 ?
+		    "AAAA" : "-", te->te_name[0] ? te->te_name : "-",
+		    (long long)te->te_value);
+	}
+}
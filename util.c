@@ -17,9 +17,11 @@
 #include <arpa/inet.h>
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "pfresolved.h"
 
@@ -94,3 +96,103 @@ appendf(char **str, char *fmt, ...)
 
 	va_end(ap);
 }
+
+/*
+ * The words of a table set, the inline words are used until a table number
+ * does not fit.
+ */
+static const uint32_t *
+tableset_words(const struct pfresolved_tableset *set, int *nwords)
+{
+	if (set->pfts_words == NULL) {
+		*nwords = TABLESET_INLINE / TABLESET_BITS;
+		return (set->pfts_inline);
+	}
+	*nwords = set->pfts_nwords;
+	return (set->pfts_words);
+}
+
+void
+tableset_add(struct pfresolved_tableset *set, int index)
+{
+	int		 nwords;
+
+	if (set->pfts_words == NULL && index < TABLESET_INLINE) {
+		set->pfts_inline[index / TABLESET_BITS] |=
+		    1U << (index % TABLESET_BITS);
+		return;
+	}
+
+	if (index / TABLESET_BITS >= set->pfts_nwords) {
+		nwords = index / TABLESET_BITS + 1;
+		if ((set->pfts_words = recallocarray(set->pfts_words,
+		    set->pfts_nwords, nwords, sizeof(*set->pfts_words))) ==
+		    NULL)
+			fatal("%s: recallocarray", __func__);
+		if (set->pfts_nwords == 0)
+			memcpy(set->pfts_words, set->pfts_inline,
+			    sizeof(set->pfts_inline));
+		set->pfts_nwords = nwords;
+	}
+
+	set->pfts_words[index / TABLESET_BITS] |=
+	    1U << (index % TABLESET_BITS);
+}
+
+void
+tableset_del(struct pfresolved_tableset *set, int index)
+{
+	uint32_t	*words;
+
+	words = set->pfts_words != NULL ? set->pfts_words : set->pfts_inline;
+	if (index / TABLESET_BITS >= (set->pfts_words != NULL ?
+	    set->pfts_nwords : TABLESET_INLINE / TABLESET_BITS))
+		return;
+
+	words[index / TABLESET_BITS] &= ~(1U << (index % TABLESET_BITS));
+}
+
+int
+tableset_isset(const struct pfresolved_tableset *set, int index)
+{
+	const uint32_t	*words;
+	int		 nwords;
+
+	words = tableset_words(set, &nwords);
+	if (index / TABLESET_BITS >= nwords)
+		return (0);
+
+	return ((words[index / TABLESET_BITS] >>
+	    (index % TABLESET_BITS)) & 1);
+}
+
+/*
+ * Return the lowest table number in the set that is not below index, -1 if
+ * there is none.
+ */
+int
+tableset_next(const struct pfresolved_tableset *set, int index)
+{
+	const uint32_t	*words;
+	uint32_t	 word;
+	int		 nwords, i;
+
+	words = tableset_words(set, &nwords);
+
+	for (i = index / TABLESET_BITS; i < nwords; i++) {
+		word = words[i];
+		if (i == index / TABLESET_BITS)
+			word &= ~0U << (index % TABLESET_BITS);
+		if (word != 0)
+			return (i * TABLESET_BITS + ffs(word) - 1);
+	}
+
+	return (-1);
+}
+
+void
+tableset_free(struct pfresolved_tableset *set)
+{
+	free(set->pfts_words);
+	memset(set, 0, sizeof(*set));
+}